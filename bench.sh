@@ -0,0 +1,255 @@
+#!/usr/bin/env bash
+# Throughput sweep of simple_rx, packet_copy and rss_scaling on virtual PMDs,
+# so runs can be compared without a NIC or traffic generator.
+#
+#   ./bench.sh > results.csv
+#
+# Needs hugepages and a DPDK install visible to pkg-config. The sweep is set
+# through the environment, e.g.
+#
+#   VARIANTS=rss_scaling VDEVS=pcap BURSTS="32 64" DURATION=5 ./bench.sh
+#
+# Every program takes burst, ring and worker counts as options and is built
+# once into $BUILD_DIR. Each run is stopped with
+# SIGINT after $DURATION seconds and its SUMMARY line becomes one CSV row.
+#
+#   null  net_null, packets of the requested size generated by the PMD
+#   pcap  net_pcap replaying a generated capture of UDP flows in a loop
+#   ring  net_ring with nothing enqueued, measures the cost of empty polls
+#
+# packet_copy also runs once per scheduler in $SCHEDS: "ring" shares
+# packet_ring between the workers, "event" schedules flows atomically on the
+# software event device (event_sw), so both compare on the same host.
+#
+#   ./bench.sh tune packet_copy -l 0-12 -- -R trace.pcap -T 10000000
+#
+# tunes one program on the traffic its own arguments give it, live ports or a
+# replay: runs of $EPOCH seconds try each of $TUNE_BURSTS, $TUNE_RX_DESCS,
+# $TUNE_RINGS and $TUNE_WORKERS (rx queues for rss_scaling, none for
+# simple_rx) in turn, keeping the best value of each before moving to the
+# next, and the options of the fastest configuration without drops are
+# printed for reuse.
+set -euo pipefail
+
+VARIANTS=${VARIANTS:-"simple_rx packet_copy rss_scaling"}
+VDEVS=${VDEVS:-"null pcap ring"}
+BURSTS=${BURSTS:-"8 32 128"}
+RING_SIZES=${RING_SIZES:-"4096 65536 1048576"}
+WORKERS=${WORKERS:-"1 2 4"}
+SCHEDS=${SCHEDS:-"ring event"}
+PKT_SIZES=${PKT_SIZES:-"64 512 1518"}
+FLOWS=${FLOWS:-256}
+DURATION=${DURATION:-10}
+EPOCH=${EPOCH:-5}
+TUNE_BURSTS=${TUNE_BURSTS:-"8 16 32 64 128"}
+TUNE_RX_DESCS=${TUNE_RX_DESCS:-"512 1024 2048 4096"}
+TUNE_RINGS=${TUNE_RINGS:-"1024 4096 16384 65536"}
+TUNE_WORKERS=${TUNE_WORKERS:-"1 2 4 8"}
+BUILD_DIR=${BUILD_DIR:-bench_build}
+CFLAGS=${CFLAGS:-"-O3 -march=native"}
+NCPU=$(nproc)
+
+mkdir -p "$BUILD_DIR"
+
+# build <variant>, prints the binary path
+build() {
+  local bin="$BUILD_DIR/$1"
+  if [ ! -x "$bin" ]; then
+    # shellcheck disable=SC2086
+    gcc "$1.c" $CFLAGS -DALLOW_EXPERIMENTAL_API \
+      $(pkg-config --cflags --libs --static libdpdk) -o "$bin" >&2
+  fi
+  echo "$bin"
+}
+
+# pcap_file <frame size>, a capture of $FLOWS UDP flows, frame size with CRC
+pcap_file() {
+  local file="$BUILD_DIR/udp_${1}_${FLOWS}.pcap"
+  [ -f "$file" ] || python3 - "$file" "$1" "$FLOWS" <<'EOF'
+import struct, sys
+path, size, flows = sys.argv[1], int(sys.argv[2]) - 4, int(sys.argv[3])
+def csum(b):
+    s = sum(struct.unpack("!%dH" % (len(b) // 2), b))
+    s = (s >> 16) + (s & 0xffff)
+    return ~(s + (s >> 16)) & 0xffff
+with open(path, "wb") as f:
+    f.write(struct.pack("<IHHiIII", 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1))
+    for i in range(flows):
+        udp_len = size - 14 - 20
+        ip = struct.pack("!BBHHHBBH4s4s", 0x45, 0, size - 14, i, 0, 64, 17, 0,
+                         bytes([10, 0, i >> 8, i & 0xff]), bytes([10, 1, 0, 1]))
+        ip = ip[:10] + struct.pack("!H", csum(ip)) + ip[12:]
+        udp = struct.pack("!HHHH", 1024 + i, 5001, udp_len, 0)
+        eth = bytes.fromhex("020000000002" "020000000001" "0800")
+        frame = eth + ip + udp + bytes(udp_len - 8)
+        f.write(struct.pack("<IIII", 0, i, len(frame), len(frame)) + frame)
+EOF
+  echo "$file"
+}
+
+# vdev_args <vdev> <packet size>
+vdev_args() {
+  case $1 in
+  null) echo "--vdev=net_null0,size=$(($2 - 4))" ;;
+  pcap) echo "--vdev=net_pcap0,rx_pcap=$(pcap_file "$2"),infinite_rx=1" ;;
+  ring) echo "--vdev=net_ring0" ;;
+  esac
+}
+
+# lcore_args <highest lcore id>, pinned 1:1 when the host has enough cpus
+lcore_args() {
+  if [ "$1" -lt "$NCPU" ]; then
+    echo "-l 0-$1"
+  else
+    echo "--lcores=(0-$1)@(0-$((NCPU - 1)))"
+  fi
+}
+
+# summary_field <SUMMARY line> <key>
+summary_field() {
+  local kv
+  for kv in $1; do
+    [ "${kv%%=*}" = "$2" ] && echo "${kv#*=}" && return
+  done
+  echo 0
+}
+
+# epoch <binary> <args...>, prints "<Mpps> <dropped>" of one run
+epoch() {
+  local out
+  out=$(timeout -s INT -k 10 $((EPOCH + 5)) "$@" 2>/dev/null |
+    grep '^SUMMARY' || true)
+  if [ -z "$out" ]; then
+    echo "0 -1" && return
+  fi
+  local dropped=$(($(summary_field "$out" ring_drops) +
+    $(summary_field "$out" alloc_fails) + $(summary_field "$out" nic_drops)))
+  awk -v s="$(summary_field "$out" seconds)" \
+    -v p="$(summary_field "$out" processed)" -v d="$dropped" \
+    'BEGIN { printf("%.3f %d\n", s > 0 ? p / s / 1e6 : 0, p > 0 ? d : -1) }'
+}
+
+# better <Mpps> <dropped> <best Mpps> <best dropped>: no drops first, then
+# fewer drops, then throughput; -1 dropped is a run without packets
+better() {
+  awk -v m="$1" -v d="$2" -v bm="$3" -v bd="$4" 'BEGIN {
+    if (d < 0) exit 1
+    if (bd < 0 || d < bd) exit 0
+    exit !(d == bd && m > bm) }'
+}
+
+# tune <variant> <EAL args> [-- <app args>]
+tune() {
+  local variant=$1 bin eal=() app=() sep=0 a
+  shift
+  bin=$(build "$variant")
+  for a in "$@"; do
+    if [ $sep = 0 ] && [ "$a" = -- ]; then
+      sep=1
+    elif [ $sep = 0 ]; then
+      eal+=("$a")
+    else
+      app+=("$a")
+    fi
+  done
+
+  local -A best=([burst]=32 [rx-desc]=1024 [ring-size]=0)
+  local dims="burst rx-desc ring-size workers"
+  case $variant in
+  rss_scaling)
+    best[rx-queues]=0
+    dims="burst rx-desc rx-queues"
+    ;;
+  simple_rx) dims="burst rx-desc ring-size" ;; # a single ring consumer
+  *) best[workers]=2 ;;
+  esac
+  local best_mpps=0 best_drops=-1 dim values keep v k mpps drops opts
+  for dim in $dims; do
+    case $dim in
+    burst) values=$TUNE_BURSTS ;;
+    rx-desc) values=$TUNE_RX_DESCS ;;
+    ring-size) values=$TUNE_RINGS ;;
+    *) values=$TUNE_WORKERS ;;
+    esac
+    keep=${best[$dim]}
+    for v in $values; do
+      best[$dim]=$v
+      opts=()
+      for k in "${!best[@]}"; do opts+=("--$k" "${best[$k]}"); done
+      read -r mpps drops < <(epoch "$bin" ${eal[@]+"${eal[@]}"} \
+        --file-prefix=tune$$ -- ${app[@]+"${app[@]}"} --stats 0 "${opts[@]}")
+      echo "tune: ${opts[*]}: $mpps Mpps, $drops dropped" >&2
+      if better "$mpps" "$drops" "$best_mpps" "$best_drops"; then
+        best_mpps=$mpps best_drops=$drops keep=$v
+      fi
+    done
+    best[$dim]=$keep
+  done
+
+  if [ "$best_drops" -lt 0 ]; then
+    echo "tune: no run of $variant received packets" >&2
+    return 1
+  fi
+  [ "$best_drops" -eq 0 ] ||
+    echo "tune: every configuration dropped packets, this one the fewest" >&2
+  opts=()
+  for k in "${!best[@]}"; do opts+=("--$k" "${best[$k]}"); done
+  echo "$variant ${opts[*]}  # $best_mpps Mpps, $best_drops dropped"
+}
+
+if [ "${1:-}" = tune ]; then
+  shift
+  tune "$@"
+  exit
+fi
+
+echo "variant,sched,vdev,burst,ring_size,workers,pkt_size,seconds,rx,processed,ring_drops,alloc_fails,nic_drops,mpps,cycles_per_pkt"
+for variant in $VARIANTS; do
+  rings=$RING_SIZES workers_list=$WORKERS scheds=ring
+  case $variant in
+  simple_rx) workers_list=1 ;;   # a single ring consumer
+  packet_copy) scheds=$SCHEDS ;;
+  rss_scaling) rings=0 ;;        # run to completion, no ring
+  esac
+  for burst in $BURSTS; do
+    for ring in $rings; do
+      for workers in $workers_list; do
+        bin=$(build "$variant")
+        # lcores doing rx, the ones cycles/packet is charged to
+        case $variant in
+        simple_rx) last=1 rx_lcores=1 ;;
+        packet_copy) last=$((workers + 5)) rx_lcores=2 ;;
+        rss_scaling) last=$workers rx_lcores=$workers ;;
+        esac
+        for sched in $scheds; do
+        app_args=()
+        case $variant in
+        simple_rx) app_args=(-- --burst "$burst" --ring-size "$ring") ;;
+        packet_copy) app_args=(-- -e "$sched" --burst "$burst" --ring-size "$ring" --workers "$workers") ;;
+        rss_scaling) app_args=(-- --burst "$burst") ;;
+        esac
+        for vdev in $VDEVS; do
+          for size in $PKT_SIZES; do
+            # shellcheck disable=SC2046
+            out=$(timeout -s INT -k 10 $((DURATION + 5)) "$bin" \
+              $(lcore_args $last) --no-pci --file-prefix=bench$$ \
+              $(vdev_args "$vdev" "$size") ${app_args[@]+"${app_args[@]}"} 2>/dev/null |
+              grep '^SUMMARY' || true)
+            if [ -z "$out" ]; then
+              echo "$variant,$sched,$vdev,$burst,$ring,$workers,$size,,,,,,,," && continue
+            fi
+            eval "${out#SUMMARY }"
+            # shellcheck disable=SC2154
+            awk -v s="$seconds" -v hz="$tsc_hz" -v rx="$rx" -v p="$processed" \
+              -v n="$rx_lcores" -v row="$variant,$sched,$vdev,$burst,$ring,$workers,$size" \
+              -v rest="$seconds,$rx,$processed,$ring_drops,$alloc_fails,$nic_drops" \
+              'BEGIN { printf("%s,%s,%.3f,%s\n", row, rest,
+                       s > 0 ? p / s / 1e6 : 0,
+                       rx > 0 ? sprintf("%.1f", hz * s * n / rx) : "") }'
+          done
+        done
+        done
+      done
+    done
+  done
+done
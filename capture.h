@@ -0,0 +1,308 @@
+/*
+ * pcapng capture sink, one per worker lcore.
+ *
+ * The worker appends Enhanced Packet Blocks to a large aligned buffer and,
+ * when it fills up or gets old, hands it to its own writer thread through a
+ * ring. The writer thread writes whole buffers with O_DIRECT, rotates files
+ * by size and age and gives the buffers back on a second ring. The worker
+ * never waits: with no free buffer the packet is dropped and counted, so
+ * slow storage cannot back up into packet_ring or the NIC.
+ *
+ * Files are PREFIX_<lcore>_<seq>.pcapng, each starting with a Section Header
+ * Block and one Interface Description Block per port, nanosecond timestamps.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_ring.h>
+
+#include "pcapng.h"
+
+#ifndef CAPTURE_BUF_SIZE
+#define CAPTURE_BUF_SIZE (4 << 20) /**< Bytes per write */
+#endif
+#ifndef CAPTURE_BUFS
+#define CAPTURE_BUFS 8 /**< Buffers per worker, power of 2 */
+#endif
+#ifndef CAPTURE_FLUSH_MS
+#define CAPTURE_FLUSH_MS 500 /**< A partly filled buffer is written after this */
+#endif
+#ifndef CAPTURE_FILE_SIZE
+#define CAPTURE_FILE_SIZE (1ULL << 30) /**< Rotate after this many bytes */
+#endif
+#ifndef CAPTURE_ROTATE_S
+#define CAPTURE_ROTATE_S 300 /**< Rotate after this many seconds */
+#endif
+#define CAPTURE_ALIGN 4096 /**< O_DIRECT offset, length and address alignment */
+#define CAPTURE_IDLE_US 100
+
+
+struct capture_buf {
+  uint8_t *data; /* CAPTURE_BUF_SIZE, CAPTURE_ALIGN aligned */
+  uint32_t len;
+  uint64_t first_tsc;
+};
+
+struct capture {
+  /* Worker side */
+  struct capture_buf *cur;
+  uint64_t flush_cycles;
+  uint64_t base_tsc; /* rte_rdtsc() at base_ns */
+  uint64_t base_ns;  /* CLOCK_REALTIME */
+  double ns_per_tsc;
+  int done; /* worker handed over its last buffer */
+
+  /* Writer side */
+  char prefix[PATH_MAX - 32];
+  unsigned lcore;
+  uint16_t nb_ifs;
+  uint32_t snaplen;
+  int fd;
+  unsigned seq;
+  uint64_t file_bytes;
+  uint64_t file_tsc;
+  uint64_t bytes_written; /* read by the stats thread */
+  uint64_t write_errors; /* failed writes and buffers no file took */
+
+  struct rte_ring *free_bufs;
+  struct rte_ring *full_bufs;
+  struct capture_buf bufs[CAPTURE_BUFS];
+};
+
+/* Fill the rest of b up to CAPTURE_ALIGN with a custom block (PCAPNG_CB) */
+static inline void capture_pad(struct capture_buf *b) {
+  uint32_t gap = RTE_ALIGN_CEIL(b->len, CAPTURE_ALIGN) - b->len;
+  if (gap == 0) return;
+  if (gap < PCAPNG_CB_MIN) gap += CAPTURE_ALIGN;
+  uint8_t *p = b->data + b->len;
+  memset(p, 0, gap);
+  pcapng_put32(p, PCAPNG_CB);
+  pcapng_put32(p + 4, gap);
+  pcapng_put32(p + gap - 4, gap);
+  b->len += gap;
+}
+
+/* Rings, buffers and the capture itself, any of them may be missing */
+static inline void capture_free(struct capture *c) {
+  if (c == NULL) return;
+  rte_ring_free(c->free_bufs);
+  rte_ring_free(c->full_bufs);
+  for (unsigned i = 0; i < CAPTURE_BUFS; i++) free(c->bufs[i].data);
+  free(c);
+}
+
+static inline struct capture *capture_create(const char *prefix, unsigned lcore,
+                                             uint16_t nb_ifs, uint32_t snaplen) {
+  struct capture *c = calloc(1, sizeof(*c));
+  char name[RTE_RING_NAMESIZE];
+  struct timespec ts;
+
+  if (c == NULL) return NULL;
+  snprintf(c->prefix, sizeof(c->prefix), "%s", prefix);
+  c->lcore = lcore;
+  c->nb_ifs = nb_ifs;
+  c->snaplen = snaplen;
+  c->fd = -1;
+  c->flush_cycles = rte_get_tsc_hz() / 1000 * CAPTURE_FLUSH_MS;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  c->base_tsc = rte_rdtsc();
+  c->base_ns = (uint64_t)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+  c->ns_per_tsc = (double)NS_PER_S / rte_get_tsc_hz();
+
+  snprintf(name, sizeof(name), "CAP_FREE_%u", lcore);
+  c->free_bufs = rte_ring_create(name, CAPTURE_BUFS, SOCKET_ID_ANY,
+                                 RING_F_SP_ENQ | RING_F_SC_DEQ | RING_F_EXACT_SZ);
+  snprintf(name, sizeof(name), "CAP_FULL_%u", lcore);
+  c->full_bufs = rte_ring_create(name, CAPTURE_BUFS, SOCKET_ID_ANY,
+                                 RING_F_SP_ENQ | RING_F_SC_DEQ | RING_F_EXACT_SZ);
+  if (c->free_bufs == NULL || c->full_bufs == NULL) {
+    capture_free(c);
+    return NULL;
+  }
+  for (unsigned i = 0; i < CAPTURE_BUFS; i++) {
+    // Two alignment units of slack for the padding block
+    if (posix_memalign((void **)&c->bufs[i].data, CAPTURE_ALIGN,
+                       CAPTURE_BUF_SIZE + 2 * CAPTURE_ALIGN) != 0) {
+      c->bufs[i].data = NULL;
+      capture_free(c);
+      return NULL;
+    }
+    rte_ring_sp_enqueue(c->free_bufs, &c->bufs[i]);
+  }
+  return c;
+}
+
+/* Worker: pass the current buffer to the writer thread */
+static inline void capture_handoff(struct capture *c) {
+  capture_pad(c->cur);
+  // Cannot fail, the rings hold every buffer
+  rte_ring_sp_enqueue(c->full_bufs, c->cur);
+  c->cur = NULL;
+}
+
+/*
+ * Worker: append one packet. Returns -1 when no buffer is free, the packet is
+ * then the caller's to count as a drop.
+ */
+static inline int capture_packet(struct capture *c, uint16_t ifid,
+                                 uint64_t tsc, const void *data,
+                                 uint32_t caplen, uint32_t origlen) {
+  const uint32_t blen = PCAPNG_EPB_LEN(caplen);
+
+  if (c->cur != NULL && c->cur->len + blen > CAPTURE_BUF_SIZE)
+    capture_handoff(c);
+  if (c->cur == NULL) {
+    if (unlikely(rte_ring_sc_dequeue(c->free_bufs, (void **)&c->cur) != 0))
+      return -1;
+    c->cur->len = 0;
+    c->cur->first_tsc = tsc;
+  }
+
+  const uint64_t ns = c->base_ns + (uint64_t)((int64_t)(tsc - c->base_tsc) *
+                                              c->ns_per_tsc);
+  uint8_t *p = c->cur->data + c->cur->len;
+  pcapng_put32(p, PCAPNG_EPB);
+  pcapng_put32(p + 4, blen);
+  pcapng_put32(p + 8, ifid);
+  pcapng_put32(p + 12, ns >> 32);
+  pcapng_put32(p + 16, (uint32_t)ns);
+  pcapng_put32(p + 20, caplen);
+  pcapng_put32(p + 24, origlen);
+  memcpy(p + 28, data, caplen);
+  memset(p + 28 + caplen, 0, blen - 32 - caplen);
+  pcapng_put32(p + blen - 4, blen);
+  c->cur->len += blen;
+  return 0;
+}
+
+/* Worker: called every poll, writes out a buffer that waited too long */
+static inline void capture_poll(struct capture *c, uint64_t now) {
+  if (c->cur != NULL && c->cur->len > 0 &&
+      now - c->cur->first_tsc > c->flush_cycles)
+    capture_handoff(c);
+}
+
+/* Worker: last buffer on the way out, the writer thread then exits */
+static inline void capture_finish(struct capture *c) {
+  if (c->cur != NULL && c->cur->len > 0) capture_handoff(c);
+  __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+}
+
+static inline int capture_write(struct capture *c, const void *buf,
+                                uint32_t len) {
+  while (len > 0) {
+    ssize_t n = write(c->fd, buf, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      __atomic_store_n(&c->write_errors, c->write_errors + 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+    buf = (const uint8_t *)buf + n;
+    len -= n;
+    c->file_bytes += n;
+    __atomic_store_n(&c->bytes_written, c->bytes_written + n,
+                     __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+/* Writer: next file of the rotation, with its SHB and IDBs. On failure no
+ * file is left open, the next buffer tries a new one. */
+static inline int capture_open(struct capture *c) {
+  char path[PATH_MAX];
+  uint8_t *hdr;
+  struct capture_buf b;
+
+  snprintf(path, sizeof(path), "%s_%u_%04u.pcapng", c->prefix, c->lcore,
+           c->seq++);
+  c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  if (c->fd < 0 && errno == EINVAL) // filesystems without O_DIRECT
+    c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (c->fd < 0) {
+    printf("Cannot open capture file %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  c->file_bytes = 0;
+  c->file_tsc = rte_rdtsc();
+
+  const uint32_t len = RTE_ALIGN_CEIL(28 + 32 * c->nb_ifs + PCAPNG_CB_MIN,
+                                      CAPTURE_ALIGN);
+  if (posix_memalign((void **)&hdr, CAPTURE_ALIGN, len) != 0) {
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  uint8_t *p = hdr;
+  const uint64_t section_len = UINT64_MAX; /* unspecified */
+  pcapng_put32(p, PCAPNG_SHB);
+  pcapng_put32(p + 4, 28);
+  pcapng_put32(p + 8, PCAPNG_BYTE_ORDER);
+  pcapng_put32(p + 12, 1); /* version 1.0 */
+  memcpy(p + 16, &section_len, 8);
+  pcapng_put32(p + 24, 28);
+  p += 28;
+  for (uint16_t i = 0; i < c->nb_ifs; i++, p += 32) {
+    pcapng_put32(p, PCAPNG_IDB);
+    pcapng_put32(p + 4, 32);
+    pcapng_put32(p + 8, 1); /* LINKTYPE_ETHERNET, reserved */
+    pcapng_put32(p + 12, c->snaplen);
+    pcapng_put32(p + 16, 9 | 1 << 16); /* if_tsresol, length 1 */
+    pcapng_put32(p + 20, 9);           /* 10^-9 */
+    pcapng_put32(p + 24, 0);           /* opt_endofopt */
+    pcapng_put32(p + 28, 32);
+  }
+  b.data = hdr;
+  b.len = p - hdr;
+  capture_pad(&b);
+  int ret = capture_write(c, hdr, b.len);
+  free(hdr);
+  if (ret != 0) {
+    close(c->fd);
+    c->fd = -1;
+  }
+  return ret;
+}
+
+/* Writer thread, one per worker so files are written in parallel */
+static inline void *capture_thread(void *arg) {
+  struct capture *c = arg;
+  const uint64_t rotate_cycles = rte_get_tsc_hz() * CAPTURE_ROTATE_S;
+
+  for (;;) {
+    struct capture_buf *b;
+    if (rte_ring_sc_dequeue(c->full_bufs, (void **)&b) != 0) {
+      if (__atomic_load_n(&c->done, __ATOMIC_ACQUIRE) &&
+          rte_ring_empty(c->full_bufs))
+        break;
+      rte_delay_us_sleep(CAPTURE_IDLE_US);
+      continue;
+    }
+    if (c->fd >= 0 && (c->file_bytes >= CAPTURE_FILE_SIZE ||
+                       rte_rdtsc() - c->file_tsc >= rotate_cycles)) {
+      close(c->fd);
+      c->fd = -1;
+    }
+    if (c->fd >= 0 || capture_open(c) == 0)
+      capture_write(c, b->data, b->len);
+    else // the buffer is lost like a failed write
+      __atomic_store_n(&c->write_errors, c->write_errors + 1, __ATOMIC_RELAXED);
+    rte_ring_sp_enqueue(c->free_bufs, b);
+  }
+  if (c->fd >= 0) close(c->fd);
+  return NULL;
+}
+
+#endif /* CAPTURE_H */
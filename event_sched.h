@@ -0,0 +1,175 @@
+/*
+ * Flow-atomic handoff from rx lcores to workers on an rte_eventdev.
+ *
+ * The alternative to one shared MP/MC ring: rx lcores enqueue NEW events
+ * carrying the packet pointer and a flow id (the RSS hash), and the event
+ * device schedules them from one ATOMIC queue, so all packets of a flow go
+ * to one worker at a time and in order, without locks, while flows move to
+ * whichever worker is free. Each lcore gets its own event port, producers
+ * unlinked and workers linked to the queue. A worker's flows stay held
+ * until its next dequeue releases them.
+ *
+ * The first event device is used; without one the software event_sw PMD
+ * is created, so no special hardware is needed. Its scheduler is a service
+ * that event_sched_run() iterates on the calling lcore.
+ */
+#ifndef EVENT_SCHED_H
+#define EVENT_SCHED_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_bus_vdev.h>
+#include <rte_common.h>
+#include <rte_eventdev.h>
+#include <rte_lcore.h>
+#include <rte_service.h>
+
+#include "lcore_plan.h"
+
+#define EVENT_SW_NAME "event_sw0"
+#define EVENT_QUEUE 0
+#define EVENT_FLOW_MASK 0xfffff /* flow_id is 20 bits */
+
+struct event_sched {
+  uint8_t dev;
+  uint32_t service_id;
+  int has_service; /* scheduling needs event_sched_run() calls */
+  uint16_t depth;  /* events per enqueue or dequeue */
+  uint8_t port[RTE_MAX_LCORE];
+};
+
+/*
+ * One event port for every rx and worker lcore of the plan, nb_events in
+ * flight at most. Returns -1 with a message when the device cannot be set
+ * up.
+ */
+static inline int event_sched_create(struct event_sched *es,
+                                     const struct lcore_plan *plan,
+                                     int socket, unsigned nb_events,
+                                     uint16_t depth) {
+  struct rte_event_dev_info info;
+  unsigned lcore;
+  uint8_t nb_ports = 0;
+
+  memset(es, 0, sizeof(*es));
+  if (rte_event_dev_count() == 0) {
+    char args[32];
+    snprintf(args, sizeof(args), "socket_id=%d", socket);
+    if (rte_vdev_init(EVENT_SW_NAME, args) != 0) {
+      printf("No event device and cannot create %s\n", EVENT_SW_NAME);
+      return -1;
+    }
+  }
+  rte_event_dev_info_get(es->dev, &info);
+  printf("Event device %u: %s\n", es->dev, info.driver_name);
+
+  RTE_LCORE_FOREACH_WORKER(lcore) {
+    const enum lcore_role role = plan->lcore[lcore].role;
+    if (role == ROLE_RX || role == ROLE_WORKER) es->port[lcore] = nb_ports++;
+  }
+  es->depth = RTE_MIN(depth, (uint16_t)RTE_MIN(
+                                 info.max_event_port_dequeue_depth,
+                                 info.max_event_port_enqueue_depth));
+  if (es->depth == 0) es->depth = depth; /* 0: no limit */
+  const struct rte_event_dev_config config = {
+      .nb_event_queues = 1,
+      .nb_event_ports = nb_ports,
+      .nb_events_limit = RTE_MIN(nb_events, (unsigned)info.max_num_events),
+      .nb_event_queue_flows = info.max_event_queue_flows,
+      .nb_event_port_dequeue_depth = es->depth,
+      .nb_event_port_enqueue_depth = es->depth,
+      .dequeue_timeout_ns = info.min_dequeue_timeout_ns,
+  };
+  if (rte_event_dev_configure(es->dev, &config) != 0) {
+    printf("Cannot configure event device %u\n", es->dev);
+    return -1;
+  }
+
+  const struct rte_event_queue_conf qconf = {
+      .schedule_type = RTE_SCHED_TYPE_ATOMIC,
+      .priority = RTE_EVENT_DEV_PRIORITY_NORMAL,
+      .nb_atomic_flows = info.max_event_queue_flows,
+      .nb_atomic_order_sequences = info.max_event_queue_flows,
+  };
+  if (rte_event_queue_setup(es->dev, EVENT_QUEUE, &qconf) != 0) return -1;
+
+  RTE_LCORE_FOREACH_WORKER(lcore) {
+    const enum lcore_role role = plan->lcore[lcore].role;
+    if (role != ROLE_RX && role != ROLE_WORKER) continue;
+    const struct rte_event_port_conf pconf = {
+        .new_event_threshold = config.nb_events_limit,
+        .dequeue_depth = es->depth,
+        .enqueue_depth = es->depth,
+    };
+    if (rte_event_port_setup(es->dev, es->port[lcore], &pconf) != 0) {
+      printf("Cannot set up event port %u\n", es->port[lcore]);
+      return -1;
+    }
+    if (role == ROLE_WORKER) {
+      const uint8_t queue = EVENT_QUEUE;
+      if (rte_event_port_link(es->dev, es->port[lcore], &queue, NULL, 1) != 1)
+        return -1;
+    }
+  }
+
+  es->has_service =
+      rte_event_dev_service_id_get(es->dev, &es->service_id) == 0;
+  if (es->has_service) rte_service_runstate_set(es->service_id, 1);
+  if (rte_event_dev_start(es->dev) != 0) {
+    printf("Cannot start event device %u\n", es->dev);
+    return -1;
+  }
+  printf("Event scheduling: %u ports, %u events, burst %u\n", nb_ports,
+         config.nb_events_limit, es->depth);
+  return 0;
+}
+
+/* New atomic events for n objects of the flows given, returns the number taken */
+static inline uint16_t event_sched_enqueue(const struct event_sched *es,
+                                           unsigned lcore, void *const *objs,
+                                           const uint32_t *flows, uint16_t n) {
+  struct rte_event ev[n];
+  for (uint16_t i = 0; i < n; i++) {
+    ev[i].event = 0;
+    ev[i].flow_id = flows[i] & EVENT_FLOW_MASK;
+    ev[i].op = RTE_EVENT_OP_NEW;
+    ev[i].sched_type = RTE_SCHED_TYPE_ATOMIC;
+    ev[i].queue_id = EVENT_QUEUE;
+    ev[i].event_type = RTE_EVENT_TYPE_CPU;
+    ev[i].priority = RTE_EVENT_DEV_PRIORITY_NORMAL;
+    ev[i].event_ptr = objs[i];
+  }
+  uint16_t sent = 0;
+  while (sent < n) {
+    const uint16_t nb = rte_event_enqueue_new_burst(
+        es->dev, es->port[lcore], &ev[sent], RTE_MIN(n - sent, es->depth));
+    sent += nb;
+    if (nb == 0) break; /* over the in-flight limit */
+  }
+  return sent;
+}
+
+/* Up to n objects, releasing the flows of the previous dequeue */
+static inline uint16_t event_sched_dequeue(const struct event_sched *es,
+                                           unsigned lcore, void **objs,
+                                           uint16_t n) {
+  struct rte_event ev[n];
+  const uint16_t nb = rte_event_dequeue_burst(es->dev, es->port[lcore], ev,
+                                              RTE_MIN(n, es->depth), 0);
+  for (uint16_t i = 0; i < nb; i++) objs[i] = ev[i].event_ptr;
+  return nb;
+}
+
+/* One scheduling pass, for devices that schedule in a service */
+static inline void event_sched_run(const struct event_sched *es) {
+  if (es->has_service) rte_service_run_iter_on_app_lcore(es->service_id, 1);
+}
+
+static inline void event_sched_stop(const struct event_sched *es) {
+  rte_event_dev_stop(es->dev);
+  if (es->has_service) rte_service_runstate_set(es->service_id, 0);
+}
+
+#endif /* EVENT_SCHED_H */
@@ -0,0 +1,392 @@
+/*
+ * Per-lcore 5-tuple flow table.
+ *
+ * Each worker owns one table and RSS keeps a flow on one worker, so there
+ * are no locks. Keys live in an rte_hash; the position rte_hash returns for
+ * a key indexes a preallocated array of cache-line sized entries, which
+ * keeps the hash free of data pointers and lets a key be recovered from its
+ * entry with rte_hash_get_key_with_position().
+ *
+ * Flows age out on a hierarchical timer wheel per table (3 levels of 256
+ * slots of FLOW_TICK_US). flow_table_expire() is called every poll and runs
+ * the ticks that are due, touching at most a budget of entries per call and
+ * resuming where it stopped. A packet only refreshes last_tsc; when a timer
+ * fires on a flow that was active since, the flow is put back on the wheel
+ * at its new deadline. Expired flows are handed to an export ring as
+ * struct flow_record and never wait for it.
+ */
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_hash.h>
+#include <rte_hash_crc.h>
+#include <rte_malloc.h>
+#include <rte_mbuf.h>
+#include <rte_mempool.h>
+#include <rte_ring.h>
+#include <rte_tcp.h>
+
+#include "pkt_parse.h"
+
+#ifndef FLOW_TABLE_SIZE
+#define FLOW_TABLE_SIZE (1 << 20) /**< Flows per worker lcore */
+#endif
+#ifndef FLOW_TICK_US
+#define FLOW_TICK_US 1000 /**< Timer wheel resolution */
+#endif
+#ifndef FLOW_IDLE_TIMEOUT_MS
+#define FLOW_IDLE_TIMEOUT_MS 30000 /**< Flows without packets this long expire */
+#endif
+#ifndef FLOW_FIN_TIMEOUT_MS
+#define FLOW_FIN_TIMEOUT_MS 1000 /**< Grace period after a FIN or RST */
+#endif
+#ifndef FLOW_EXPIRE_BUDGET
+#define FLOW_EXPIRE_BUDGET 64 /**< Wheel entries touched per flow_table_expire() */
+#endif
+
+#define FLOW_HASH_BUCKET_ENTRIES 8 /**< rte_hash keys per 64 byte bucket */
+
+#define FLOW_WHEEL_BITS 8
+#define FLOW_WHEEL_SLOTS (1 << FLOW_WHEEL_BITS)
+#define FLOW_WHEEL_LEVELS 3
+#define FLOW_NONE UINT32_MAX
+
+/* 40 bytes, the padding is zeroed so keys compare as plain memory */
+struct flow_key {
+  uint8_t src_addr[16];
+  uint8_t dst_addr[16];
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t proto;
+  uint8_t ip_version; /* 4 or 6, IPv4 addresses fill the first 4 bytes */
+  uint8_t pad[2];
+};
+
+struct flow_entry {
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t first_tsc;
+  uint64_t last_tsc;
+  uint32_t next; /* timer wheel slot list */
+  uint32_t prev;
+  uint32_t expire_tick;
+  uint16_t slot;     /* level * FLOW_WHEEL_SLOTS + index */
+  uint8_t tcp_flags; /* every flag seen on the flow */
+} __rte_cache_aligned;
+
+enum flow_expire_reason {
+  FLOW_EXPIRE_IDLE,
+  FLOW_EXPIRE_FIN, /* FIN or RST seen */
+};
+
+/* What an expired flow leaves on the export ring */
+struct flow_record {
+  struct flow_key key;
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t first_tsc;
+  uint64_t last_tsc;
+  uint8_t tcp_flags;
+  uint8_t reason; /* enum flow_expire_reason */
+};
+
+struct flow_table {
+  struct rte_hash *hash;
+  struct flow_entry *entries; /* indexed by rte_hash key position */
+  uint32_t size;
+  uint32_t nb_flows;
+
+  uint32_t wheel[FLOW_WHEEL_LEVELS * FLOW_WHEEL_SLOTS]; /* list heads */
+  uint64_t base_tsc;      /* TSC of tick 0 */
+  uint64_t tick_cycles;
+  uint64_t next_tick_tsc; /* when tick becomes due */
+  uint32_t tick;          /* next tick to run */
+  uint8_t stage;          /* within tick: cascade level 2, level 1, expire */
+  uint32_t idle_ticks;
+  uint32_t fin_ticks;
+
+  struct rte_ring *export_ring; /* of struct flow_record, may be NULL */
+  struct rte_mempool *record_pool;
+};
+
+/* Counts from one flow_table_update() call */
+struct flow_update {
+  uint32_t added;
+  uint32_t full; /* packets of new flows that found the table full */
+};
+
+/* Counts from one flow_table_expire() call */
+struct flow_expire {
+  uint32_t expired;
+  uint32_t work;         /* wheel entries touched */
+  uint32_t capped;       /* 1 when the budget ran out before the due ticks */
+  uint32_t lag;          /* due ticks left for the next call */
+  uint32_t export_drops; /* records lost to a full ring or pool */
+};
+
+static inline struct flow_table *flow_table_create(const char *name,
+                                                   uint32_t size, int socket,
+                                                   struct rte_ring *export_ring,
+                                                   struct rte_mempool *record_pool) {
+  struct rte_hash_parameters params = {
+      .name = name,
+      .entries = size,
+      .key_len = sizeof(struct flow_key),
+      .hash_func = rte_hash_crc,
+      .socket_id = socket,
+      // Overflow into extendable buckets instead of failing short of size
+      .extra_flag = RTE_HASH_EXTRA_FLAGS_EXT_TABLE,
+  };
+  struct flow_table *ft =
+      rte_zmalloc_socket(name, sizeof(*ft), RTE_CACHE_LINE_SIZE, socket);
+  if (ft == NULL) return NULL;
+  ft->size = size;
+  ft->export_ring = export_ring;
+  ft->record_pool = record_pool;
+  memset(ft->wheel, 0xff, sizeof(ft->wheel));
+  ft->tick_cycles = RTE_MAX(rte_get_tsc_hz() * FLOW_TICK_US / US_PER_S, 1);
+  ft->base_tsc = ft->next_tick_tsc = rte_rdtsc();
+  ft->idle_ticks = (uint64_t)FLOW_IDLE_TIMEOUT_MS * 1000 / FLOW_TICK_US;
+  ft->fin_ticks = (uint64_t)FLOW_FIN_TIMEOUT_MS * 1000 / FLOW_TICK_US;
+  ft->hash = rte_hash_create(&params);
+  ft->entries = rte_zmalloc_socket(name, (size_t)size * sizeof(struct flow_entry),
+                                   RTE_CACHE_LINE_SIZE, socket);
+  if (ft->hash == NULL || ft->entries == NULL) {
+    rte_hash_free(ft->hash);
+    rte_free(ft->entries);
+    rte_free(ft);
+    return NULL;
+  }
+  return ft;
+}
+
+/*
+ * Hugepage bytes flow_table_create() takes for size flows: the entries and
+ * what rte_hash allocates for them, its key slots, main and extendable
+ * buckets and the free slot and free bucket rings.
+ */
+static inline size_t flow_table_bytes(uint32_t size) {
+  const size_t slots = (size_t)size + 1;
+  const size_t buckets = rte_align32pow2(size) / FLOW_HASH_BUCKET_ENTRIES;
+  const size_t key = RTE_ALIGN(sizeof(void *) + sizeof(struct flow_key), 16);
+  return sizeof(struct flow_table) + (size_t)size * sizeof(struct flow_entry) +
+         slots * key + 2 * buckets * RTE_CACHE_LINE_SIZE +
+         (rte_align32pow2(slots) + rte_align32pow2(buckets + 1) + slots) *
+             sizeof(uint32_t);
+}
+
+static inline uint32_t flow_tsc_tick(const struct flow_table *ft,
+                                     uint64_t tsc) {
+  return (tsc - ft->base_tsc) / ft->tick_cycles;
+}
+
+/* Put entry p in the wheel slot for expire, at least the next tick to run */
+static inline void flow_wheel_link(struct flow_table *ft, uint32_t p,
+                                   uint32_t expire) {
+  struct flow_entry *e = &ft->entries[p];
+  uint32_t delta = expire - ft->tick;
+  unsigned level;
+
+  if ((int32_t)delta < 0) {
+    expire = ft->tick;
+    delta = 0;
+  }
+  if (delta >= 1u << (FLOW_WHEEL_LEVELS * FLOW_WHEEL_BITS)) {
+    delta = (1u << (FLOW_WHEEL_LEVELS * FLOW_WHEEL_BITS)) - 1;
+    expire = ft->tick + delta;
+  }
+  for (level = 0; delta >> (FLOW_WHEEL_BITS * (level + 1)); level++)
+    ;
+  e->expire_tick = expire;
+  e->slot = level * FLOW_WHEEL_SLOTS +
+            ((expire >> (FLOW_WHEEL_BITS * level)) & (FLOW_WHEEL_SLOTS - 1));
+  e->prev = FLOW_NONE;
+  e->next = ft->wheel[e->slot];
+  if (e->next != FLOW_NONE) ft->entries[e->next].prev = p;
+  ft->wheel[e->slot] = p;
+}
+
+static inline void flow_wheel_unlink(struct flow_table *ft, uint32_t p) {
+  struct flow_entry *e = &ft->entries[p];
+  if (e->prev != FLOW_NONE)
+    ft->entries[e->prev].next = e->next;
+  else
+    ft->wheel[e->slot] = e->next;
+  if (e->next != FLOW_NONE) ft->entries[e->next].prev = e->prev;
+}
+
+static inline void flow_key_from_parse(struct flow_key *k,
+                                       const struct parse_burst *pb,
+                                       uint16_t i) {
+  memcpy(k->src_addr, pb->src_addr[i], sizeof(k->src_addr));
+  memcpy(k->dst_addr, pb->dst_addr[i], sizeof(k->dst_addr));
+  k->src_port = pb->src_port[i];
+  k->dst_port = pb->dst_port[i];
+  k->proto = pb->proto[i];
+  k->ip_version = pb->flags[i] & PARSE_F_IPV6 ? 6 : 4;
+  memset(k->pad, 0, sizeof(k->pad));
+}
+
+/*
+ * Account a parsed burst to its flows, looking up RTE_HASH_LOOKUP_BULK_MAX
+ * keys at a time. New flows are added one by one, after checking again so a
+ * flow first seen twice in the same burst gets a single entry.
+ */
+static inline void flow_table_update(struct flow_table *ft,
+                                     const struct parse_burst *pb,
+                                     struct rte_mbuf **bufs, uint64_t now,
+                                     struct flow_update *upd) {
+  struct flow_key keys[RTE_HASH_LOOKUP_BULK_MAX];
+  const void *key_ptrs[RTE_HASH_LOOKUP_BULK_MAX];
+  int32_t pos[RTE_HASH_LOOKUP_BULK_MAX];
+  uint16_t idx[RTE_HASH_LOOKUP_BULK_MAX];
+  const uint32_t now_tick = flow_tsc_tick(ft, now);
+  uint16_t i = 0;
+
+  upd->added = 0;
+  upd->full = 0;
+  while (i < pb->n) {
+    unsigned nb = 0;
+    for (; i < pb->n && nb < RTE_HASH_LOOKUP_BULK_MAX; i++) {
+      if (!(pb->flags[i] & (PARSE_F_IPV4 | PARSE_F_IPV6)) ||
+          (pb->flags[i] & PARSE_F_BAD))
+        continue;
+      flow_key_from_parse(&keys[nb], pb, i);
+      key_ptrs[nb] = &keys[nb];
+      idx[nb++] = i;
+    }
+    if (nb == 0) break;
+
+    rte_hash_lookup_bulk(ft->hash, key_ptrs, nb, pos);
+    for (unsigned j = 0; j < nb; j++)
+      if (pos[j] >= 0) rte_prefetch0(&ft->entries[pos[j]]);
+    for (unsigned j = 0; j < nb; j++) {
+      int32_t p = pos[j];
+      if (unlikely(p < 0)) {
+        p = rte_hash_lookup(ft->hash, &keys[j]);
+        if (p < 0) {
+          p = rte_hash_add_key(ft->hash, &keys[j]);
+          if (unlikely(p < 0)) {
+            upd->full++;
+            continue;
+          }
+          memset(&ft->entries[p], 0, sizeof(ft->entries[p]));
+          ft->entries[p].first_tsc = now;
+          flow_wheel_link(ft, p, now_tick + ft->idle_ticks);
+          ft->nb_flows++;
+          upd->added++;
+        }
+      }
+      struct flow_entry *e = &ft->entries[p];
+      const uint8_t tcp_flags = pb->tcp_flags[idx[j]];
+      e->packets++;
+      e->bytes += rte_pktmbuf_pkt_len(bufs[idx[j]]);
+      e->last_tsc = now;
+      // A finished flow moves up to its shorter deadline right away
+      if (unlikely(tcp_flags & ~e->tcp_flags &
+                   (RTE_TCP_FIN_FLAG | RTE_TCP_RST_FLAG))) {
+        flow_wheel_unlink(ft, p);
+        flow_wheel_link(ft, p, now_tick + ft->fin_ticks);
+      }
+      e->tcp_flags |= tcp_flags;
+    }
+  }
+}
+
+/*
+ * Timer of entry p fired on tick t, already unlinked. Flows seen since are
+ * rescheduled, the others exported and removed from the table.
+ */
+static inline void flow_expire_one(struct flow_table *ft, uint32_t p,
+                                   uint32_t t, struct flow_expire *ex) {
+  struct flow_entry *e = &ft->entries[p];
+  const int fin = !!(e->tcp_flags & (RTE_TCP_FIN_FLAG | RTE_TCP_RST_FLAG));
+  const uint32_t due =
+      flow_tsc_tick(ft, e->last_tsc) + (fin ? ft->fin_ticks : ft->idle_ticks);
+  struct flow_key key;
+  void *key_ptr;
+
+  if ((int32_t)(due - t) > 0) {
+    flow_wheel_link(ft, p, due);
+    return;
+  }
+  if (rte_hash_get_key_with_position(ft->hash, p, &key_ptr) != 0) return;
+  memcpy(&key, key_ptr, sizeof(key));
+
+  if (ft->export_ring != NULL) {
+    struct flow_record *r;
+    if (unlikely(rte_mempool_get(ft->record_pool, (void **)&r) != 0)) {
+      ex->export_drops++;
+    } else {
+      r->key = key;
+      r->packets = e->packets;
+      r->bytes = e->bytes;
+      r->first_tsc = e->first_tsc;
+      r->last_tsc = e->last_tsc;
+      r->tcp_flags = e->tcp_flags;
+      r->reason = fin ? FLOW_EXPIRE_FIN : FLOW_EXPIRE_IDLE;
+      if (unlikely(rte_ring_mp_enqueue(ft->export_ring, r) != 0)) {
+        rte_mempool_put(ft->record_pool, r);
+        ex->export_drops++;
+      }
+    }
+  }
+  rte_hash_del_key(ft->hash, &key);
+  ft->nb_flows--;
+  ex->expired++;
+}
+
+/*
+ * Run the wheel ticks due at now, touching at most budget entries. Each tick
+ * first cascades the level 2 and level 1 slots it starts, then expires its
+ * level 0 slot; ft->stage remembers how far a capped call got.
+ */
+static inline void flow_table_expire(struct flow_table *ft, uint64_t now,
+                                     uint32_t budget, struct flow_expire *ex) {
+  memset(ex, 0, sizeof(*ex));
+  if (likely(now < ft->next_tick_tsc)) return;
+
+  const uint32_t target = flow_tsc_tick(ft, now);
+  while ((int32_t)(target - ft->tick) >= 0) {
+    const uint32_t t = ft->tick;
+    uint32_t *head = NULL;
+
+    if (ft->stage == 0 && (t & ((1u << (2 * FLOW_WHEEL_BITS)) - 1)) == 0)
+      head = &ft->wheel[2 * FLOW_WHEEL_SLOTS +
+                        ((t >> (2 * FLOW_WHEEL_BITS)) & (FLOW_WHEEL_SLOTS - 1))];
+    else if (ft->stage == 1 && (t & (FLOW_WHEEL_SLOTS - 1)) == 0)
+      head = &ft->wheel[FLOW_WHEEL_SLOTS +
+                        ((t >> FLOW_WHEEL_BITS) & (FLOW_WHEEL_SLOTS - 1))];
+    else if (ft->stage == 2)
+      head = &ft->wheel[t & (FLOW_WHEEL_SLOTS - 1)];
+
+    while (head != NULL && *head != FLOW_NONE) {
+      if (ex->work == budget) {
+        ex->capped = 1;
+        ex->lag = target - t + 1;
+        return;
+      }
+      const uint32_t p = *head;
+      flow_wheel_unlink(ft, p);
+      ex->work++;
+      if (ft->stage < 2)
+        flow_wheel_link(ft, p, ft->entries[p].expire_tick);
+      else
+        flow_expire_one(ft, p, t, ex);
+    }
+
+    if (++ft->stage == 3) {
+      ft->stage = 0;
+      ft->tick++;
+    }
+  }
+  ft->next_tick_tsc = ft->base_tsc + (uint64_t)ft->tick * ft->tick_cycles;
+}
+
+#endif /* FLOW_TABLE_H */
@@ -0,0 +1,268 @@
+/*
+ * Adaptive idle policy for polling lcores.
+ *
+ * A loop calls idle_poll() after every rx burst or ring dequeue. While polls
+ * return work nothing changes. Once they come back empty the lcore backs off
+ * step by step as the idle period grows:
+ *
+ *   IDLE_POLL     the first IDLE_PAUSE_US, plain polling
+ *   IDLE_PAUSE    rte_pause() between polls, doubling up to IDLE_PAUSE_MAX
+ *   IDLE_MONITOR  rte_power_monitor() on the ring producer tail, so the core
+ *                 naps in UMWAIT until an enqueue or IDLE_SLICE_US passes
+ *   IDLE_SLEEP    past the sleep period: rx queue interrupt and epoll for rx
+ *                 lcores, a monitor or timer sleep for ring consumers
+ *
+ * Cycles between polls are counted as busy when the previous poll returned
+ * work and idle otherwise. The deepest level an idle period reached is given
+ * back when it ends, so callers can time the packets that waited.
+ *
+ * rte_power_monitor() is used with its 20.11 signature, other releases and
+ * CPUs without WAITPKG pause instead.
+ */
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_cpuflags.h>
+#include <rte_cycles.h>
+#include <rte_ethdev.h>
+#include <rte_interrupts.h>
+#include <rte_lcore.h>
+#include <rte_pause.h>
+#include <rte_ring.h>
+#include <rte_version.h>
+
+#include "stats.h"
+
+#if RTE_VERSION >= RTE_VERSION_NUM(20, 11, 0, 0) && \
+    RTE_VERSION < RTE_VERSION_NUM(21, 2, 0, 0)
+#define IDLE_HAVE_MONITOR 1
+#include <rte_power_intrinsics.h>
+#endif
+
+#ifndef IDLE_PAUSE_US
+#define IDLE_PAUSE_US 10 /**< Plain polling this long into an idle period */
+#endif
+#ifndef IDLE_MONITOR_US
+#define IDLE_MONITOR_US 100 /**< Pausing this long, then monitoring */
+#endif
+#define IDLE_SLICE_US 50  /**< Longest monitor or timer sleep between polls */
+#define IDLE_INTR_MS 10   /**< epoll timeout, bounds a missed rx interrupt */
+#define IDLE_PAUSE_MAX 64 /**< rte_pause() calls per empty poll at most */
+#define IDLE_SLEEP_MAX_US 1000000 /**< Largest -I */
+
+enum idle_level {
+  IDLE_POLL,
+  IDLE_PAUSE,
+  IDLE_MONITOR,
+  IDLE_SLEEP,
+  IDLE_LEVELS,
+};
+
+/* Per-lcore counters, one writer */
+struct idle_stats {
+  uint64_t busy_cycles;
+  uint64_t idle_cycles;
+  uint64_t waits[IDLE_LEVELS]; /* empty polls that waited at each level */
+  uint64_t wakes;              /* idle periods that reached IDLE_MONITOR */
+  uint64_t wake_cycles;        /* summed age of the oldest packet at wake up */
+  uint64_t wake_max;
+};
+
+struct idle {
+  struct idle_stats *st;
+  uint64_t pause_cycles;
+  uint64_t monitor_cycles;
+  uint64_t sleep_cycles; /* 0 never waits, pure polling */
+  uint64_t slice_cycles;
+  uint64_t last_tsc;  /* previous idle_poll() */
+  uint64_t since_tsc; /* first empty poll of the idle period, 0 when busy */
+  enum idle_level level;
+  unsigned backoff;
+  int busy;
+  /* what a wait can be woken by */
+  const volatile void *addr;
+  uint8_t addr_size;
+  uint16_t port;
+  uint16_t queue;
+  int intr;
+};
+
+static inline void idle_stats_sum(struct idle_stats *sum,
+                                  const struct idle_stats *st) {
+  sum->busy_cycles += stats_read(&st->busy_cycles);
+  sum->idle_cycles += stats_read(&st->idle_cycles);
+  for (int l = 0; l < IDLE_LEVELS; l++)
+    sum->waits[l] += stats_read(&st->waits[l]);
+  sum->wakes += stats_read(&st->wakes);
+  sum->wake_cycles += stats_read(&st->wake_cycles);
+  sum->wake_max = RTE_MAX(sum->wake_max, stats_read(&st->wake_max));
+}
+
+/* sleep_us is the idle period before the deepest wait, 0 keeps polling */
+static inline void idle_init(struct idle *id, struct idle_stats *st,
+                             uint64_t sleep_us) {
+  const uint64_t hz = rte_get_tsc_hz();
+  memset(id, 0, sizeof(*id));
+  id->st = st;
+  id->pause_cycles = IDLE_PAUSE_US * hz / US_PER_S;
+  id->monitor_cycles = IDLE_MONITOR_US * hz / US_PER_S;
+  id->sleep_cycles = sleep_us * hz / US_PER_S;
+  id->slice_cycles = IDLE_SLICE_US * hz / US_PER_S;
+  id->last_tsc = rte_rdtsc();
+  id->backoff = 1;
+}
+
+/* Monitored waits wake on the next enqueue to r */
+static inline void idle_monitor_ring(struct idle *id, struct rte_ring *r) {
+#ifdef IDLE_HAVE_MONITOR
+  struct rte_cpu_intrinsics intr;
+  rte_cpu_get_intrinsics_support(&intr);
+  if (!intr.power_monitor) return;
+  switch (rte_ring_get_prod_sync_type(r)) {
+    case RTE_RING_SYNC_MT_RTS:
+      id->addr = &r->rts_prod.tail.raw;
+      id->addr_size = sizeof(r->rts_prod.tail.raw);
+      break;
+    case RTE_RING_SYNC_MT_HTS:
+      id->addr = &r->hts_prod.ht.raw;
+      id->addr_size = sizeof(r->hts_prod.ht.raw);
+      break;
+    default:
+      id->addr = &r->prod.tail;
+      id->addr_size = sizeof(r->prod.tail);
+  }
+#else
+  RTE_SET_USED(id);
+  RTE_SET_USED(r);
+#endif
+}
+
+/*
+ * Sleeps wait for an rx interrupt of port/queue. Registers the queue with
+ * this thread's epoll instance, so it runs on the polling lcore. Returns
+ * non-zero when the port has no rx interrupts, sleeps are then timed.
+ */
+static inline int idle_rx_intr(struct idle *id, uint16_t port, uint16_t queue) {
+  id->port = port;
+  id->queue = queue;
+  id->intr = rte_eth_dev_rx_intr_ctl_q(port, queue, RTE_EPOLL_PER_THREAD,
+                                       RTE_INTR_EVENT_ADD, NULL) == 0;
+  return !id->intr;
+}
+
+static inline void idle_monitor(const struct idle *id, uint64_t until) {
+#ifdef IDLE_HAVE_MONITOR
+  const uint64_t mask = id->addr_size == 8 ? UINT64_MAX : UINT32_MAX;
+  const uint64_t cur = id->addr_size == 8 ? *(const volatile uint64_t *)id->addr
+                                          : *(const volatile uint32_t *)id->addr;
+  rte_power_monitor(id->addr, cur, mask, until, id->addr_size);
+#else
+  RTE_SET_USED(id);
+  RTE_SET_USED(until);
+#endif
+}
+
+static inline void idle_wait(struct idle *id, uint64_t now) {
+  const uint64_t idle = now - id->since_tsc;
+
+  if (idle >= id->sleep_cycles) {
+    id->level = IDLE_SLEEP;
+    if (id->intr) {
+      struct rte_epoll_event ev;
+      rte_eth_dev_rx_intr_enable(id->port, id->queue);
+      rte_epoll_wait(RTE_EPOLL_PER_THREAD, &ev, 1, IDLE_INTR_MS);
+      rte_eth_dev_rx_intr_disable(id->port, id->queue);
+    } else if (id->addr != NULL) {
+      idle_monitor(id, now + id->slice_cycles);
+    } else {
+      rte_delay_us_sleep(IDLE_SLICE_US);
+    }
+  } else if (idle >= id->monitor_cycles && id->addr != NULL) {
+    id->level = RTE_MAX(id->level, IDLE_MONITOR);
+    idle_monitor(id, now + id->slice_cycles);
+  } else if (idle >= id->pause_cycles) {
+    id->level = RTE_MAX(id->level, IDLE_PAUSE);
+    for (unsigned i = 0; i < id->backoff; i++) rte_pause();
+    id->backoff = RTE_MIN(id->backoff * 2, (unsigned)IDLE_PAUSE_MAX);
+  } else {
+    return;
+  }
+  stats_add(&id->st->waits[id->level], 1);
+}
+
+/*
+ * Call after every poll that returned n items. Waits when the idle period is
+ * long enough. Returns the deepest level of the idle period the poll ended,
+ * IDLE_POLL while busy.
+ */
+static inline enum idle_level idle_poll(struct idle *id, unsigned n) {
+  const uint64_t now = rte_rdtsc();
+  stats_add(id->busy ? &id->st->busy_cycles : &id->st->idle_cycles,
+            now - id->last_tsc);
+  id->busy = n > 0;
+
+  enum idle_level ended = IDLE_POLL;
+  if (n > 0) {
+    if (id->since_tsc != 0) ended = id->level;
+    id->since_tsc = 0;
+    id->level = IDLE_POLL;
+    id->backoff = 1;
+  } else if (id->sleep_cycles > 0) {
+    if (id->since_tsc == 0) id->since_tsc = now;
+    idle_wait(id, now);
+  }
+  id->last_tsc = rte_rdtsc();
+  /* cycles spent waiting are idle ones */
+  stats_add(&id->st->idle_cycles, id->last_tsc - now);
+  return ended;
+}
+
+/* Age of the oldest packet found when an IDLE_MONITOR or deeper period ends */
+static inline void idle_woken(struct idle *id, uint64_t age) {
+  stats_add(&id->st->wakes, 1);
+  stats_add(&id->st->wake_cycles, age);
+  if (age > id->st->wake_max)
+    __atomic_store_n(&id->st->wake_max, age, __ATOMIC_RELAXED);
+}
+
+/*
+ * Busy share of every polling lcore since the last call, read from the
+ * idle_stats at off in each lcore's size byte block, then the waits of sum.
+ */
+static inline void idle_print(const void *blocks, size_t size, size_t off,
+                              const struct idle_stats *sum) {
+  static struct idle_stats last[RTE_MAX_LCORE];
+  unsigned lcore, n = 0;
+
+  printf("Busy:");
+  RTE_LCORE_FOREACH(lcore) {
+    struct idle_stats cur = {0};
+    idle_stats_sum(&cur, (const struct idle_stats *)((const char *)blocks +
+                                                     (size_t)lcore * size +
+                                                     off));
+    const uint64_t busy = cur.busy_cycles - last[lcore].busy_cycles;
+    const uint64_t all = busy + cur.idle_cycles - last[lcore].idle_cycles;
+    last[lcore] = cur;
+    if (all == 0) continue;
+    printf("%s lcore %u %.1f%%", n++ % 8 == 7 ? "\n     " : "", lcore,
+           100.0 * busy / all);
+  }
+  printf("\n");
+
+  const double us = 1e6 / rte_get_tsc_hz();
+  printf("Idle waits: pause %" PRIu64 " \t monitor %" PRIu64 " \t sleep %" PRIu64
+         " \t wake ups %" PRIu64 ", oldest packet avg %.1f us max %.1f us\n",
+         sum->waits[IDLE_PAUSE], sum->waits[IDLE_MONITOR],
+         sum->waits[IDLE_SLEEP], sum->wakes,
+         sum->wakes ? sum->wake_cycles * us / sum->wakes : 0.0,
+         sum->wake_max * us);
+}
+
+#endif /* IDLE_H */
@@ -0,0 +1,252 @@
+/*
+ * Lcore roles for a pipeline of rx lcores feeding ring workers.
+ *
+ * lcore_plan_build() takes the EAL lcore set, the CPU topology from sysfs
+ * (physical core and L3 of every lcore's cpu) and the packet sources (ports,
+ * or a replay), and gives every source its rx lcores and a share of the
+ * workers:
+ *
+ *   rx       on the source's NUMA node, on a physical core no other hot lcore
+ *            uses, whole cores (no EAL sibling) first
+ *   workers  on the node, sharing an L3 with the source's rx lcores, off the
+ *            rx lcores' SMT siblings, at least one per node with a source
+ *   service  the main lcore, stats and the control threads
+ *
+ * Each rule is a preference: when the EAL set leaves no better lcore the
+ * next free one is used, and lcores taken from another node are flagged
+ * remote. Every lcore gets a struct lcore_assign that stays valid for the
+ * whole run, so its address is the launch argument.
+ */
+#ifndef LCORE_PLAN_H
+#define LCORE_PLAN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+
+#ifndef PLAN_SYSFS_CPU
+#define PLAN_SYSFS_CPU "/sys/devices/system/cpu/cpu%u/"
+#endif
+
+enum lcore_role {
+  ROLE_NONE,
+  ROLE_RX,
+  ROLE_WORKER,
+  ROLE_SERVICE,
+};
+
+struct lcore_assign {
+  enum lcore_role role;
+  unsigned lcore;
+  uint16_t port;   /* rx: the port polled, worker: the one it serves */
+  uint16_t queue;  /* rx queue, rx lcores of a port take 0, 1, ... */
+  unsigned socket; /* node of the pools and ring the lcore works on */
+  int remote;      /* lcore itself sits on another node */
+  /* topology of the lcore's first cpu */
+  unsigned cpu;
+  int core; /* physical core id on the socket, shared by SMT siblings */
+  int llc;  /* L3 cache id, unique across sockets */
+};
+
+struct lcore_plan {
+  struct lcore_assign lcore[RTE_MAX_LCORE];
+  int port_llc[RTE_MAX_ETHPORTS]; /* L3 of the port's first rx lcore */
+  unsigned nb_rx;
+  unsigned nb_workers;
+  unsigned nb_remote;
+  unsigned nb_shared; /* hot lcores sharing a physical core */
+};
+
+/* Node of a port's memory, vdevs without one use the calling lcore's */
+static inline unsigned plan_port_socket(uint16_t port) {
+  const int socket = rte_eth_dev_socket_id(port);
+  return socket < 0 ? rte_socket_id() : (unsigned)socket;
+}
+
+/* First integer of a sysfs file, -1 when it cannot be read */
+static inline int plan_sysfs_int(unsigned cpu, const char *file) {
+  char path[128];
+  int v = -1;
+  snprintf(path, sizeof(path), PLAN_SYSFS_CPU "%s", cpu, file);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return -1;
+  if (fscanf(f, "%d", &v) != 1) v = -1;
+  fclose(f);
+  return v;
+}
+
+/* Without sysfs every cpu is its own core and a node one L3 */
+static inline void plan_topology(struct lcore_assign *a) {
+  const unsigned socket = rte_lcore_to_socket_id(a->lcore);
+  rte_cpuset_t set = rte_lcore_cpuset(a->lcore);
+
+  a->cpu = a->lcore;
+  for (unsigned c = 0; c < CPU_SETSIZE; c++) {
+    if (CPU_ISSET(c, &set)) {
+      a->cpu = c;
+      break;
+    }
+  }
+  a->core = plan_sysfs_int(a->cpu, "topology/core_id");
+  if (a->core < 0) a->core = -(int)a->cpu - 1;
+  a->llc = plan_sysfs_int(a->cpu, "cache/index3/id");
+  if (a->llc < 0) /* older kernels, the first cpu sharing the cache */
+    a->llc = plan_sysfs_int(a->cpu, "cache/index3/shared_cpu_list");
+  if (a->llc < 0) a->llc = -(int)socket - 1;
+}
+
+static inline int plan_same_core(const struct lcore_assign *a,
+                                 const struct lcore_assign *b) {
+  return a->core == b->core &&
+         rte_lcore_to_socket_id(a->lcore) == rte_lcore_to_socket_id(b->lcore);
+}
+
+/* Other EAL lcores on the same physical core, hot ones only if asked */
+static inline unsigned plan_siblings(const struct lcore_plan *plan,
+                                     const struct lcore_assign *a, int hot) {
+  unsigned lcore, n = 0;
+  RTE_LCORE_FOREACH(lcore) {
+    const struct lcore_assign *o = &plan->lcore[lcore];
+    if (o == a || !plan_same_core(o, a)) continue;
+    if (!hot || o->role == ROLE_RX || o->role == ROLE_WORKER) n++;
+  }
+  return n;
+}
+
+/* Lower is better, the weights order the rules of the file comment */
+static inline unsigned plan_score(const struct lcore_plan *plan,
+                                  const struct lcore_assign *a,
+                                  enum lcore_role role, uint16_t port,
+                                  unsigned socket) {
+  unsigned score = rte_lcore_to_socket_id(a->lcore) != socket ? 64 : 0;
+  if (role == ROLE_RX) {
+    score += plan_siblings(plan, a, 1) ? 8 : 0;
+    score += plan_siblings(plan, a, 0) ? 1 : 0;
+  } else {
+    unsigned lcore;
+    RTE_LCORE_FOREACH(lcore) {
+      const struct lcore_assign *o = &plan->lcore[lcore];
+      if (o != a && plan_same_core(o, a) && o->role == ROLE_RX) score += 16;
+    }
+    score += plan->port_llc[port] != a->llc ? 4 : 0;
+    score += plan_siblings(plan, a, 1) ? 2 : 0;
+  }
+  return score;
+}
+
+static inline struct lcore_assign *plan_assign(struct lcore_plan *plan,
+                                               enum lcore_role role,
+                                               uint16_t port, unsigned socket) {
+  struct lcore_assign *best = NULL;
+  unsigned best_score = 0, lcore;
+
+  RTE_LCORE_FOREACH_WORKER(lcore) {
+    struct lcore_assign *a = &plan->lcore[lcore];
+    if (a->role != ROLE_NONE) continue;
+    const unsigned score = plan_score(plan, a, role, port, socket);
+    if (best == NULL || score < best_score) {
+      best = a;
+      best_score = score;
+    }
+  }
+  if (best == NULL) return NULL;
+  best->role = role;
+  best->port = port;
+  best->socket = socket;
+  best->remote = rte_lcore_to_socket_id(best->lcore) != socket;
+  plan->nb_remote += best->remote;
+  plan->nb_shared += plan_siblings(plan, best, 1) > 0;
+  return best;
+}
+
+/* First index in sockets[0..n) holding sockets[i], i itself when unique */
+static inline unsigned plan_socket_first(const unsigned *sockets, unsigned i) {
+  unsigned j = 0;
+  while (sockets[j] != sockets[i]) j++;
+  return j;
+}
+
+/* Nodes among the nb_ports sources, the fewest workers a plan can have */
+static inline unsigned plan_nb_sockets(const unsigned *sockets,
+                                       unsigned nb_ports) {
+  unsigned n = 0;
+  for (unsigned p = 0; p < nb_ports; p++)
+    n += plan_socket_first(sockets, p) == p;
+  return n;
+}
+
+/*
+ * rx_per_port[i] rx lcores for each of the nb_ports sources, then up to
+ * nb_workers workers: one for the first source of every node, since nothing
+ * else drains the node's ring, and the rest round robin over the sources.
+ * sockets[i] is the node of ports[i]. Fails when not every rx lcore can be
+ * placed, or when nb_workers > 0 and a node is left without a worker; fewer
+ * workers than asked for is not an error otherwise.
+ */
+static inline int lcore_plan_build(struct lcore_plan *plan,
+                                   const uint16_t *ports,
+                                   const unsigned *sockets,
+                                   const uint16_t *rx_per_port,
+                                   unsigned nb_ports, unsigned nb_workers) {
+  unsigned lcore;
+
+  memset(plan, 0, sizeof(*plan));
+  RTE_LCORE_FOREACH(lcore) {
+    plan->lcore[lcore].lcore = lcore;
+    plan_topology(&plan->lcore[lcore]);
+  }
+  plan->lcore[rte_get_main_lcore()].role = ROLE_SERVICE;
+
+  for (unsigned p = 0; p < nb_ports; p++) {
+    for (uint16_t q = 0; q < rx_per_port[p]; q++) {
+      struct lcore_assign *a = plan_assign(plan, ROLE_RX, ports[p], sockets[p]);
+      if (a == NULL) return -1;
+      a->queue = q;
+      if (q == 0) plan->port_llc[ports[p]] = a->llc;
+      plan->nb_rx++;
+    }
+  }
+  if (nb_workers == 0) return 0;
+  for (unsigned p = 0; p < nb_ports; p++) {
+    if (plan_socket_first(sockets, p) != p) continue;
+    if (plan->nb_workers == nb_workers ||
+        plan_assign(plan, ROLE_WORKER, ports[p], sockets[p]) == NULL)
+      return -1;
+    plan->nb_workers++;
+  }
+  for (unsigned w = 0; plan->nb_workers < nb_workers && nb_ports > 0; w++) {
+    const unsigned p = w % nb_ports;
+    if (plan_assign(plan, ROLE_WORKER, ports[p], sockets[p]) == NULL) break;
+    plan->nb_workers++;
+  }
+  return 0;
+}
+
+static inline void lcore_plan_print(const struct lcore_plan *plan) {
+  static const char *const names[] = {"-", "rx", "worker", "service"};
+  unsigned lcore;
+
+  printf("Lcore plan: %u rx, %u workers\n", plan->nb_rx, plan->nb_workers);
+  printf("  lcore   cpu  socket  core      L3  role     port queue\n");
+  RTE_LCORE_FOREACH(lcore) {
+    const struct lcore_assign *a = &plan->lcore[lcore];
+    printf("  %5u %5u %7u %5d %7d  %-8s", lcore, a->cpu,
+           rte_lcore_to_socket_id(lcore), RTE_MAX(a->core, -1),
+           RTE_MAX(a->llc, -1), names[a->role]);
+    if (a->role == ROLE_RX)
+      printf(" %4u %5u", a->port, a->queue);
+    else if (a->role == ROLE_WORKER)
+      printf(" %4u %5s", a->port, "");
+    if (a->role == ROLE_RX || a->role == ROLE_WORKER) {
+      if (plan_siblings(plan, a, 1)) printf("  SMT-SHARED");
+      if (a->remote) printf("  REMOTE socket %u", a->socket);
+    }
+    printf("\n");
+  }
+}
+
+#endif /* LCORE_PLAN_H */
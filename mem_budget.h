@@ -0,0 +1,228 @@
+/*
+ * Startup sizing of pools and rings against a hugepage budget.
+ *
+ * Rings are sized from traffic instead of constants: a ring has to absorb
+ * latency_us of expected_pps while its consumer stalls, rounded up to a
+ * power of two. Pools are then sized from what can hold their objects at
+ * once (rx descriptors, rings, lcore caches, bursts in flight), and the
+ * estimates below are checked against the budget of each NUMA node before
+ * anything is created. The budget defaults to the free hugepage memory of
+ * the node, mapped by the heap or not.
+ *
+ * Allocations whose size does not depend on the traffic are booked with
+ * mem_reserve() and stay booked while pools and rings are resized.
+ *
+ * Created pools and rings are recorded and mem_report() prints the memory
+ * each one really takes, memzone headers included; other allocations are
+ * recorded with the bytes they were booked for.
+ */
+#ifndef MEM_BUDGET_H
+#define MEM_BUDGET_H
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_mbuf.h>
+#include <rte_memzone.h>
+#include <rte_mempool.h>
+#include <rte_ring.h>
+
+#define MEM_MAX_ITEMS 256 /**< Pools, rings and tables mem_report() lists */
+#define MEM_RING_MIN 1024        /**< Smallest packet ring, a few bursts */
+#define MEM_RING_MAX (1u << 20)  /**< Largest ring sized from traffic */
+#define MEM_BUDGET_MAX_MB (1u << 24) /**< Largest -M, 16 TB per node */
+#define MEM_PPS_MAX 1000000000ull    /**< Largest -P */
+#define MEM_LATENCY_MAX_US 10000000  /**< Largest -W, 10 s */
+
+struct mem_item {
+  char name[RTE_MEMZONE_NAMESIZE];
+  int socket;
+  unsigned count;    /* objects or ring slots */
+  unsigned elt_size; /* 0 for rings */
+  size_t bytes;
+};
+
+struct mem_budget {
+  size_t limit[RTE_MAX_NUMA_NODES]; /* per node, 0 when unknown */
+  size_t planned[RTE_MAX_NUMA_NODES];
+  size_t reserved[RTE_MAX_NUMA_NODES]; /* kept by mem_unplan() */
+  struct mem_item item[MEM_MAX_ITEMS];
+  unsigned nb;
+};
+
+/* Bytes in the free pages of every hugepage size under dir */
+static inline size_t mem_hugepages_free(const char *dir) {
+  DIR *d = opendir(dir);
+  struct dirent *e;
+  size_t bytes = 0;
+
+  if (d == NULL) return 0;
+  while ((e = readdir(d)) != NULL) {
+    char path[PATH_MAX];
+    unsigned long kb, pages;
+    if (sscanf(e->d_name, "hugepages-%lukB", &kb) != 1) continue;
+    snprintf(path, sizeof(path), "%s/%s/free_hugepages", dir, e->d_name);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) continue;
+    if (fscanf(f, "%lu", &pages) == 1) bytes += (size_t)pages * kb << 10;
+    fclose(f);
+  }
+  closedir(d);
+  return bytes;
+}
+
+/*
+ * Free hugepage memory of a node: what its heap has mapped and not used,
+ * plus the free pages the kernel still holds. In the default dynamic memory
+ * mode the heap maps pages as it grows, so at startup most of the memory is
+ * in the second part. 0 when neither can be read, which leaves the node
+ * without a limit.
+ */
+static inline size_t mem_socket_free(int socket) {
+  struct rte_malloc_socket_stats st;
+  char dir[64];
+  size_t bytes;
+
+  snprintf(dir, sizeof(dir), "/sys/devices/system/node/node%d/hugepages",
+           socket);
+  bytes = mem_hugepages_free(dir);
+  if (bytes == 0 && socket == 0 && rte_socket_count() <= 1)
+    bytes = mem_hugepages_free("/sys/kernel/mm/hugepages");
+  if (rte_malloc_get_socket_stats(socket, &st) == 0)
+    bytes += st.heap_freesz_bytes;
+  return bytes;
+}
+
+/* budget_mb per node, 0 takes what each node has free */
+static inline void mem_budget_init(struct mem_budget *b, unsigned budget_mb) {
+  memset(b, 0, sizeof(*b));
+  for (int s = 0; s < RTE_MAX_NUMA_NODES; s++)
+    b->limit[s] = budget_mb > 0 ? (size_t)budget_mb << 20 : mem_socket_free(s);
+}
+
+/* Power of two ring holding latency_us of pps, clamped to [min, max].
+ * pps and latency_us are bounded by MEM_PPS_MAX and MEM_LATENCY_MAX_US,
+ * their product stays well inside 64 bits. */
+static inline unsigned mem_ring_entries(uint64_t pps, unsigned latency_us,
+                                        unsigned min, unsigned max) {
+  const uint64_t n = pps * latency_us / US_PER_S;
+  return rte_align32pow2(RTE_MIN(RTE_MAX(n, (uint64_t)min), (uint64_t)max));
+}
+
+static inline size_t mem_ring_bytes(unsigned count) {
+  const ssize_t sz = rte_ring_get_memsize(rte_align32pow2(count));
+  return sz < 0 ? 0 : (size_t)sz;
+}
+
+/* Objects, their ring and the header with the lcore caches */
+static inline size_t mem_pool_bytes(unsigned n, unsigned elt_size) {
+  return (size_t)n * rte_mempool_calc_obj_size(elt_size, 0, NULL) +
+         mem_ring_bytes(n + 1) + sizeof(struct rte_mempool) +
+         RTE_MAX_LCORE * sizeof(struct rte_mempool_cache);
+}
+
+static inline unsigned mem_pktmbuf_elt(unsigned data_room) {
+  return sizeof(struct rte_mbuf) + data_room;
+}
+
+/*
+ * Books bytes on a node before the pool or ring is created. Returns -1 once
+ * the node's budget is exceeded, the booking stays so the caller can shrink
+ * and book again after mem_unplan().
+ */
+static inline int mem_plan(struct mem_budget *b, int socket, size_t bytes) {
+  const int s = socket < 0 ? 0 : socket;
+  b->planned[s] += bytes;
+  return b->limit[s] > 0 && b->planned[s] > b->limit[s] ? -1 : 0;
+}
+
+/* Drops what was booked with mem_plan() on a node, keeps the reservations */
+static inline void mem_unplan(struct mem_budget *b, int socket) {
+  const int s = socket < 0 ? 0 : socket;
+  b->planned[s] = b->reserved[s];
+}
+
+/* mem_plan() for memory of a fixed size, booked for good */
+static inline int mem_reserve(struct mem_budget *b, int socket, size_t bytes) {
+  b->reserved[socket < 0 ? 0 : socket] += bytes;
+  return mem_plan(b, socket, bytes);
+}
+
+static inline struct mem_item *mem_item_add(struct mem_budget *b,
+                                            const char *name, int socket) {
+  if (b->nb == MEM_MAX_ITEMS) return NULL;
+  struct mem_item *it = &b->item[b->nb++];
+  snprintf(it->name, sizeof(it->name), "%s", name);
+  it->socket = socket;
+  return it;
+}
+
+static void mem_chunk_len(struct rte_mempool *mp __rte_unused, void *opaque,
+                          struct rte_mempool_memhdr *memhdr,
+                          unsigned mem_idx __rte_unused) {
+  *(size_t *)opaque += memhdr->len;
+}
+
+/* Records a created pool, its chunks and header memzone */
+static inline void mem_add_pool(struct mem_budget *b, struct rte_mempool *mp) {
+  if (mp == NULL) return;
+  struct mem_item *it = mem_item_add(b, mp->name, mp->socket_id);
+  if (it == NULL) return;
+  it->count = mp->size;
+  it->elt_size = mp->elt_size;
+  it->bytes = mp->mz != NULL ? mp->mz->len : 0;
+  rte_mempool_mem_iter(mp, mem_chunk_len, &it->bytes);
+  it->bytes += mem_ring_bytes(mp->size + 1);
+}
+
+/* Records another allocation of count elt_size objects */
+static inline void mem_add_bytes(struct mem_budget *b, const char *name,
+                                 int socket, unsigned count, unsigned elt_size,
+                                 size_t bytes) {
+  struct mem_item *it = mem_item_add(b, name, socket);
+  if (it == NULL) return;
+  it->count = count;
+  it->elt_size = elt_size;
+  it->bytes = bytes;
+}
+
+static inline void mem_add_ring(struct mem_budget *b,
+                                const struct rte_ring *r) {
+  if (r == NULL) return;
+  const int socket = r->memzone != NULL ? r->memzone->socket_id : SOCKET_ID_ANY;
+  struct mem_item *it = mem_item_add(b, r->name, socket);
+  if (it == NULL) return;
+  it->count = rte_ring_get_size(r);
+  it->bytes = r->memzone != NULL ? r->memzone->len : mem_ring_bytes(it->count);
+}
+
+/* Table of the recorded pools, rings and tables, totals against the budget */
+static inline void mem_report(const struct mem_budget *b) {
+  size_t used[RTE_MAX_NUMA_NODES] = {0};
+
+  printf("Memory: %-28s %6s %10s %8s %10s\n", "pool/ring/table", "socket", "count",
+         "elt", "MB");
+  for (unsigned i = 0; i < b->nb; i++) {
+    const struct mem_item *it = &b->item[i];
+    printf("        %-28s %6d %10u %8u %10.1f\n", it->name, it->socket,
+           it->count, it->elt_size, it->bytes / 1048576.0);
+    used[it->socket < 0 ? 0 : it->socket] += it->bytes;
+  }
+  for (int s = 0; s < RTE_MAX_NUMA_NODES; s++) {
+    if (used[s] == 0) continue;
+    printf("        socket %d: %.1f MB", s, used[s] / 1048576.0);
+    if (b->limit[s] > 0)
+      printf(" of %.1f MB budget", b->limit[s] / 1048576.0);
+    printf("\n");
+  }
+}
+
+#endif /* MEM_BUDGET_H */
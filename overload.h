@@ -0,0 +1,173 @@
+/*
+ * Overload policies for an rx lcore handing bursts to a ring that is full.
+ *
+ *   OVERLOAD_TAIL   the packets of a burst that do not fit are dropped
+ *   OVERLOAD_HEAD   the oldest ring entries are dropped to make room, so the
+ *                   consumers see the newest traffic; the producer dequeues
+ *                   them itself, so the ring must be multi-consumer
+ *   OVERLOAD_PAUSE  nothing is dropped: the producer waits for room and does
+ *                   not poll its rx queue meanwhile, the NIC drops into
+ *                   imissed once its descriptors run out
+ *   OVERLOAD_CLASS  the last reserve free slots are kept for control packets
+ *                   (non-IP, ICMP, TCP SYN/FIN/RST), bulk traffic is dropped
+ *                   first
+ *
+ * overload_enqueue() takes a whole burst. What the ring did not take is left
+ * at the end of the burst and any ring entries dropped for it are given back,
+ * so the caller releases both with one bulk call each. Every decision is
+ * counted.
+ */
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_icmp.h>
+#include <rte_pause.h>
+#include <rte_ring.h>
+#include <rte_tcp.h>
+
+#include "pkt_parse.h"
+#include "stats.h"
+
+#define OVERLOAD_RESERVE_DIV 8 /**< Ring share kept for control packets */
+
+enum overload_policy {
+  OVERLOAD_TAIL,
+  OVERLOAD_HEAD,
+  OVERLOAD_PAUSE,
+  OVERLOAD_CLASS,
+  OVERLOAD_POLICIES,
+};
+
+static const char *const overload_names[OVERLOAD_POLICIES] = {
+    "tail", "head", "pause", "class"};
+
+/* Per-lcore counters, one writer */
+struct overload_stats {
+  uint64_t tail_drops;   /* not taken by the ring */
+  uint64_t head_drops;   /* old ring entries dropped for newer ones */
+  uint64_t class_drops;  /* bulk packets refused to keep the reserve */
+  uint64_t pauses;       /* bursts that waited for room */
+  uint64_t pause_cycles; /* rx polling stopped for */
+};
+
+struct overload {
+  enum overload_policy policy;
+  unsigned reserve;          /* OVERLOAD_CLASS free slots for control */
+  const volatile char *stop; /* OVERLOAD_PAUSE gives up once set */
+};
+
+/* Policy by name, -1 when unknown */
+static inline int overload_parse(const char *name) {
+  for (int p = 0; p < OVERLOAD_POLICIES; p++)
+    if (strcmp(name, overload_names[p]) == 0) return p;
+  return -1;
+}
+
+/* capacity is the ring's, the control reserve is a share of it */
+static inline void overload_init(struct overload *ol,
+                                 enum overload_policy policy,
+                                 unsigned capacity, const volatile char *stop) {
+  ol->policy = policy;
+  ol->reserve = capacity / OVERLOAD_RESERVE_DIV;
+  ol->stop = stop;
+}
+
+/* Total dropped by the policies, for the existing ring drop counters */
+static inline uint64_t overload_drops(const struct overload_stats *st) {
+  return st->tail_drops + st->head_drops + st->class_drops;
+}
+
+/* ctl[i] is set for the control class packets of a parsed burst */
+static inline void overload_classify(const struct parse_burst *pb,
+                                     uint8_t *ctl) {
+  for (uint16_t i = 0; i < pb->n; i++) {
+    const uint8_t f = pb->flags[i];
+    if (f & PARSE_F_BAD)
+      ctl[i] = 0;
+    else if (!(f & (PARSE_F_IPV4 | PARSE_F_IPV6)))
+      ctl[i] = 1; /* ARP, LLDP, ... */
+    else
+      ctl[i] = pb->proto[i] == IPPROTO_ICMP || pb->proto[i] == IPPROTO_ICMPV6 ||
+               (pb->tcp_flags[i] &
+                (RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG | RTE_TCP_RST_FLAG));
+  }
+}
+
+/*
+ * Moves the bulk packets that do not fit above the reserve to the end of
+ * objs, keeping the order of the rest. Returns how many stay.
+ */
+static inline unsigned overload_admit(const struct overload *ol,
+                                      struct rte_ring *r, void **objs,
+                                      const uint8_t *ctl, unsigned n) {
+  const unsigned free = rte_ring_free_count(r);
+  unsigned room = free > ol->reserve ? free - ol->reserve : 0;
+  void *refused[n];
+  unsigned nb_keep = 0, nb_refused = 0;
+
+  if (room >= n) return n;
+  for (unsigned i = 0; i < n; i++) {
+    if (ctl[i] || room > 0) {
+      room -= !ctl[i];
+      objs[nb_keep++] = objs[i];
+    } else {
+      refused[nb_refused++] = objs[i];
+    }
+  }
+  memcpy(&objs[nb_keep], refused, nb_refused * sizeof(*refused));
+  return nb_keep;
+}
+
+/* OVERLOAD_PAUSE: retries until everything is taken or the run stops */
+static inline unsigned overload_wait(const struct overload *ol,
+                                     struct rte_ring *r, void **objs,
+                                     unsigned nb, unsigned n,
+                                     struct overload_stats *st) {
+  const uint64_t start = rte_rdtsc();
+  stats_add(&st->pauses, 1);
+  while (nb < n && !*ol->stop) {
+    rte_pause();
+    nb += rte_ring_enqueue_burst(r, &objs[nb], n - nb, NULL);
+  }
+  stats_add(&st->pause_cycles, rte_rdtsc() - start);
+  return nb;
+}
+
+/*
+ * Enqueues a burst of n under the policy and returns how many the ring
+ * took; objs[ret..n) were not taken. OVERLOAD_HEAD puts the entries it
+ * dropped in old (room for n), their number in *nb_old. ctl is only read
+ * by OVERLOAD_CLASS and may be NULL otherwise.
+ */
+static inline unsigned overload_enqueue(const struct overload *ol,
+                                        struct rte_ring *r, void **objs,
+                                        const uint8_t *ctl, unsigned n,
+                                        void **old, unsigned *nb_old,
+                                        struct overload_stats *st) {
+  unsigned nb_try = n, nb;
+
+  *nb_old = 0;
+  if (ol->policy == OVERLOAD_HEAD) {
+    const unsigned free = rte_ring_free_count(r);
+    if (free < n) {
+      *nb_old = rte_ring_dequeue_burst(r, old, n - free, NULL);
+      if (*nb_old) stats_add(&st->head_drops, *nb_old);
+    }
+  } else if (ol->policy == OVERLOAD_CLASS) {
+    nb_try = overload_admit(ol, r, objs, ctl, n);
+    if (nb_try < n) stats_add(&st->class_drops, n - nb_try);
+  }
+
+  nb = rte_ring_enqueue_burst(r, objs, nb_try, NULL);
+  if (unlikely(nb < nb_try) && ol->policy == OVERLOAD_PAUSE)
+    nb = overload_wait(ol, r, objs, nb, nb_try, st);
+  if (unlikely(nb < nb_try)) stats_add(&st->tail_drops, nb_try - nb);
+  return nb;
+}
+
+#endif /* OVERLOAD_H */
@@ -1,46 +1,215 @@
+#define _GNU_SOURCE /* O_DIRECT in capture.h */
+#include <errno.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <rte_cycles.h>
 #include <rte_eal.h>
+#include <rte_errno.h>
 #include <rte_ethdev.h>
+#include <rte_hash_crc.h>
 #include <rte_lcore.h>
 #include <rte_malloc.h>
 #include <rte_mbuf.h>
+#include <rte_mbuf_dyn.h>
+#include <rte_mempool.h>
 #include <rte_ring.h>
+#include <rte_telemetry.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "capture.h"
+#include "pkt_parse.h"
+#include "pcap_replay.h"
+#include "pkt_filter.h"
+#include "idle.h"
+#include "lcore_plan.h"
+#include "mem_budget.h"
+#include "event_sched.h"
+#include "reorder_merge.h"
+#include "overload.h"
+#include "stats.h"
+
+/* Defaults of the run time options, see usage() */
 #define RX_RING_SIZE 4096
 #define TX_RING_SIZE 16384
-#define MBUFS 8191
 #define MBUF_CACHE 256
-#define MBUFSZ (2048 + sizeof(struct rte_mbuf) + RTE_PKTMBUF_HEADROOM)
-#define LCORE_QUEUESZ 4194304
+#ifndef BURST_SIZE
 #define BURST_SIZE 32
+#endif
+#define BURST_MAX PARSE_BURST_MAX /**< Largest --burst, sizes the burst arrays */
 
-#define RING_SIZE 1048576
+#ifndef RING_SIZE
+#define RING_SIZE 0 /**< packet_ring slots, 0 sizes it from -P and -W */
+#endif
+#define RING_LATENCY_US 1000 /**< Consumer stall packet_ring absorbs, -W */
+#define RING_PPS 14880000    /**< Expected packets per second per node, -P */
+#define NB_MBUF_MIN 8192
+#ifndef NB_WORKERS
+#define NB_WORKERS 10 /**< open_packets() lcores */
+#endif
+#define RX_LCORES_PER_PORT 2 /**< Rx queues and lcores per port with RSS */
+#define RX_RSS_HF (ETH_RSS_IP | ETH_RSS_UDP | ETH_RSS_TCP)
+#ifndef IDLE_SLEEP_US
+#define IDLE_SLEEP_US 1000 /**< Idle period before lcores sleep, -I */
+#endif
 #define MEMPOOL_CACHE_SIZE 256
-#define MAX_PKT_BURST 32
-#define RTE_TEST_RX_DESC_DEFAULT 4096  /**< Configurable number of RX ring descriptors */
-#define RTE_TEST_TX_DESC_DEFAULT 16384 /**< Configurable number of TX ring descriptors */
-
-#define NB_MBUF RTE_MAX(                    \
-        (nb_ports * nb_rx_queue * nb_rxd +      \
-         nb_ports * nb_lcores * MAX_PKT_BURST + \
-         nb_ports * n_tx_queue * nb_txd +       \
-         nb_lcores * MEMPOOL_CACHE_SIZE),       \
-         (unsigned)8192)
+#define PACKET_DATA_SIZE RTE_ETHER_MAX_LEN /**< Default snaplen, max frame */
+#define JUMBO_FRAME_MAX 9600               /**< Frame size accepted with -S */
+#define RETAIN_MAX 64                      /**< Packets a worker may hold past its burst */
+#define RETAIN_DEADLINE_US 100             /**< Retained mbufs older than this are copied out */
+#define RETAIN_EVERY_MAX (1u << 30)        /**< Sparsest retain sampling, -r */
+#define RETAIN_DEADLINE_MAX_US 60000000    /**< Longest -d, a minute */
+#define MERGE_BURST 64                     /**< Mbufs the merge stage takes per poll */
 
 static uint8_t nb_ports;
-static volatile unsigned long packets_rx;
-static volatile unsigned long packets_processed;
-static uint64_t timer_period = 3;
-static uint64_t timer_cycles;
+static uint64_t timer_period = 3; /* --stats, seconds, 0 prints none */
+static uint16_t burst_size = BURST_SIZE;
+static uint16_t rx_ring_size = RX_RING_SIZE; /* rx descriptors per queue */
+static unsigned ring_size_fixed = RING_SIZE;
+static unsigned mbuf_cache = MBUF_CACHE;
+static uint16_t rx_queues = RX_LCORES_PER_PORT;
+static unsigned nb_workers = NB_WORKERS;
 static volatile char is_stop = 0;
-unsigned int free_space = LCORE_QUEUESZ;
-unsigned int free_space2 = LCORE_QUEUESZ;
+static uint64_t start_tsc; /* set when the lcores are launched */
+unsigned int free_space;
 struct rte_ring *queue;
-struct rte_ring *packet_ring;
+
+/* Pools and packet_ring of one NUMA node, for the lcores planned on it */
+struct numa_node {
+  struct rte_mempool *mbuf_pool;
+  struct rte_mempool *small_pool; /* -S, headers, mbuf_pool the rest */
+  struct rte_mempool *packet_pool;
+  struct rte_ring *packet_ring;
+};
+static struct numa_node numa_nodes[RTE_MAX_NUMA_NODES];
+static struct lcore_plan plan;
+static uint16_t port_rx_queues[RTE_MAX_ETHPORTS]; /* one rx lcore each */
+
+/* What rx_packets() puts on packet_ring */
+enum handoff_mode {
+  HANDOFF_COPY,     /* struct packet slots, mbuf freed on rx lcore */
+  HANDOFF_ZEROCOPY, /* the rte_mbuf itself, freed by open_packets() */
+};
+static enum handoff_mode handoff_mode = HANDOFF_COPY;
+
+/* How workers get what rx lcores hand off */
+enum sched_mode {
+  SCHED_RING,  /* packet_ring of the node, any worker takes any packet */
+  SCHED_EVENT, /* atomic event queue, a flow is on one worker at a time */
+};
+static enum sched_mode sched_mode = SCHED_RING;
+static struct event_sched evs;
+static unsigned reorder_window; /* -O, 0 leaves packets unordered */
+static struct merge *merge;
+static struct overload overload; /* -b, what rx does when workers fall behind */
+static uint16_t merge_src_of[RTE_MAX_LCORE]; /* rx lcore to reorder source */
+static struct replay *replay; /* -R, stands in for the ports */
+static const char *replay_path;
+static enum replay_timing replay_timing = REPLAY_FAST;
+static uint64_t replay_rate;
+static unsigned replay_loops = 1;
+static int replay_copy;
+static struct pkt_filter *filter; /* -f, NULL keeps everything */
+static const char *filter_spec;
+static uint16_t snaplen = PACKET_DATA_SIZE; /* -s, bytes copied per frame */
+static uint16_t small_data_room;           /* -S, 0 keeps one pool */
+static uint64_t idle_sleep_us = IDLE_SLEEP_US; /* 0 polls all the time */
+static unsigned mem_budget_mb;                 /* -M, 0 is the free memory */
+static uint64_t ring_pps = RING_PPS;
+static unsigned ring_latency_us = RING_LATENCY_US;
+static struct mem_budget mem;
+static int hw_ptype = 1;       /* every port fills in mbuf->packet_type */
+static unsigned retain_every;  /* 0 disables the retain sampling consumer */
+static uint64_t retain_cycles;
+
+/* pcapng sink per open_packets() lcore when started with -c PREFIX */
+static const char *capture_prefix;
+static struct capture *captures[RTE_MAX_LCORE];
+static pthread_t capture_tids[RTE_MAX_LCORE];
+static uint64_t capture_bytes_last;
+
+/* Counters written only by the owning lcore, summed by print_stats() */
+struct lcore_stats {
+  uint64_t rx;
+  uint64_t enqueued;
+  uint64_t ring_drops;
+  uint64_t processed;
+  uint64_t bytes;
+  uint64_t non_ip;    /* parsed as neither IPv4 nor IPv6 */
+  uint64_t malformed; /* PARSE_F_BAD */
+  uint64_t alloc_fails; /* packet_pool exhausted */
+  uint64_t retain_copies;
+  uint64_t captured;
+  uint64_t capture_drops; /* no free capture buffer, storage too slow */
+  uint64_t filter_match;
+  uint64_t filter_reject; /* freed at rx, never copied or enqueued */
+  struct idle_stats idle;
+  uint64_t numa_remote; /* handled by an lcore off its memory's node */
+  struct merge_stats reorder;
+  struct overload_stats overload; /* ring_drops is their drops summed */
+} __rte_cache_aligned;
+static struct lcore_stats lcore_stats[RTE_MAX_LCORE];
+
+static struct lcore_stats stats_last; /* print_stats() rates are deltas */
+
+#define LCORE_STAT(member) STATS_FIELD(struct lcore_stats, member)
+#define LCORE_STAT_AS(name, member) \
+  STATS_FIELD_AS(name, struct lcore_stats, member)
+
+/* Summed by stats_sum(), also the keys of /packet_copy/stats */
+static const struct stats_field stats_fields[] = {
+    LCORE_STAT(rx),
+    LCORE_STAT(enqueued),
+    LCORE_STAT(ring_drops),
+    LCORE_STAT(processed),
+    LCORE_STAT(bytes),
+    LCORE_STAT(alloc_fails),
+    LCORE_STAT(non_ip),
+    LCORE_STAT(malformed),
+    LCORE_STAT(retain_copies),
+    LCORE_STAT(captured),
+    LCORE_STAT(capture_drops),
+    LCORE_STAT(filter_match),
+    LCORE_STAT(filter_reject),
+    LCORE_STAT(numa_remote),
+    LCORE_STAT_AS("reorder_ordered", reorder.ordered),
+    LCORE_STAT_AS("reorder_late", reorder.late),
+    LCORE_STAT_AS("reorder_drops", reorder.drops),
+    LCORE_STAT_AS("tail_drops", overload.tail_drops),
+    LCORE_STAT_AS("head_drops", overload.head_drops),
+    LCORE_STAT_AS("class_drops", overload.class_drops),
+    LCORE_STAT_AS("rx_pauses", overload.pauses),
+    LCORE_STAT_AS("rx_pause_cycles", overload.pause_cycles),
+    LCORE_STAT_AS("busy_cycles", idle.busy_cycles),
+    LCORE_STAT_AS("idle_cycles", idle.idle_cycles),
+    LCORE_STAT_AS("idle_pause_waits", idle.waits[IDLE_PAUSE]),
+    LCORE_STAT_AS("idle_monitor_waits", idle.waits[IDLE_MONITOR]),
+    LCORE_STAT_AS("idle_sleep_waits", idle.waits[IDLE_SLEEP]),
+    LCORE_STAT_AS("idle_wakes", idle.wakes),
+    LCORE_STAT_AS("idle_wake_cycles", idle.wake_cycles),
+    STATS_FIELD_MAX("idle_wake_max", struct lcore_stats, idle.wake_max),
+};
+
+/* Count the non-IP and malformed packets of a parsed burst */
+static inline void stats_parsed(struct lcore_stats *stats,
+                                const struct parse_burst *pb) {
+  uint64_t non_ip = 0, bad = 0;
+  for (uint16_t i = 0; i < pb->n; i++) {
+    non_ip += !(pb->flags[i] & (PARSE_F_IPV4 | PARSE_F_IPV6 | PARSE_F_BAD));
+    bad += !!(pb->flags[i] & PARSE_F_BAD);
+  }
+  if (non_ip) stats_add(&stats->non_ip, non_ip);
+  if (bad) stats_add(&stats->malformed, bad);
+}
+
+static void stats_sum(struct lcore_stats *sum) {
+  stats_sum_lcores(sum, lcore_stats, sizeof(*sum), stats_fields,
+                   RTE_DIM(stats_fields));
+}
 
 static const struct rte_eth_conf port_conf_default = {
     .rxmode =
@@ -49,16 +218,61 @@ static const struct rte_eth_conf port_conf_default = {
         },
 };
 
+/* Copy slot taken from packet_pool, header followed by the frame bytes */
 struct packet {
+  uint64_t rx_tsc; /* TSC of the rx burst the frame came in */
+  uint32_t ptype;  /* mbuf->packet_type */
   int size;
-  u_char *data;
+  uint32_t pkt_len; /* on the wire, size may be less */
+  uint16_t port;
+  u_char data[];
+};
+
+/* Same stamp for mbufs handed off in zero-copy mode */
+static int rx_tsc_dynfield = -1;
+static const struct rte_mbuf_dynfield rx_tsc_dynfield_desc = {
+    .name = "packet_copy_dynfield_rx_tsc",
+    .size = sizeof(uint64_t),
+    .align = __alignof__(uint64_t),
+};
+
+static inline uint64_t *rx_tsc(struct rte_mbuf *m) {
+  return RTE_MBUF_DYNFIELD(m, rx_tsc_dynfield, uint64_t *);
+}
+
+/*
+ * Packet a zero-copy consumer keeps after its burst. The mbuf is held
+ * until the deadline, then copied into a packet_pool slot so the rx pool
+ * is not drained by slow consumers.
+ */
+struct retained {
+  struct rte_mbuf *m;
+  struct packet *p;
+  uint64_t tsc;
 };
 
+struct lcore_latency {
+  struct latency_hist dwell; /* rx burst to ring dequeue */
+  struct latency_hist total; /* rx burst to processing done */
+  struct latency_hist ordered; /* rx burst to leaving the merge stage */
+} __rte_cache_aligned;
+static struct lcore_latency lcore_latency[RTE_MAX_LCORE];
+
+static void print_latency(void) {
+  const size_t size = sizeof(struct lcore_latency);
+  hist_print_lcores("Ring dwell", lcore_latency, size,
+                    offsetof(struct lcore_latency, dwell));
+  hist_print_lcores("Rx to done", lcore_latency, size,
+                    offsetof(struct lcore_latency, total));
+  hist_print_lcores("Rx to ordered", lcore_latency, size,
+                    offsetof(struct lcore_latency, ordered));
+}
+
 int port_init(uint16_t port, struct rte_mempool *membuf_pool) {
   struct rte_eth_conf port_conf = port_conf_default;
-  const uint16_t rx_rings = 1;
+  const uint16_t rx_rings = port_rx_queues[port];
   const uint16_t tx_rings = 0;
-  uint16_t nb_rxd = RX_RING_SIZE;
+  uint16_t nb_rxd = rx_ring_size;
   uint16_t nb_txd = TX_RING_SIZE;
   int ret;
 
@@ -81,20 +295,70 @@ int port_init(uint16_t port, struct rte_mempool *membuf_pool) {
 
   printf("Dev adjust rx-tx success [%u]\n", port);
 
+  // Small data room: headers land in small_pool mbufs, the rest of a frame
+  // in membuf_pool ones with buffer split, or in chained small mbufs with
+  // scatter. Either way jumbo frames are taken.
+  struct rte_eth_rxconf rxconf = dev_info.default_rxconf;
+  union rte_eth_rxseg rx_seg[2] = {0};
+  struct rte_mempool *rx_pool = membuf_pool;
+  struct rte_mempool *small_pool =
+      numa_nodes[plan_port_socket(port)].small_pool;
+  if (small_pool != NULL) {
+    const uint64_t capa = dev_info.rx_offload_capa;
+    if (capa & RTE_ETH_RX_OFFLOAD_BUFFER_SPLIT) {
+      rx_seg[0].split.mp = small_pool;
+      rx_seg[0].split.length = small_data_room;
+      rx_seg[1].split.mp = membuf_pool;
+      rxconf.rx_seg = rx_seg;
+      rxconf.rx_nseg = 2;
+      rxconf.offloads |= RTE_ETH_RX_OFFLOAD_BUFFER_SPLIT;
+      rx_pool = NULL;
+      printf("Port %u splits frames after %u bytes\n", port, small_data_room);
+    } else if (capa & DEV_RX_OFFLOAD_SCATTER) {
+      port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_SCATTER;
+      rx_pool = small_pool;
+      printf("Port %u scatters frames over %u byte mbufs\n", port,
+             small_data_room);
+    } else {
+      printf("Port %u can neither split nor scatter, using full mbufs\n",
+             port);
+    }
+    if (rx_pool != membuf_pool && (capa & DEV_RX_OFFLOAD_JUMBO_FRAME)) {
+      port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_JUMBO_FRAME;
+      port_conf.rxmode.max_rx_pkt_len =
+          RTE_MIN((uint32_t)JUMBO_FRAME_MAX, dev_info.max_rx_pktlen);
+    }
+  }
+
+  // Several rx lcores each get an RSS queue of their own
+  if (rx_rings > 1) {
+    port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+    port_conf.rx_adv_conf.rss_conf.rss_hf =
+        RX_RSS_HF & dev_info.flow_type_rss_offloads;
+  }
+
+  // Rx interrupts let idle rx lcores sleep in epoll, ports without them
+  // get timed sleeps
+  port_conf.intr_conf.rxq = idle_sleep_us > 0;
   ret = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
+  if (ret != 0 && port_conf.intr_conf.rxq) {
+    printf("Port %u has no rx interrupts\n", port);
+    port_conf.intr_conf.rxq = 0;
+    ret = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
+  }
   if (ret != 0) return ret;
   printf("rte_eth_dev_configure success [%u]\n", port);
 
-  // uint16_t q;
-  // for (q = 0; q < rx_rings; q++) {
-  printf("Going to initialize queue %u of port %u\n", port, port);
-  ret = rte_eth_rx_queue_setup(port, 0, nb_rxd, rte_eth_dev_socket_id(port),
-                               NULL, membuf_pool);
-  if (ret < 0) {
-    printf("Error in rx queue_setup %u error %s\n", port, strerror(-ret));
-    return ret;
+  rxconf.offloads |= port_conf.rxmode.offloads;
+  for (uint16_t q = 0; q < rx_rings; q++) {
+    printf("Going to initialize queue %u of port %u\n", q, port);
+    ret = rte_eth_rx_queue_setup(port, q, nb_rxd, rte_eth_dev_socket_id(port),
+                                 &rxconf, rx_pool);
+    if (ret < 0) {
+      printf("Error in rx queue_setup %u error %s\n", port, strerror(-ret));
+      return ret;
+    }
   }
-  //}
 
   printf("Port rx queue success [%u]\n", port);
 
@@ -106,6 +370,13 @@ int port_init(uint16_t port, struct rte_mempool *membuf_pool) {
 
   printf("Port started [%u]\n", port);
 
+  if (!pkt_parse_port_ptypes(port)) {
+    hw_ptype = 0;
+    printf("Port %u has no packet types, workers parse in software\n", port);
+  }
+
+  xstats_select(port);
+
   struct rte_ether_addr addr;
   ret = rte_eth_macaddr_get(port, &addr);
   if (ret != 0) {
@@ -122,118 +393,354 @@ int port_init(uint16_t port, struct rte_mempool *membuf_pool) {
 }
 
 void print_stats(void) {
-  struct rte_eth_stats st;
+  struct lcore_stats sum;
+  const double dt = stats_interval();
   printf("--------------------------------------------------------------\n");
 
-  for (int p = 0; p < nb_ports; ++p) {
-    rte_eth_stats_get(p, &st);
-    printf("Port #%u: %lu received / %lu errors / %lu missed\n", p, st.ipackets,
-           st.ierrors, st.imissed);
-  }
+  print_ports(nb_ports, dt);
 
-  printf(
-      "Rx packets: %lu \t Ring space: %u \t Packet ring: %u \t Packets "
-      "processed %lu\n",
-      packets_rx, free_space, free_space2, packets_processed);
+  // Free packet_ring slots, read here rather than by rx on every burst
+  unsigned ring_free = 0;
+  for (int n = 0; n < RTE_MAX_NUMA_NODES; n++)
+    if (numa_nodes[n].packet_ring != NULL)
+      ring_free += rte_ring_free_count(numa_nodes[n].packet_ring);
+
+  stats_sum(&sum);
+  printf("Rx packets: %" PRIu64 " (%" PRIu64 " bytes) \t Enqueued %" PRIu64
+         " \t Packet ring: %u \t Packets processed %" PRIu64 "\n",
+         sum.rx, sum.bytes, sum.enqueued, ring_free, sum.processed);
+  printf("Ring full drops %" PRIu64 " \t Pool drops %" PRIu64 "\n",
+         sum.ring_drops, sum.alloc_fails);
+
+  if (dt > 0)
+    printf("Rates: rx %.3f Mpps \t enqueued %.3f Mpps \t processed %.3f Mpps"
+           " \t ring drops %.0f/s \t alloc fails %.0f/s\n",
+           (sum.rx - stats_last.rx) / dt / 1e6,
+           (sum.enqueued - stats_last.enqueued) / dt / 1e6,
+           (sum.processed - stats_last.processed) / dt / 1e6,
+           (sum.ring_drops - stats_last.ring_drops) / dt,
+           (sum.alloc_fails - stats_last.alloc_fails) / dt);
+  printf("Overload %s: tail drops %" PRIu64 " \t head drops %" PRIu64
+         " \t class drops %" PRIu64 " \t rx pauses %" PRIu64 " (%.1f ms)\n",
+         overload_names[overload.policy], sum.overload.tail_drops,
+         sum.overload.head_drops, sum.overload.class_drops, sum.overload.pauses,
+         sum.overload.pause_cycles * 1e3 / rte_get_tsc_hz());
+  printf("Parsed: non-IP %" PRIu64 " \t malformed %" PRIu64 "\n",
+         sum.non_ip, sum.malformed);
+  if (filter != NULL)
+    printf("Filter %s: matched %" PRIu64 " \t rejected %" PRIu64 "\n",
+           filter_spec, sum.filter_match, sum.filter_reject);
+  if (capture_prefix != NULL) {
+    uint64_t written = 0, errors = 0;
+    unsigned lcore;
+    RTE_LCORE_FOREACH(lcore) {
+      if (captures[lcore] == NULL) continue;
+      written += __atomic_load_n(&captures[lcore]->bytes_written,
+                                 __ATOMIC_RELAXED);
+      errors += __atomic_load_n(&captures[lcore]->write_errors,
+                                __ATOMIC_RELAXED);
+    }
+    printf("Capture: packets %" PRIu64 " \t drops %" PRIu64
+           " \t written %.1f MB \t write errors %" PRIu64 "\n",
+           sum.captured, sum.capture_drops, written / 1e6, errors);
+    if (dt > 0)
+      printf("Capture rates: %.3f Mpps \t %.1f Mbit/s to disk \t drops %.0f/s\n",
+             (sum.captured - stats_last.captured) / dt / 1e6,
+             (written - capture_bytes_last) * 8 / dt / 1e6,
+             (sum.capture_drops - stats_last.capture_drops) / dt);
+    capture_bytes_last = written;
+  }
+  stats_last = sum;
+  if (handoff_mode == HANDOFF_ZEROCOPY)
+    printf("Zero-copy handoff, retained copies %" PRIu64 "\n",
+           sum.retain_copies);
+  if (merge != NULL)
+    printf("Reorder: in order %" PRIu64 " \t late %" PRIu64
+           " \t dropped %" PRIu64 "\n",
+           sum.reorder.ordered, sum.reorder.late, sum.reorder.drops);
+  if (replay != NULL)
+    printf("Replay: truncated copies %" PRIu64 "\n",
+           __atomic_load_n(&replay->truncated, __ATOMIC_RELAXED));
+  if (plan.nb_remote > 0)
+    printf("NUMA: %u remote lcores handled %" PRIu64 " packets\n",
+           plan.nb_remote, sum.numa_remote);
+  idle_print(lcore_stats, sizeof(struct lcore_stats),
+             offsetof(struct lcore_stats, idle), &sum.idle);
+  print_latency();
   printf("--------------------------------------------------------------\n\n");
 }
 
-static inline int is_valid_ipv4_pkt(struct rte_ipv4_hdr *pkt, uint32_t link_len)
-{
-    /* From http://www.rfc-editor.org/rfc/rfc1812.txt section 5.2.2 */
-    /*
-     *      * 1. The packet length reported by the Link Layer must be large
-     *           * enough to hold the minimum length legal IP datagram (20 bytes).
-     *                */
-    if (link_len < sizeof(struct rte_ipv4_hdr))
-        return -1;
-    /* 2. The IP checksum must be correct. */
-    /* this is checked in H/W */
-    /*
-     *      * 3. The IP version number must be 4. If the version number is not 4
-     *           * then the packet may be another version of IP, such as IPng or
-     *                * ST-II.
-     *                     */
-    if (((pkt->version_ihl) >> 4) != 4)
-        return -3;
-    /*
-     *      * 4. The IP header length field must be large enough to hold the
-     *           * minimum length legal IP datagram (20 bytes = 5 words).
-     *                */
-    if ((pkt->version_ihl & 0xf) < 5)
-        return -4;
-    /*
-     *      * 5. The IP total length field must be large enough to hold the IP
-     *           * datagram header, whose length is specified in the IP header length
-     *                * field.
-     *                     */
-    if (rte_cpu_to_be_16(pkt->total_length) < sizeof(struct rte_ipv4_hdr))
-        return -5;
-    return 0;
+// The event device takes what its in-flight limit allows, tail drop or
+// pause are the only policies it has
+static unsigned handoff_event(const struct lcore_assign *a, void **objs,
+                              const uint32_t *flows, unsigned n,
+                              struct overload_stats *st) {
+  unsigned nb = event_sched_enqueue(&evs, a->lcore, objs, flows, n);
+  if (unlikely(nb < n) && overload.policy == OVERLOAD_PAUSE) {
+    const uint64_t start = rte_rdtsc();
+    stats_add(&st->pauses, 1);
+    while (nb < n && !is_stop) {
+      rte_pause();
+      nb += event_sched_enqueue(&evs, a->lcore, &objs[nb], &flows[nb], n - nb);
+    }
+    stats_add(&st->pause_cycles, rte_rdtsc() - start);
+  }
+  if (unlikely(nb < n)) stats_add(&st->tail_drops, n - nb);
+  return nb;
 }
 
-static int rx_packets(void *args) {
-  uint16_t port = *(uint16_t *)args;
-  // unsigned lcoreid = *(unsigned *)args;
-  printf("Core %u processing rx packets on port %d \n", rte_lcore_id(), port);
+// Hands a burst to the workers under the -b policy and returns how many they
+// took, objs[ret..n) are left to the caller. Ring entries dropped by
+// OVERLOAD_HEAD come back in old. Counts enqueued and ring_drops. flows is
+// only read with -e event and ctl with -b class, either may be NULL otherwise.
+static inline unsigned handoff_enqueue(const struct lcore_assign *a,
+                                       const struct numa_node *node,
+                                       void **objs, const uint32_t *flows,
+                                       const uint8_t *ctl, unsigned n,
+                                       void **old, unsigned *nb_old,
+                                       struct lcore_stats *stats) {
+  unsigned nb;
+  *nb_old = 0;
+  if (sched_mode == SCHED_EVENT) {
+    nb = handoff_event(a, objs, flows, n, &stats->overload);
+  } else {
+    nb = overload_enqueue(&overload, node->packet_ring, objs, ctl, n, old,
+                          nb_old, &stats->overload);
+  }
+  if (nb > 0) stats_add(&stats->enqueued, nb);
+  if (nb < n || *nb_old > 0)
+    stats_add(&stats->ring_drops, n - nb + *nb_old);
+  return nb;
+}
 
-  while (!is_stop) {
-    struct rte_mbuf *bufs[BURST_SIZE];
-    const uint16_t nb_rx = rte_eth_rx_burst(port, 0, bufs, BURST_SIZE);
-    if (unlikely(nb_rx == 0)) continue;
-    packets_rx += nb_rx;
-    for (int i = 0; i < nb_rx; i++) {
-      // Enqueue into rte_ring
-      // rte_ring_enqueue_bulk(queue, (void **)&bufs[i], 1, &free_space);
-     if(rte_pktmbuf_data_len(bufs[i]) > 0){
-         struct packet *p = NULL;
-         p = rte_malloc("packet_malloc", sizeof(struct packet), 0);
-         p->size = rte_pktmbuf_data_len(bufs[i]);
-         p->data = NULL;
-         p->data = rte_malloc("packet_data", p->size, 0);
-         rte_memcpy(p->data, rte_pktmbuf_mtod(bufs[i], unsigned char *), p->size);
-         rte_ring_mp_enqueue_bulk(packet_ring, (void **)&p, 1, &free_space2);
+static inline unsigned handoff_dequeue(const struct lcore_assign *a,
+                                       const struct numa_node *node,
+                                       void **objs, unsigned n) {
+  if (sched_mode == SCHED_EVENT)
+    return event_sched_dequeue(&evs, a->lcore, objs, n);
+  return rte_ring_dequeue_burst(node->packet_ring, objs, n, NULL);
+}
 
-         // printf("Packet of original: %d  copied with length %d\n",
-         //      rte_pktmbuf_data_len(bufs[i]), p->size);
+// A finished replay stops the run once the workers have drained the ring,
+// or processed everything the event device took
+static inline void replay_check_done(const struct numa_node *node) {
+  if (replay == NULL || !replay->done) return;
+  if (sched_mode == SCHED_EVENT) {
+    struct lcore_stats sum;
+    stats_sum(&sum);
+    if (sum.processed >= sum.enqueued) is_stop = 1;
+  } else if (rte_ring_empty(node->packet_ring)) {
+    is_stop = 1;
+  }
+}
 
+// Flow ids for atomic scheduling: the RSS hash, or a CRC of the parsed
+// 5-tuple for ports without one and replays. Non-IP packets share flow 0.
+static void rx_flows(struct rte_mbuf **bufs, uint16_t n, uint32_t *flows) {
+  uint16_t i;
+  for (i = 0; i < n && (bufs[i]->ol_flags & PKT_RX_RSS_HASH); i++)
+    flows[i] = bufs[i]->hash.rss;
+  if (i == n) return;
 
-     }
-     else{
-     //printf("Error packet \n");
-     }
+  struct parse_burst pb;
+  pkt_parse_mbufs(&pb, bufs, n, hw_ptype);
+  for (i = 0; i < n; i++) {
+    const uint8_t f = pb.flags[i];
+    if (bufs[i]->ol_flags & PKT_RX_RSS_HASH) {
+      flows[i] = bufs[i]->hash.rss;
+    } else if (!(f & (PARSE_F_IPV4 | PARSE_F_IPV6)) || (f & PARSE_F_BAD)) {
+      flows[i] = 0;
+    } else {
+      const uint32_t alen = f & PARSE_F_IPV4 ? 4 : 16;
+      uint32_t h = rte_hash_crc(pb.src_addr[i], alen, pb.proto[i]);
+      h = rte_hash_crc(pb.dst_addr[i], alen, h);
+      if (!(f & PARSE_F_FRAG))
+        h = rte_hash_crc_4byte(
+            (uint32_t)pb.src_port[i] << 16 | pb.dst_port[i], h);
+      flows[i] = h;
+    }
+  }
+}
 
-     rte_pktmbuf_free(bufs[i]);
+// Control packets for OVERLOAD_CLASS, the others need no parsing
+static inline void rx_classify(struct rte_mbuf **bufs, uint16_t n,
+                               uint8_t *ctl) {
+  struct parse_burst pb;
+  if (overload.policy != OVERLOAD_CLASS) return;
+  pkt_parse_mbufs(&pb, bufs, n, hw_ptype);
+  overload_classify(&pb, ctl);
+}
 
-     // printf("Packet freed\n");
-      // rte_free(p->data);
-      // rte_free(p);a
+// Copies the first snaplen bytes of a frame, which may span segments
+static inline void packet_fill(struct packet *p, const struct rte_mbuf *m) {
+  p->pkt_len = source_pkt_len(m);
+  p->size = RTE_MIN(p->pkt_len, (uint32_t)snaplen);
+  if (likely(p->size <= rte_pktmbuf_data_len(m)))
+    rte_memcpy(p->data, rte_pktmbuf_mtod(m, void *), p->size);
+  else
+    rte_pktmbuf_read(m, 0, p->size, p->data);
+}
+
+// Idle rx lcores sleep until an rx interrupt when the port has them
+static void rx_idle_init(struct idle *idle, struct lcore_stats *stats,
+                         const struct lcore_assign *a) {
+  const uint16_t port = a->port;
+  idle_init(idle, &stats->idle, idle_sleep_us);
+  if (replay == NULL && idle_sleep_us > 0 &&
+      idle_rx_intr(idle, port, a->queue) != 0)
+    printf("Core %u sleeps on a timer when port %u is idle\n", rte_lcore_id(),
+           port);
+}
+
+// Frees what the filter rejects before anything is copied or enqueued
+static inline uint16_t rx_filter(struct lcore_stats *stats,
+                                 struct rte_mbuf **bufs, uint16_t nb_rx) {
+  if (filter == NULL) return nb_rx;
+  const uint16_t nb = pkt_filter_burst(filter, bufs, nb_rx);
+  stats_add(&stats->filter_match, nb);
+  if (nb < nb_rx) stats_add(&stats->filter_reject, nb_rx - nb);
+  return nb;
+}
+
+static int rx_packets_zerocopy(const struct lcore_assign *a) {
+  const uint16_t port = a->port;
+  const struct numa_node *node = &numa_nodes[a->socket];
+  struct lcore_stats *stats = &lcore_stats[rte_lcore_id()];
+  struct idle idle;
+  uint32_t seq = 0; /* next reorder sequence number of this queue */
+  // flows and ctl are only filled in, and read, in their modes
+  const int use_flows = sched_mode == SCHED_EVENT;
+  const int use_ctl = overload.policy == OVERLOAD_CLASS;
+  printf("Core %u zero-copy rx on port %d queue %u\n", rte_lcore_id(), port,
+         a->queue);
+  rx_idle_init(&idle, stats, a);
 
+  while (!is_stop) {
+    struct rte_mbuf *bufs[BURST_MAX], *old[BURST_MAX];
+    uint32_t flows[BURST_MAX];
+    uint8_t ctl[BURST_MAX];
+    unsigned nb_old;
+    uint16_t nb_rx = source_rx_burst(replay, port, a->queue, bufs, burst_size);
+    idle_poll(&idle, nb_rx);
+    if (unlikely(nb_rx == 0)) {
+      replay_check_done(node);
+      continue;
+    }
+    stats_add(&stats->rx, nb_rx);
+    if ((nb_rx = rx_filter(stats, bufs, nb_rx)) == 0) continue;
+    const uint64_t now = rte_rdtsc();
+    uint64_t bytes = 0;
+    for (int i = 0; i < nb_rx; i++) {
+      bytes += source_pkt_len(bufs[i]);
+      *rx_tsc(bufs[i]) = now;
     }
+    stats_add(&stats->bytes, bytes);
+    if (a->remote) stats_add(&stats->numa_remote, nb_rx);
+    if (use_flows) rx_flows(bufs, nb_rx, flows);
+    rx_classify(bufs, nb_rx, ctl);
+    if (merge != NULL) merge_stamp(bufs, nb_rx, merge_src_of[a->lcore], seq);
+
+    // Ownership of the mbufs moves to open_packets()
+    const unsigned nb_enq = handoff_enqueue(
+        a, node, (void **)bufs, use_flows ? flows : NULL, use_ctl ? ctl : NULL,
+        nb_rx, (void **)old, &nb_old, stats);
+    seq += nb_enq; /* what was not taken leaves no gap */
+    if (nb_enq < nb_rx) rte_pktmbuf_free_bulk(&bufs[nb_enq], nb_rx - nb_enq);
+    if (nb_old > 0) rte_pktmbuf_free_bulk(old, nb_old);
   }
 
   printf("Stopping rx Reader\n");
-  //print_stats();
 
   return 0;
 }
 
-static int set_timer() {
-  uint64_t diff_tsc, cur_tsc, prev_tsc, timer_tsc;
+static int rx_packets(void *args) {
+  const struct lcore_assign *a = args;
+  if (handoff_mode == HANDOFF_ZEROCOPY) return rx_packets_zerocopy(a);
+
+  const uint16_t port = a->port;
+  const struct numa_node *node = &numa_nodes[a->socket];
+  struct rte_mempool *packet_pool = node->packet_pool;
+  struct lcore_stats *stats = &lcore_stats[rte_lcore_id()];
+  struct idle idle;
+  // flows and ctl are only filled in, and read, in their modes
+  const int use_flows = sched_mode == SCHED_EVENT;
+  const int use_ctl = overload.policy == OVERLOAD_CLASS;
+  printf("Core %u processing rx packets on port %d queue %u\n", rte_lcore_id(),
+         port, a->queue);
+  rx_idle_init(&idle, stats, a);
 
-  prev_tsc = 0, timer_tsc = 0;
   while (!is_stop) {
-    cur_tsc = rte_rdtsc();
-    diff_tsc = cur_tsc - prev_tsc;
-    if (timer_cycles > 0) { /* timer enabled */
-      timer_tsc += diff_tsc;
-      if (unlikely(timer_tsc >= timer_cycles)) { /* timeout */
-        print_stats();
-        timer_tsc = 0;
+    struct rte_mbuf *bufs[BURST_MAX];
+    struct packet *pkts[BURST_MAX], *old[BURST_MAX];
+    uint32_t flows[BURST_MAX];
+    uint8_t ctl[BURST_MAX];
+    unsigned nb_old = 0;
+    uint16_t nb_rx = source_rx_burst(replay, port, a->queue, bufs, burst_size);
+    idle_poll(&idle, nb_rx);
+    if (unlikely(nb_rx == 0)) {
+      replay_check_done(node);
+      continue;
+    }
+    const uint64_t now = rte_rdtsc();
+    stats_add(&stats->rx, nb_rx);
+    if ((nb_rx = rx_filter(stats, bufs, nb_rx)) == 0) continue;
+
+    // One bulk get per burst, served from this lcore's mempool cache
+    if (unlikely(rte_mempool_get_bulk(packet_pool, (void **)pkts, nb_rx) !=
+                 0)) {
+      stats_add(&stats->alloc_fails, nb_rx);
+      rte_pktmbuf_free_bulk(bufs, nb_rx);
+      continue;
+    }
+
+    if (use_flows) rx_flows(bufs, nb_rx, flows);
+    rx_classify(bufs, nb_rx, ctl);
+    unsigned nb_pkts = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < nb_rx; i++) {
+      uint16_t len = rte_pktmbuf_data_len(bufs[i]);
+      bytes += source_pkt_len(bufs[i]);
+      if (len > 0) {
+        if (use_flows) flows[nb_pkts] = flows[i];
+        if (use_ctl) ctl[nb_pkts] = ctl[i];
+        struct packet *p = pkts[nb_pkts++];
+        p->rx_tsc = now;
+        p->ptype = bufs[i]->packet_type;
+        p->port = port;
+        packet_fill(p, bufs[i]);
       }
     }
-    prev_tsc = cur_tsc;
+    rte_pktmbuf_free_bulk(bufs, nb_rx);
+    stats_add(&stats->bytes, bytes);
+    if (a->remote) stats_add(&stats->numa_remote, nb_pkts);
+
+    // Return slots not used by empty frames, or not taken for lack of room,
+    // and the ones dropped from the ring
+    if (nb_pkts > 0)
+      nb_pkts = handoff_enqueue(a, node, (void **)pkts,
+                                use_flows ? flows : NULL, use_ctl ? ctl : NULL,
+                                nb_pkts, (void **)old, &nb_old, stats);
+    if (nb_pkts < nb_rx)
+      rte_mempool_put_bulk(packet_pool, (void **)&pkts[nb_pkts],
+                           nb_rx - nb_pkts);
+    if (nb_old > 0) rte_mempool_put_bulk(packet_pool, (void **)old, nb_old);
   }
+
+  printf("Stopping rx Reader\n");
+  //print_stats();
+
+  return 0;
+}
+
+/* /packet_copy/stats: the summed lcore counters as JSON, e.g. via dpdk-telemetry.py */
+static int telemetry_stats(const char *cmd __rte_unused,
+                           const char *params __rte_unused,
+                           struct rte_tel_data *d) {
+  struct lcore_stats sum;
+  stats_sum(&sum);
+  stats_telemetry(d, &sum, stats_fields, RTE_DIM(stats_fields));
+  return 0;
 }
 
 //
@@ -257,46 +764,630 @@ static int set_timer() {
 //  }
 //}
 
+/* Copy retained mbufs older than the deadline out of the rx pool */
+static void retain_expire(struct retained *r, unsigned n, uint64_t now,
+                          struct rte_mempool *packet_pool,
+                          struct lcore_stats *stats) {
+  for (unsigned i = 0; i < n; i++) {
+    if (r[i].m == NULL || now - r[i].tsc < retain_cycles) continue;
+    struct packet *p;
+    if (rte_mempool_get(packet_pool, (void **)&p) != 0) {
+      stats_add(&stats->alloc_fails, 1);
+      break;
+    }
+    packet_fill(p, r[i].m);
+    rte_pktmbuf_free(r[i].m);
+    r[i].m = NULL;
+    r[i].p = p;
+    stats_add(&stats->retain_copies, 1);
+  }
+}
+
+static void retain_release(struct retained *r,
+                           struct rte_mempool *packet_pool) {
+  if (r->m != NULL) rte_pktmbuf_free(r->m);
+  if (r->p != NULL) rte_mempool_put(packet_pool, r->p);
+  r->m = NULL;
+  r->p = NULL;
+}
+
+/*
+ * Zero-copy worker. With retain_every set it acts as a sampling consumer
+ * that keeps the last RETAIN_MAX sampled packets, to exercise the copy on
+ * deadline path; everything else is freed with the burst, or handed to
+ * the merge stage with -O.
+ */
+static int open_packets_zerocopy(const struct lcore_assign *a) {
+  const struct numa_node *node = &numa_nodes[a->socket];
+  printf("Starting zero-copy process on lcore %u\n", a->lcore);
+  struct lcore_stats *stats = &lcore_stats[rte_lcore_id()];
+  struct lcore_latency *lat = &lcore_latency[rte_lcore_id()];
+  struct rte_mbuf *mbuf[BURST_MAX];
+  struct rte_mbuf *done[BURST_MAX];
+  uint64_t stamp[BURST_MAX];
+  struct retained retained[RETAIN_MAX] = {0};
+  struct parse_burst pb;
+  struct capture *cap = captures[rte_lcore_id()];
+  unsigned retain_next = 0, sample = 0;
+  int nb, q, nb_done;
+  struct idle idle;
+  idle_init(&idle, &stats->idle, idle_sleep_us);
+  if (node->packet_ring != NULL) idle_monitor_ring(&idle, node->packet_ring);
+
+  while (!is_stop) {
+    nb = handoff_dequeue(a, node, (void **)mbuf, burst_size);
+    const enum idle_level woke = idle_poll(&idle, nb);
+    uint64_t now = rte_rdtsc();
+    if (retain_every) retain_expire(retained, RETAIN_MAX, now, node->packet_pool,
+                                     stats);
+    if (cap != NULL) capture_poll(cap, now);
+    if (unlikely(nb == 0)) continue;
+    stats_add(&stats->processed, nb);
+    if (a->remote) stats_add(&stats->numa_remote, nb);
+
+    for (q = 0; q < nb; q++) {
+      stamp[q] = *rx_tsc(mbuf[q]);
+      hist_add(&lat->dwell, now - stamp[q]);
+    }
+    if (woke >= IDLE_MONITOR) idle_woken(&idle, now - stamp[0]);
+    pkt_parse_mbufs(&pb, mbuf, nb, hw_ptype);
+    stats_parsed(stats, &pb);
+    if (cap != NULL) {
+      // The first segment, cut to -s like the copies and the IDB snaplen
+      unsigned dropped = 0;
+      for (q = 0; q < nb; q++)
+        dropped += capture_packet(cap, mbuf[q]->port, stamp[q],
+                                  rte_pktmbuf_mtod(mbuf[q], void *),
+                                  RTE_MIN(rte_pktmbuf_data_len(mbuf[q]),
+                                          snaplen),
+                                  source_pkt_len(mbuf[q])) != 0;
+      stats_add(&stats->captured, nb - dropped);
+      if (dropped) stats_add(&stats->capture_drops, dropped);
+    }
+
+    nb_done = 0;
+    for (q = 0; q < nb; q++) {
+      if (retain_every && ++sample == retain_every) {
+        sample = 0;
+        retain_release(&retained[retain_next], node->packet_pool);
+        retained[retain_next].m = mbuf[q];
+        retained[retain_next].tsc = now;
+        retain_next = (retain_next + 1) % RETAIN_MAX;
+        continue;
+      }
+      done[nb_done++] = mbuf[q];
+    }
+
+    const uint64_t done_tsc = rte_rdtsc();
+    for (q = 0; q < nb; q++) hist_add(&lat->total, done_tsc - stamp[q]);
+    if (merge != NULL)
+      merge_put(merge, done, nb_done, &stats->reorder);
+    else
+      rte_pktmbuf_free_bulk(done, nb_done);
+  }
+
+  for (q = 0; q < RETAIN_MAX; q++)
+    retain_release(&retained[q], node->packet_pool);
+  if (cap != NULL) capture_finish(cap);
+  return 0;
+}
+
 static int open_packets(void *args) {
-  unsigned lcoreid = *(unsigned *)args;
-  printf("Starting process on lcore %u\n", lcoreid);
-  struct rte_mbuf *mbuf[BURST_SIZE];
-  struct packet *arr_packets[BURST_SIZE];
+  const struct lcore_assign *a = args;
+  if (handoff_mode == HANDOFF_ZEROCOPY) return open_packets_zerocopy(a);
+  const struct numa_node *node = &numa_nodes[a->socket];
+  printf("Starting process on lcore %u\n", a->lcore);
+  struct lcore_stats *stats = &lcore_stats[rte_lcore_id()];
+  struct lcore_latency *lat = &lcore_latency[rte_lcore_id()];
+  struct packet *arr_packets[BURST_MAX];
+  struct parse_burst pb;
+  struct capture *cap = captures[rte_lcore_id()];
   int nb, q;
-  packets_processed = 0;
+  struct idle idle;
+  idle_init(&idle, &stats->idle, idle_sleep_us);
+  if (node->packet_ring != NULL) idle_monitor_ring(&idle, node->packet_ring);
   // process packets
   while (!is_stop) {
      // printf("Checking burst\n");
-    // Dequeue from rte_ring
-    nb = rte_ring_mc_dequeue_burst(packet_ring, (void **)&arr_packets,
-                                   BURST_SIZE, NULL);
+    // Dequeue from rte_ring, or the event device
+    nb = handoff_dequeue(a, node, (void **)arr_packets, burst_size);
+    const enum idle_level woke = idle_poll(&idle, nb);
+    if (cap != NULL) capture_poll(cap, rte_rdtsc());
     if (unlikely(nb == 0)) continue;
    // printf("packets dequeued\n");
-    packets_processed += nb;
-    // Read packets from mbuf
+    const uint64_t deq_tsc = rte_rdtsc();
+    for (q = 0; q < nb; q++)
+      hist_add(&lat->dwell, deq_tsc - arr_packets[q]->rx_tsc);
+    if (woke >= IDLE_MONITOR) idle_woken(&idle, deq_tsc - arr_packets[0]->rx_tsc);
+    stats_add(&stats->processed, nb);
+    if (a->remote) stats_add(&stats->numa_remote, nb);
     for (q = 0; q < nb; q++) {
-        // printf("packe dequeue size: %d with data: %.*s\n",
-        // arr_packets[q]->size,
-        //     10, arr_packets[q]->data);
-
-        if(arr_packets[q]->data)
-            rte_free(arr_packets[q]->data);
-        if(arr_packets[q])
-            rte_free(arr_packets[q]);
+      pb.data[q] = arr_packets[q]->data;
+      rte_prefetch0(pb.data[q]);
+      pb.len[q] = arr_packets[q]->size;
+      pb.ptype[q] = arr_packets[q]->ptype;
+    }
+    pkt_parse_run(&pb, nb, hw_ptype);
+    stats_parsed(stats, &pb);
+    if (cap != NULL) {
+      unsigned dropped = 0;
+      for (q = 0; q < nb; q++) {
+        const struct packet *p = arr_packets[q];
+        dropped += capture_packet(cap, p->port, p->rx_tsc, p->data, p->size,
+                                  p->pkt_len) != 0;
+      }
+      stats_add(&stats->captured, nb - dropped);
+      if (dropped) stats_add(&stats->capture_drops, dropped);
     }
-    //rte_free(arr_packets);
+    // Read packets from copy slots
+    // for (q = 0; q < nb; q++)
+    //   printf("packe dequeue size: %d with data: %.*s\n",
+    //          arr_packets[q]->size, 10, arr_packets[q]->data);
+
+    const uint64_t done_tsc = rte_rdtsc();
+    for (q = 0; q < nb; q++)
+      hist_add(&lat->total, done_tsc - arr_packets[q]->rx_tsc);
+    rte_mempool_put_bulk(node->packet_pool, (void **)arr_packets, nb);
+  }
+
+  if (cap != NULL) capture_finish(cap);
+  return 0;
+}
+
+/*
+ * Mbufs of a node's pool out at once: the rx descriptors of its queues, the
+ * cache and a burst of every lcore working on the node and, in zero-copy
+ * mode, a full packet_ring, the retained packets and the reorder buffers.
+ */
+static unsigned node_mbufs(unsigned socket, unsigned ring_size) {
+  unsigned n = 0, lcore;
+  RTE_LCORE_FOREACH_WORKER(lcore) {
+    const struct lcore_assign *a = &plan.lcore[lcore];
+    if (a->role == ROLE_NONE || a->socket != socket) continue;
+    n += mbuf_cache + burst_size;
+    if (a->role == ROLE_RX && replay_path == NULL) n += rx_ring_size;
+    if (a->role == ROLE_WORKER && handoff_mode == HANDOFF_ZEROCOPY)
+      n += RETAIN_MAX;
+    if (a->role == ROLE_RX && reorder_window > 0)
+      n += 2 * rte_align32pow2(reorder_window); /* order and ready slots */
   }
+  if (handoff_mode == HANDOFF_ZEROCOPY) n += ring_size;
+  return RTE_MAX(n, (unsigned)NB_MBUF_MIN);
 }
 
+/* Copy slots, a full ring plus what lcore caches and bursts hold, 2^n - 1 */
+static unsigned node_packets(unsigned ring_size, unsigned nb_lcores) {
+  if (handoff_mode == HANDOFF_ZEROCOPY) /* only retained packets copied */
+    return RTE_MAX(nb_lcores * (RETAIN_MAX + MEMPOOL_CACHE_SIZE), 8192u) - 1;
+  return rte_align32pow2(ring_size +
+                         nb_lcores * (MEMPOOL_CACHE_SIZE + burst_size)) -
+         1;
+}
+
+/* Hugepage memory the pools and ring of a node will take */
+static size_t node_bytes(unsigned socket, unsigned ring_size,
+                         unsigned nb_lcores) {
+  const unsigned nb_mbuf = node_mbufs(socket, ring_size);
+  size_t bytes =
+      mem_pool_bytes(nb_mbuf, mem_pktmbuf_elt(RTE_MBUF_DEFAULT_BUF_SIZE)) +
+      mem_pool_bytes(node_packets(ring_size, nb_lcores),
+                     sizeof(struct packet) + snaplen) +
+      mem_ring_bytes(ring_size);
+  if (small_data_room > 0 && replay_path == NULL)
+    bytes += mem_pool_bytes(
+        nb_mbuf, mem_pktmbuf_elt(RTE_PKTMBUF_HEADROOM + small_data_room));
+  return bytes;
+}
+
+/*
+ * packet_ring holds ring_latency_us of ring_pps unless --ring-size fixes it.
+ * Halved until the pools and ring of every node fit its budget.
+ */
+static unsigned plan_ring_size(const unsigned *sockets, unsigned nb,
+                               unsigned nb_lcores) {
+  unsigned ring_size =
+      ring_size_fixed > 0 ? rte_align32pow2(ring_size_fixed)
+                    : mem_ring_entries(ring_pps, ring_latency_us, MEM_RING_MIN,
+                                       MEM_RING_MAX);
+  for (;;) {
+    int fits = 1;
+    for (unsigned i = 0; i < nb; i++) mem_unplan(&mem, sockets[i]);
+    for (unsigned i = 0; i < nb; i++) {
+      // Sources sharing a node share its pools, book them once
+      unsigned j = 0;
+      while (j < i && sockets[j] != sockets[i]) j++;
+      if (j == i &&
+          mem_plan(&mem, sockets[i], node_bytes(sockets[i], ring_size,
+                                                nb_lcores)) != 0)
+        fits = 0;
+    }
+    if (fits) return ring_size;
+    if (ring_size_fixed > 0 || ring_size <= MEM_RING_MIN) return 0;
+    ring_size /= 2;
+  }
+}
+
+/* Pools and ring of a node, created the first time a source needs them */
+static int numa_node_create(unsigned socket, unsigned ring_size,
+                            unsigned nb_lcores) {
+  struct numa_node *node = &numa_nodes[socket];
+  const unsigned nb_mbuf = node_mbufs(socket, ring_size);
+  char name[RTE_MEMPOOL_NAMESIZE];
+
+  if (node->mbuf_pool != NULL) return 0;
+
+  snprintf(name, sizeof(name), "MBUF_POOL_%u", socket);
+  node->mbuf_pool = rte_pktmbuf_pool_create(
+      name, nb_mbuf, mbuf_cache, 0, RTE_MBUF_DEFAULT_BUF_SIZE, socket);
+  if (node->mbuf_pool == NULL) return -1;
+  mem_add_pool(&mem, node->mbuf_pool);
+
+  // As many small mbufs as full ones, a split frame takes one of each
+  if (small_data_room > 0 && replay_path == NULL) {
+    snprintf(name, sizeof(name), "SMALL_MBUF_POOL_%u", socket);
+    node->small_pool = rte_pktmbuf_pool_create(
+        name, nb_mbuf, mbuf_cache, 0, RTE_PKTMBUF_HEADROOM + small_data_room,
+        socket);
+    if (node->small_pool == NULL) return -1;
+    mem_add_pool(&mem, node->small_pool);
+  }
+
+  // Fixed-size copy slots, per-lcore cache keeps get/put off the shared ring
+  snprintf(name, sizeof(name), "PACKET_POOL_%u", socket);
+  node->packet_pool = rte_mempool_create(
+      name, node_packets(ring_size, nb_lcores), sizeof(struct packet) + snaplen,
+      MEMPOOL_CACHE_SIZE, 0, NULL, NULL, NULL, NULL, socket, 0);
+  if (node->packet_pool == NULL) return -1;
+  mem_add_pool(&mem, node->packet_pool);
+
+  // The event device holds what the ring would
+  if (sched_mode == SCHED_RING) {
+    snprintf(name, sizeof(name), "RING_PACKETS_%u", socket);
+    node->packet_ring = rte_ring_create(name, ring_size, socket,
+                                        RING_F_MP_RTS_ENQ | RING_F_MC_RTS_DEQ);
+    if (node->packet_ring == NULL) return -1;
+    mem_add_ring(&mem, node->packet_ring);
+  }
+
+  printf("Pools and packet ring created on socket %u\n", socket);
+  return 0;
+}
+
+static void usage(const char *prgname) {
+  printf(
+      "%s [EAL options] -- [-m copy|zerocopy] [-r N] [-d US] [-c PREFIX]\n"
+      "    [-R FILE [-T fast|orig|PPS] [-L N] [-X]] [-f FILTER] [-s N] [-S N]\n"
+      "    [-I US] [-M MB] [-P PPS] [-W US] [-e ring|event] [-O N]\n"
+      "    [-b tail|head|pause|class] [--burst N] [--rx-desc N] [--ring-size N]\n"
+      "    [--mbuf-cache N] [--rx-queues N] [--workers N] [--stats S]\n"
+      "  -m MODE: packet_ring handoff, copy into slots (default) or mbufs\n"
+      "  -r N: zero-copy consumer retains every Nth packet (default 0, off)\n"
+      "  -d US: retained mbufs are copied out after US microseconds "
+      "(default %u)\n"
+      "  -c PREFIX: workers write what they dequeue to PREFIX_<lcore>_<n>.pcapng\n"
+      "  -R FILE: read packets from a pcap/pcapng file instead of the ports\n"
+      "  -T TIMING: replay as fast as possible (default), at the original\n"
+      "             spacing, or at PPS packets per second\n"
+      "  -L N: replay the file N times, 0 loops forever (default 1)\n"
+      "  -X: copy replayed packets into mbufs instead of attaching the file\n"
+      "  -f FILTER: keep only packets matching a tcpdump expression, or an\n"
+      "             eBPF program given as FILE.o[:SECTION]\n"
+      "  -s N: copy only the first N bytes of each frame (default %u)\n"
+      "  -S N: rx mbufs with an N byte data room, the rest of larger frames\n"
+      "        goes to a separate full size pool (buffer split or scatter)\n"
+      "  -I US: idle lcores back off to pause and monitor, and sleep after US\n"
+      "         microseconds without packets; 0 polls all the time "
+      "(default %u)\n"
+      "  -M MB: hugepage memory pools and rings may take per NUMA node\n"
+      "         (default what the node has free)\n"
+      "  -P PPS: packets per second a node is expected to take (default %u)\n"
+      "  -W US: worker stall packet_ring absorbs at that rate (default %u)\n"
+      "  -e SCHED: workers share packet_ring (default), or take flows from\n"
+      "            an atomic event queue, one worker per flow at a time\n"
+      "  -O N: zero-copy only, put packets back in rx queue order after the\n"
+      "        workers, holding up to N out of order packets per queue\n"
+      "  -b POLICY: when the workers fall behind, drop what does not fit\n"
+      "             (tail, default), drop the oldest queued packets (head),\n"
+      "             stop polling rx until there is room (pause), or keep the\n"
+      "             last free slots for control packets (class)\n"
+      "  --burst N: packets per rx burst and ring dequeue, 1 to %u "
+      "(default %u)\n"
+      "  --rx-desc N: rx descriptors per queue (default %u)\n"
+      "  --ring-size N: packet_ring slots, 0 sizes it from -P and -W "
+      "(default %u)\n"
+      "  --mbuf-cache N: per-lcore cache of the mbuf pools (default %u)\n"
+      "  --rx-queues N: rx queues and lcores per port with RSS (default %u)\n"
+      "  --workers N: open_packets() lcores (default %u)\n"
+      "  --stats S: seconds between stats, 0 prints none (default 3)\n",
+      prgname, RETAIN_DEADLINE_US, PACKET_DATA_SIZE, IDLE_SLEEP_US, RING_PPS,
+      RING_LATENCY_US, BURST_MAX, BURST_SIZE, RX_RING_SIZE, RING_SIZE,
+      MBUF_CACHE, RX_LCORES_PER_PORT, NB_WORKERS);
+}
+
+/* Long options for the sizes bench.sh sweeps, values past the short ones */
+enum {
+  OPT_BURST = 256,
+  OPT_RX_DESC,
+  OPT_RING_SIZE,
+  OPT_MBUF_CACHE,
+  OPT_RX_QUEUES,
+  OPT_WORKERS,
+  OPT_STATS,
+};
+
+static const struct option long_options[] = {
+    {"burst", required_argument, NULL, OPT_BURST},
+    {"rx-desc", required_argument, NULL, OPT_RX_DESC},
+    {"ring-size", required_argument, NULL, OPT_RING_SIZE},
+    {"mbuf-cache", required_argument, NULL, OPT_MBUF_CACHE},
+    {"rx-queues", required_argument, NULL, OPT_RX_QUEUES},
+    {"workers", required_argument, NULL, OPT_WORKERS},
+    {"stats", required_argument, NULL, OPT_STATS},
+    {NULL, 0, NULL, 0},
+};
+
+/* A whole decimal number in [min, max], -1 otherwise */
+static long parse_num(const char *arg, unsigned long min, unsigned long max) {
+  char *end;
+  errno = 0;
+  const unsigned long n = strtoul(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || n < min || n > max)
+    return -1;
+  return (long)n;
+}
+
+/* The values every run time size was given, to rerun a configuration */
+static void print_config(void) {
+  printf("Config: --burst %u --rx-desc %u --ring-size %u --mbuf-cache %u"
+         " --rx-queues %u --workers %u --stats %" PRIu64 "\n",
+         burst_size, rx_ring_size, ring_size_fixed, mbuf_cache, rx_queues,
+         nb_workers, timer_period);
+}
+
+static int parse_args(int argc, char **argv) {
+  const char *prgname = argv[0];
+  uint64_t deadline_us = RETAIN_DEADLINE_US;
+  int opt, policy = OVERLOAD_TAIL;
+  long n;
+
+  while ((opt = getopt_long(argc, argv, "m:r:d:c:R:T:L:Xf:s:S:I:M:P:W:e:O:b:",
+                            long_options, NULL)) != EOF) {
+    switch (opt) {
+      case OPT_BURST:
+      case OPT_RX_DESC:
+      case OPT_RING_SIZE:
+      case OPT_MBUF_CACHE:
+      case OPT_RX_QUEUES:
+      case OPT_WORKERS:
+      case OPT_STATS: {
+        // Ranges in the order of long_options
+        static const unsigned long max[] = {
+            BURST_MAX, UINT16_MAX, MEM_RING_MAX, RTE_MEMPOOL_CACHE_MAX_SIZE,
+            RTE_MAX_QUEUES_PER_PORT, RTE_MAX_LCORE, 3600};
+        static const unsigned long min[] = {1, 1, 0, 0, 1, 1, 0};
+        if ((n = parse_num(optarg, min[opt - OPT_BURST],
+                           max[opt - OPT_BURST])) < 0) {
+          printf("Invalid --%s %s, %lu to %lu\n",
+                 long_options[opt - OPT_BURST].name, optarg,
+                 min[opt - OPT_BURST], max[opt - OPT_BURST]);
+          usage(prgname);
+          return -1;
+        }
+        switch (opt) {
+          case OPT_BURST: burst_size = n; break;
+          case OPT_RX_DESC: rx_ring_size = n; break;
+          case OPT_RING_SIZE: ring_size_fixed = n; break;
+          case OPT_MBUF_CACHE: mbuf_cache = n; break;
+          case OPT_RX_QUEUES: rx_queues = n; break;
+          case OPT_WORKERS: nb_workers = n; break;
+          default: timer_period = n;
+        }
+        break;
+      }
+      case 'm':
+        if (strcmp(optarg, "copy") == 0)
+          handoff_mode = HANDOFF_COPY;
+        else if (strcmp(optarg, "zerocopy") == 0)
+          handoff_mode = HANDOFF_ZEROCOPY;
+        else {
+          printf("Invalid handoff mode %s\n", optarg);
+          usage(prgname);
+          return -1;
+        }
+        break;
+      case 'c':
+        capture_prefix = optarg;
+        break;
+      case 'R':
+        replay_path = optarg;
+        break;
+      case 'T':
+        if (strcmp(optarg, "fast") == 0)
+          replay_timing = REPLAY_FAST;
+        else if (strcmp(optarg, "orig") == 0)
+          replay_timing = REPLAY_ORIG;
+        else if ((n = parse_num(optarg, 1, REPLAY_RATE_MAX)) > 0) {
+          replay_rate = n;
+          replay_timing = REPLAY_RATE;
+        } else {
+          printf("Invalid replay timing %s, fast, orig or 1 to %llu pps\n",
+                 optarg, REPLAY_RATE_MAX);
+          usage(prgname);
+          return -1;
+        }
+        break;
+      case 'X':
+        replay_copy = 1;
+        break;
+      case 'f':
+        filter_spec = optarg;
+        break;
+      case 'e':
+        if (strcmp(optarg, "ring") == 0)
+          sched_mode = SCHED_RING;
+        else if (strcmp(optarg, "event") == 0)
+          sched_mode = SCHED_EVENT;
+        else {
+          printf("Invalid scheduler %s\n", optarg);
+          usage(prgname);
+          return -1;
+        }
+        break;
+      case 'b':
+        if ((policy = overload_parse(optarg)) < 0) {
+          printf("Invalid overload policy %s\n", optarg);
+          usage(prgname);
+          return -1;
+        }
+        break;
+      case 'r':
+      case 'd':
+      case 'L':
+      case 's':
+      case 'S':
+      case 'I':
+      case 'M':
+      case 'P':
+      case 'W':
+      case 'O': {
+        unsigned long min = 0, max;
+        switch (opt) {
+          case 'r': max = RETAIN_EVERY_MAX; break;
+          case 'd': max = RETAIN_DEADLINE_MAX_US; break;
+          case 'L': max = UINT32_MAX; break;
+          case 's':
+          case 'S': min = RTE_ETHER_HDR_LEN; max = UINT16_MAX; break;
+          case 'I': max = IDLE_SLEEP_MAX_US; break;
+          case 'M': max = MEM_BUDGET_MAX_MB; break;
+          case 'P': max = MEM_PPS_MAX; break;
+          case 'W': max = MEM_LATENCY_MAX_US; break;
+          default: max = MERGE_WINDOW_MAX;
+        }
+        if ((n = parse_num(optarg, min, max)) < 0) {
+          printf("Invalid -%c %s, %lu to %lu\n", opt, optarg, min, max);
+          usage(prgname);
+          return -1;
+        }
+        switch (opt) {
+          case 'r': retain_every = n; break;
+          case 'd': deadline_us = n; break;
+          case 'L': replay_loops = n; break;
+          case 's': snaplen = n; break;
+          case 'S': small_data_room = n; break;
+          case 'I': idle_sleep_us = n; break;
+          case 'M': mem_budget_mb = n; break;
+          case 'P': ring_pps = n; break;
+          case 'W': ring_latency_us = n; break;
+          default: reorder_window = n;
+        }
+        break;
+      }
+      default:
+        usage(prgname);
+        return -1;
+    }
+  }
+
+  // Only mbufs carry a sequence number, and retained ones would leave gaps
+  if (reorder_window > 0 &&
+      (handoff_mode != HANDOFF_ZEROCOPY || retain_every > 0)) {
+    printf("-O needs -m zerocopy and cannot be used with -r\n");
+    usage(prgname);
+    return -1;
+  }
+  // Both drop packets out of the middle of what was numbered or scheduled
+  if ((policy == OVERLOAD_HEAD || policy == OVERLOAD_CLASS) &&
+      (sched_mode == SCHED_EVENT || reorder_window > 0)) {
+    printf("-b %s needs -e ring and cannot be used with -O\n",
+           overload_names[policy]);
+    usage(prgname);
+    return -1;
+  }
+  overload.policy = policy;
+  retain_cycles = deadline_us * rte_get_timer_hz() / US_PER_S;
+  optind = 1; /* reset getopt lib */
+  return 0;
+}
+
+/*
+ * The lcores leave their loops and main() prints the totals once capture
+ * writers have drained. A second signal exits without waiting.
+ */
 void exit_stats(int sig) {
+  if (is_stop) exit(0);
   is_stop = 1;
   printf("Caught signal %d\n", sig);
-  printf("Total received packets: %lu\n", packets_processed);
-  exit(0);
+}
+
+static void capture_start(unsigned lcore) {
+  char name[RTE_MAX_THREAD_NAME_LEN];
+  captures[lcore] =
+      capture_create(capture_prefix, lcore, RTE_MAX(nb_ports, 1), snaplen);
+  snprintf(name, sizeof(name), "capture_%u", lcore);
+  if (captures[lcore] == NULL ||
+      rte_ctrl_thread_create(&capture_tids[lcore], name, NULL, capture_thread,
+                             captures[lcore]) != 0)
+    rte_exit(EXIT_FAILURE, "Cannot start capture for lcore %u\n", lcore);
+}
+
+/* One poll of the merge stage: packets leave it in rx order, are captured and
+ * freed. Returns how many left. */
+static unsigned merge_output(struct lcore_stats *stats,
+                             struct lcore_latency *lat, struct capture *cap) {
+  struct rte_mbuf *out[MERGE_BURST];
+  const unsigned nb = merge_poll(merge, out, MERGE_BURST, &stats->reorder);
+  const uint64_t now = rte_rdtsc();
+  if (cap != NULL) capture_poll(cap, now);
+  if (nb == 0) return 0;
+  unsigned dropped = 0;
+  for (unsigned i = 0; i < nb; i++) {
+    const uint64_t stamp = *rx_tsc(out[i]);
+    hist_add(&lat->ordered, now - stamp);
+    if (cap != NULL)
+      dropped += capture_packet(cap, out[i]->port, stamp,
+                                rte_pktmbuf_mtod(out[i], void *),
+                                RTE_MIN(rte_pktmbuf_data_len(out[i]), snaplen),
+                                source_pkt_len(out[i])) != 0;
+  }
+  if (cap != NULL) {
+    stats_add(&stats->captured, nb - dropped);
+    if (dropped) stats_add(&stats->capture_drops, dropped);
+  }
+  rte_pktmbuf_free_bulk(out, nb);
+  return nb;
+}
+
+/*
+ * The main lcore's loop: a software event device's scheduler, and with -O
+ * the merge stage. Once stopped, the merge stage waits for the workers to
+ * hand over their last bursts and drains everything still in sequence, so
+ * a replay is captured to its end; merge_free() counts the rest as drops
+ * once the lcores are done.
+ */
+static void service_loop(void) {
+  const unsigned lcore = rte_lcore_id();
+  struct lcore_stats *stats = &lcore_stats[lcore];
+  struct lcore_latency *lat = &lcore_latency[lcore];
+  struct capture *cap = captures[lcore];
+
+  while (!is_stop) {
+    event_sched_run(&evs);
+    if (merge != NULL) merge_output(stats, lat, cap);
+  }
+  if (merge == NULL) return;
+
+  unsigned worker;
+  RTE_LCORE_FOREACH_WORKER(worker) {
+    if (plan.lcore[worker].role != ROLE_WORKER) continue;
+    while (rte_eal_get_lcore_state(worker) == RUNNING)
+      merge_output(stats, lat, cap);
+  }
+  while (merge_output(stats, lat, cap) > 0 || !rte_ring_empty(merge->ring))
+    ;
+  if (cap != NULL) capture_finish(cap);
 }
 
 int main(int argc, char *argv[]) {
-  struct rte_mempool *membuf_pool;
   uint16_t portid;
 
   int ret = rte_eal_init(argc, argv);
@@ -306,77 +1397,178 @@ int main(int argc, char *argv[]) {
   argv += ret;
   printf("EAL configs set \n");
 
-  timer_cycles = timer_period * rte_get_timer_hz();
-  uint32_t nb_lcores = rte_lcore_count();
-  nb_ports = rte_eth_dev_count_avail();
-  uint16_t n_tx_queue = 0;
-  uint16_t nb_rx_queue = 1;
-
-  static uint16_t nb_rxd = RTE_TEST_RX_DESC_DEFAULT;
-  static uint16_t nb_txd = RTE_TEST_TX_DESC_DEFAULT;
+  if (parse_args(argc, argv) < 0)
+    rte_exit(EXIT_FAILURE, "Invalid application arguments\n");
+  print_config();
 
-  printf("Number of ports available %d\n", nb_ports);
-
-  unsigned nb_mbuf = NB_MBUF;
-  // pktmbuf_pool_create
-  membuf_pool =
-      rte_pktmbuf_pool_create("MBUF_POOL", nb_mbuf, MBUF_CACHE, 0,
-                              RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-    printf("pktmbuf pool done!\n");
+  if (filter_spec != NULL && (filter = pkt_filter_create(filter_spec)) == NULL)
+    rte_exit(EXIT_FAILURE, "Invalid filter %s\n", filter_spec);
+  if (filter != NULL)
+    printf("Filter %s, %s\n", filter_spec,
+           filter->jit.func != NULL ? "JIT" : "interpreted");
 
-  // mempool_create same as probe
- // unsigned hwsize = MBUFS * nb_ports;
- // unsigned swsize = LCORE_QUEUESZ;
+  rx_tsc_dynfield = rte_mbuf_dynfield_register(&rx_tsc_dynfield_desc);
+  if (rx_tsc_dynfield < 0)
+    rte_exit(EXIT_FAILURE, "Cannot register rx timestamp mbuf field\n");
 
- // struct rte_mempool *mempool2;
- // mempool2 = rte_mempool_create("mbuf_pool", hwsize + swsize, MBUFSZ, 32,
- //                               sizeof(struct rte_pktmbuf_pool_private),
- //                               rte_pktmbuf_pool_init, NULL, rte_pktmbuf_init,
- //                               NULL, rte_socket_id(), 0);
+  uint32_t nb_lcores = rte_lcore_count();
+  // A replay is the only packet source, ports are left alone
+  nb_ports = replay_path != NULL ? 0 : rte_eth_dev_count_avail();
 
-  // mempool2 = rte_mempool_create("MBUF_POOL2",
-  //                               swsize, sizeof(struct
-  //                               rte_pktmbuf_pool_private), MBUF_CACHE,
-  //                               RTE_MBUF_DEFAULT_BUF_SIZE,
-  //                               NULL, NULL, NULL, NULL,
-  //                               rte_socket_id(), 0);
+  printf("Number of ports available %d\n", nb_ports);
+  printf("Handoff mode: %s, %s scheduling\n",
+         handoff_mode == HANDOFF_ZEROCOPY ? "zerocopy" : "copy",
+         sched_mode == SCHED_EVENT ? "event" : "ring");
 
-  //if (mempool2 == NULL) rte_exit(EXIT_FAILURE, "Error in creating membuf pool");
+  // Every source gets its rx lcores, workers, pools and ring on the node
+  // its packets arrive on
+  uint16_t src_ports[RTE_MAX_ETHPORTS];
+  unsigned src_sockets[RTE_MAX_ETHPORTS];
+  uint16_t src_rx[RTE_MAX_ETHPORTS];
+  unsigned nb_src = 0, nb_src_rx = 0;
+  if (replay_path != NULL) {
+    // One reader per replay, it owns the file cursor
+    src_ports[0] = 0;
+    src_rx[0] = 1;
+    src_sockets[nb_src++] = rte_socket_id();
+  } else {
+    RTE_ETH_FOREACH_DEV(portid) {
+      struct rte_eth_dev_info info;
+      if (rte_eth_dev_info_get(portid, &info) != 0)
+        rte_exit(EXIT_FAILURE, "Cannot get info of port %u\n", portid);
+      port_rx_queues[portid] =
+          info.flow_type_rss_offloads & RX_RSS_HF
+              ? RTE_MIN(rx_queues, info.max_rx_queues)
+              : 1;
+      src_ports[nb_src] = portid;
+      src_rx[nb_src] = port_rx_queues[portid];
+      src_sockets[nb_src++] = plan_port_socket(portid);
+    }
+  }
+  for (unsigned i = 0; i < nb_src; i++) nb_src_rx += src_rx[i];
+  // A node's packet_ring is drained only by workers of that node
+  const unsigned nb_src_sockets = plan_nb_sockets(src_sockets, nb_src);
+  if (nb_workers < nb_src_sockets)
+    rte_exit(EXIT_FAILURE,
+             "--workers %u leaves a NUMA node with ports undrained, need %u\n",
+             nb_workers, nb_src_sockets);
+  if (lcore_plan_build(&plan, src_ports, src_sockets, src_rx, nb_src,
+                       nb_workers) != 0)
+    rte_exit(EXIT_FAILURE,
+             "Need %u rx lcores and a worker for each of %u NUMA nodes\n",
+             nb_src_rx, nb_src_sockets);
+  lcore_plan_print(&plan);
+  if (plan.nb_workers < nb_workers)
+    printf("Only %u of %u workers placed, not enough lcores\n",
+           plan.nb_workers, nb_workers);
+  if (plan.nb_remote > 0)
+    printf("WARNING: %u lcores work on memory of another NUMA node\n",
+           plan.nb_remote);
+  if (plan.nb_shared > 0)
+    printf("WARNING: %u hot lcores share a physical core\n", plan.nb_shared);
 
-  //printf("Mempool created successfully\n");
+  mem_budget_init(&mem, mem_budget_mb);
+  const unsigned ring_size = plan_ring_size(src_sockets, nb_src, nb_lcores);
+  if (ring_size == 0) {
+    for (unsigned i = 0; i < nb_src; i++)
+      printf("Socket %u needs %.1f MB at the smallest ring\n", src_sockets[i],
+             node_bytes(src_sockets[i], MEM_RING_MIN, nb_lcores) / 1048576.0);
+    rte_exit(EXIT_FAILURE, "Pools and rings do not fit the memory budget\n");
+  }
+  overload_init(&overload, overload.policy, ring_size - 1, &is_stop);
+  printf("packet_ring: %u slots, %u us at %" PRIu64 " pps\n", ring_size,
+         (unsigned)((uint64_t)ring_size * US_PER_S / RTE_MAX(ring_pps, 1ul)),
+         ring_pps);
+  for (unsigned i = 0; i < nb_src; i++) {
+    if (numa_node_create(src_sockets[i], ring_size, nb_lcores) != 0)
+      rte_exit(EXIT_FAILURE, "Cannot create pools on socket %u: %s\n",
+               src_sockets[i], rte_strerror(rte_errno));
+  }
+  printf("pktmbuf pool done!\n");
+  unsigned lcore;
+  // One device for every node, as many events in flight as the rings hold
+  if (sched_mode == SCHED_EVENT &&
+      event_sched_create(&evs, &plan, src_sockets[0], ring_size * nb_src,
+                         burst_size) != 0)
+    rte_exit(EXIT_FAILURE, "Cannot set up event scheduling\n");
+  if (reorder_window > 0) {
+    // One source per rx lcore, the merge ring holds every mbuf there is
+    unsigned nb_mbufs = 0, s = 0;
+    RTE_LCORE_FOREACH_WORKER(lcore) {
+      if (plan.lcore[lcore].role == ROLE_RX) merge_src_of[lcore] = s++;
+    }
+    for (int n = 0; n < RTE_MAX_NUMA_NODES; n++) {
+      if (numa_nodes[n].mbuf_pool != NULL)
+        nb_mbufs += numa_nodes[n].mbuf_pool->size;
+      if (numa_nodes[n].small_pool != NULL)
+        nb_mbufs += numa_nodes[n].small_pool->size;
+    }
+    merge = merge_create(plan.nb_rx, reorder_window, nb_mbufs, rte_socket_id());
+    if (merge == NULL) rte_exit(EXIT_FAILURE, "Cannot set up reordering\n");
+    mem_add_ring(&mem, merge->ring);
+    printf("Reorder: %u queues, window %u\n", plan.nb_rx,
+           rte_align32pow2(reorder_window));
+  }
 
-  RTE_ETH_FOREACH_DEV(portid) {
-    if (port_init(portid, membuf_pool) != 0)
-      rte_exit(EXIT_FAILURE, "Cannot init port %" PRIu16 " \n", portid);
+  if (replay_path != NULL) {
+    replay = replay_open(replay_path, 0, numa_nodes[src_sockets[0]].mbuf_pool);
+    if (replay == NULL) rte_exit(EXIT_FAILURE, "Cannot replay %s\n", replay_path);
+    replay->timing = replay_timing;
+    replay->rate_pps = replay_rate;
+    replay->loops = replay_loops;
+    replay->copy = replay_copy;
+    hw_ptype = 0; /* no PMD classified these */
+    mem_add_pool(&mem, replay->shinfo_pool);
+    printf("Replaying %s\n", replay_path);
+  } else {
+    RTE_ETH_FOREACH_DEV(portid) {
+      if (port_init(portid, numa_nodes[plan_port_socket(portid)].mbuf_pool) !=
+          0)
+        rte_exit(EXIT_FAILURE, "Cannot init port %" PRIu16 " \n", portid);
+    }
   }
 
+  mem_report(&mem);
+
   signal(SIGINT, exit_stats);
 
   //queue = rte_ring_create("RING 1", swsize, SOCKET_ID_ANY,
   //                       RING_F_SP_ENQ | RING_F_MC_RTS_DEQ);
 
-  packet_ring = rte_ring_create("RING_PACKETS", RING_SIZE, SOCKET_ID_ANY,
-                                RING_F_MP_RTS_ENQ | RING_F_MC_RTS_DEQ);
-
-  unsigned lcoreid = 3;
-  // RTE_LCORE_FOREACH_WORKER(lcoreid)
-  for(int i=0;i<10 ;i++)
-  {
-    printf("Lcore starting remote process function\n");
-    // rte_eal_remote_launch(process_packets, (void *)&lcoreid, lcoreid);
-    lcoreid++;
-    rte_eal_remote_launch(open_packets, (void *)&lcoreid,lcoreid);
-  }
-  // set_timer();
-  portid = 0;
-  RTE_ETH_FOREACH_DEV(portid) {
-    printf("Starting rx on port %d\n", portid);
-    rte_eal_remote_launch(rx_packets, (void *)&portid, ++lcoreid);
-    rte_eal_remote_launch(rx_packets, (void *)&portid, ++lcoreid);
+  // In order packets are only seen after the merge stage
+  if (capture_prefix != NULL && merge != NULL)
+    capture_start(rte_get_main_lcore());
+  start_tsc = rte_rdtsc();
+  RTE_LCORE_FOREACH_WORKER(lcore) {
+    struct lcore_assign *a = &plan.lcore[lcore];
+    if (a->role == ROLE_WORKER) {
+      if (capture_prefix != NULL && merge == NULL) capture_start(lcore);
+      rte_eal_remote_launch(open_packets, a, lcore);
+    } else if (a->role == ROLE_RX) {
+      printf("Starting rx on port %d\n", a->port);
+      rte_eal_remote_launch(rx_packets, a, lcore);
+    }
   }
 
-  rte_eal_remote_launch(set_timer, NULL, ++lcoreid);
+  rte_telemetry_register_cmd("/packet_copy/stats", telemetry_stats,
+                             "Returns packet counters summed over lcores");
+  if (stats_thread_start(timer_period, print_stats, &is_stop) != 0)
+    rte_exit(EXIT_FAILURE, "Cannot start stats thread\n");
+  if ((sched_mode == SCHED_EVENT && evs.has_service) || merge != NULL)
+    service_loop();
   rte_eal_mp_wait_lcore();
+  if (sched_mode == SCHED_EVENT) event_sched_stop(&evs);
+  if (merge != NULL)
+    merge_free(merge, &lcore_stats[rte_get_main_lcore()].reorder);
+
+  RTE_LCORE_FOREACH(lcore) {
+    if (captures[lcore] != NULL) pthread_join(capture_tids[lcore], NULL);
+  }
+  struct lcore_stats sum;
+  stats_sum(&sum);
+  printf("Total received packets: %" PRIu64 "\n", sum.processed);
+  print_summary(start_tsc, sum.rx, sum.processed, sum.ring_drops,
+                sum.alloc_fails);
 
   return 0;
 }
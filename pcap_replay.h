@@ -0,0 +1,324 @@
+/*
+ * pcap/pcapng replay in place of an ethdev rx queue.
+ *
+ * The trace is mmapped and replay_rx_burst() turns the next records into
+ * mbufs, so captured traffic goes through the same rx_packets() code as a
+ * NIC; source_rx_burst() picks the replay or rte_eth_rx_burst(). By default
+ * the mbufs are attached to the mapping as external buffers and nothing is
+ * copied; with copy set the data goes into mbufs of the pool instead, for
+ * consumers that write to packets. Packets are released as fast as possible,
+ * at their original spacing, or at a fixed packet rate.
+ *
+ * The mbufs hold the captured bytes; the original frame length is kept in a
+ * dynamic field that source_pkt_len() reads, so byte counts and captures of
+ * a truncated trace see the frame as it was on the wire.
+ *
+ * One lcore reads a replay. Classic pcap (microsecond or nanosecond) and
+ * pcapng (EPB and SPB, per-interface if_tsresol) are read in host byte order.
+ */
+#ifndef PCAP_REPLAY_H
+#define PCAP_REPLAY_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_mbuf.h>
+#include <rte_mbuf_dyn.h>
+#include <rte_mempool.h>
+
+#include "pcapng.h"
+
+#define REPLAY_MAX_IFS 64 /**< pcapng interfaces per section */
+#define REPLAY_RATE_MAX 1000000000ull /**< Fastest paced replay, packets/s */
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+
+enum replay_timing {
+  REPLAY_FAST, /* as fast as the rx lcore takes them */
+  REPLAY_ORIG, /* original inter-packet gaps */
+  REPLAY_RATE, /* rate_pps packets per second */
+};
+
+struct replay {
+  const uint8_t *map;
+  size_t size;
+  size_t first; /* offset of the first record */
+  size_t off;   /* offset of the next record */
+  int pcapng;
+  uint64_t units[REPLAY_MAX_IFS]; /* pcapng timestamp units per second */
+  unsigned nb_ifs;
+  uint64_t pcap_units; /* classic pcap: 1e6 or 1e9 */
+
+  enum replay_timing timing;
+  uint64_t rate_pps;
+  unsigned loops; /* 0 replays forever */
+  unsigned loop;
+  int copy;
+  uint16_t port; /* put in mbuf->port */
+  double tsc_per_ns;
+  uint64_t start_tsc; /* 0 until the first packet of a loop */
+  uint64_t start_ns;
+  uint64_t sent; /* packets of the current loop */
+  uint64_t next_due; /* TSC the held back packet is due, 0 when none */
+  int done;
+  uint64_t truncated; /* copy mode frames cut to the mbuf, read by stats */
+
+  struct rte_mempool *mb_pool;
+  struct rte_mempool *shinfo_pool;
+};
+
+/* Original frame length of a replayed mbuf */
+static int replay_origlen_dynfield = -1;
+static const struct rte_mbuf_dynfield replay_origlen_dynfield_desc = {
+    .name = "pcap_replay_dynfield_origlen",
+    .size = sizeof(uint32_t),
+    .align = __alignof__(uint32_t),
+};
+
+/* Length of the frame on the wire: origlen for a replay, else pkt_len */
+static inline uint32_t source_pkt_len(const struct rte_mbuf *m) {
+  if (replay_origlen_dynfield < 0) return rte_pktmbuf_pkt_len(m);
+  return *RTE_MBUF_DYNFIELD(m, replay_origlen_dynfield, const uint32_t *);
+}
+
+static inline uint64_t replay_units_ns(uint64_t ts, uint64_t units) {
+  return ts / units * NS_PER_S + ts % units * NS_PER_S / units;
+}
+
+/* pcapng IDB options, if_tsresol sets the interface's timestamp units */
+static inline void replay_idb(struct replay *r, const uint8_t *b, uint32_t len) {
+  uint64_t units = 1000000;
+  const uint8_t *opt = b + 16, *end = b + len - 4;
+  while (opt + 4 <= end) {
+    uint16_t code, olen;
+    memcpy(&code, opt, 2);
+    memcpy(&olen, opt + 2, 2);
+    if (code == 0 || opt + 4 + olen > end) break;
+    if (code == 9 && olen >= 1) {
+      const uint8_t res = opt[4];
+      units = res & 0x80 ? 1ULL << RTE_MIN(res & 0x7f, 63) : 1;
+      for (unsigned i = 0; !(res & 0x80) && i < RTE_MIN(res, 19); i++)
+        units *= 10;
+    }
+    opt += 4 + RTE_ALIGN_CEIL(olen, 4);
+  }
+  if (r->nb_ifs < REPLAY_MAX_IFS) r->units[r->nb_ifs++] = units;
+}
+
+/* Next packet record from the cursor, -1 at the end of the trace */
+static inline int replay_next(struct replay *r, const uint8_t **data,
+                              uint32_t *caplen, uint32_t *origlen,
+                              uint64_t *ts_ns) {
+  while (r->off + 16 <= r->size) {
+    const uint8_t *b = r->map + r->off;
+    if (!r->pcapng) {
+      *caplen = pcapng_get32(b + 8);
+      *origlen = pcapng_get32(b + 12);
+      if (r->off + 16 + *caplen > r->size) return -1;
+      *ts_ns = (uint64_t)pcapng_get32(b) * NS_PER_S +
+               pcapng_get32(b + 4) * (NS_PER_S / r->pcap_units);
+      *data = b + 16;
+      r->off += 16 + *caplen;
+      return 0;
+    }
+
+    const uint32_t type = pcapng_get32(b), len = pcapng_get32(b + 4);
+    if (len < 12 || (len & 3) || r->off + len > r->size) return -1;
+    r->off += len;
+    switch (type) {
+      case PCAPNG_SHB:
+        r->nb_ifs = 0;
+        break;
+      case PCAPNG_IDB:
+        if (len >= 20) replay_idb(r, b, len);
+        break;
+      case PCAPNG_EPB: {
+        const uint32_t ifid = pcapng_get32(b + 8);
+        if (len < PCAPNG_EPB_MIN) break;
+        *caplen = pcapng_get32(b + 20);
+        *origlen = pcapng_get32(b + 24);
+        if (*caplen > len - PCAPNG_EPB_MIN) break;
+        const uint64_t ts = (uint64_t)pcapng_get32(b + 12) << 32 |
+                            pcapng_get32(b + 16);
+        *ts_ns = replay_units_ns(ts, ifid < r->nb_ifs ? r->units[ifid] : 1000000);
+        *data = b + 28;
+        return 0;
+      }
+      case PCAPNG_SPB:
+        if (len < PCAPNG_SPB_MIN) break;
+        *origlen = pcapng_get32(b + 8);
+        *caplen = RTE_MIN(*origlen, len - PCAPNG_SPB_MIN);
+        *ts_ns = 0;
+        *data = b + 12;
+        return 0;
+    }
+  }
+  return -1;
+}
+
+static inline struct replay *replay_open(const char *path, uint16_t port,
+                                         struct rte_mempool *mb_pool) {
+  struct replay *r = calloc(1, sizeof(*r));
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (r == NULL || fd < 0 || fstat(fd, &st) != 0 || st.st_size < 24) {
+    printf("Cannot open replay file %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  r->size = st.st_size;
+  r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (r->map == MAP_FAILED) {
+    printf("Cannot map %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  replay_origlen_dynfield =
+      rte_mbuf_dynfield_register(&replay_origlen_dynfield_desc);
+  if (replay_origlen_dynfield < 0) {
+    printf("Cannot register the replay origlen mbuf field\n");
+    return NULL;
+  }
+  madvise((void *)(uintptr_t)r->map, r->size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+  const uint32_t magic = pcapng_get32(r->map);
+  if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS) {
+    r->pcap_units = magic == PCAP_MAGIC_NS ? NS_PER_S : 1000000;
+    r->first = 24;
+  } else if (magic == PCAPNG_SHB &&
+             pcapng_get32(r->map + 8) == PCAPNG_BYTE_ORDER) {
+    r->pcapng = 1;
+    r->first = 0;
+  } else {
+    printf("%s is not a pcap or pcapng file in host byte order\n", path);
+    return NULL;
+  }
+  r->off = r->first;
+  r->port = port;
+  r->loops = 1;
+  r->tsc_per_ns = (double)rte_get_tsc_hz() / NS_PER_S;
+  r->mb_pool = mb_pool;
+
+  char name[RTE_MEMPOOL_NAMESIZE];
+  snprintf(name, sizeof(name), "REPLAY_SHINFO_%u", port);
+  r->shinfo_pool = rte_mempool_create(
+      name, mb_pool->size, sizeof(struct rte_mbuf_ext_shared_info),
+      RTE_MIN(mb_pool->cache_size, RTE_MEMPOOL_CACHE_MAX_SIZE), 0, NULL, NULL,
+      NULL, NULL, mb_pool->socket_id, 0);
+  if (r->shinfo_pool == NULL) {
+    printf("Cannot create %s\n", name);
+    return NULL;
+  }
+  return r;
+}
+
+/* Last reference to an attached mbuf gone, the mapping stays */
+static void replay_extbuf_free(void *addr __rte_unused, void *opaque) {
+  rte_mempool_put(rte_mempool_from_obj(opaque), opaque);
+}
+
+/* Up to n mbufs of the trace that are due, 0 once every loop is done */
+static inline uint16_t replay_rx_burst(struct replay *r,
+                                       struct rte_mbuf **bufs, uint16_t n) {
+  struct rte_mbuf_ext_shared_info *shinfo[n];
+  const uint8_t *data;
+  uint32_t caplen, origlen;
+  uint64_t ts_ns;
+  uint16_t nb = 0;
+
+  const uint64_t now = rte_rdtsc();
+  if (unlikely(r->done) || now < r->next_due) return 0;
+  r->next_due = 0;
+  if (rte_pktmbuf_alloc_bulk(r->mb_pool, bufs, n) != 0) return 0;
+  if (!r->copy &&
+      rte_mempool_get_bulk(r->shinfo_pool, (void **)shinfo, n) != 0) {
+    rte_pktmbuf_free_bulk(bufs, n);
+    return 0;
+  }
+
+  while (nb < n) {
+    const size_t off = r->off;
+    if (replay_next(r, &data, &caplen, &origlen, &ts_ns) != 0) {
+      if (++r->loop == r->loops) {
+        r->done = 1;
+        break;
+      }
+      r->off = r->first;
+      r->start_tsc = 0;
+      if (r->sent == 0) break; /* no packets at all */
+      r->sent = 0;
+      continue;
+    }
+
+    if (r->start_tsc == 0) {
+      r->start_tsc = now;
+      r->start_ns = ts_ns;
+    }
+    uint64_t due = r->start_tsc;
+    if (r->timing == REPLAY_ORIG && ts_ns > r->start_ns)
+      due += (ts_ns - r->start_ns) * r->tsc_per_ns;
+    else if (r->timing == REPLAY_RATE)
+      due += r->sent * ((double)rte_get_tsc_hz() / r->rate_pps);
+    if (due > now) {
+      r->off = off; /* not yet, read it again once due */
+      r->next_due = due;
+      break;
+    }
+    r->sent++;
+
+    struct rte_mbuf *m = bufs[nb];
+    if (r->copy) {
+      if (unlikely(caplen > rte_pktmbuf_tailroom(m))) {
+        caplen = rte_pktmbuf_tailroom(m);
+        __atomic_store_n(&r->truncated, r->truncated + 1, __ATOMIC_RELAXED);
+      }
+      rte_memcpy(rte_pktmbuf_mtod(m, void *), data, caplen);
+    } else {
+      struct rte_mbuf_ext_shared_info *sh = shinfo[nb];
+      caplen = RTE_MIN(caplen, (uint32_t)UINT16_MAX);
+      sh->free_cb = replay_extbuf_free;
+      sh->fcb_opaque = sh;
+      rte_mbuf_ext_refcnt_set(sh, 1);
+      rte_pktmbuf_attach_extbuf(
+          m, (void *)(uintptr_t)data,
+          rte_eal_iova_mode() == RTE_IOVA_VA ? (rte_iova_t)(uintptr_t)data
+                                             : RTE_BAD_IOVA,
+          caplen, sh);
+    }
+    m->data_len = caplen;
+    m->pkt_len = caplen;
+    *RTE_MBUF_DYNFIELD(m, replay_origlen_dynfield, uint32_t *) =
+        RTE_MAX(origlen, caplen);
+    m->port = r->port;
+    nb++;
+  }
+
+  if (nb < n) {
+    rte_pktmbuf_free_bulk(&bufs[nb], n - nb);
+    if (!r->copy)
+      rte_mempool_put_bulk(r->shinfo_pool, (void **)&shinfo[nb], n - nb);
+  }
+  return nb;
+}
+
+/* The common rx source: the replay when there is one, else the ethdev queue */
+static inline uint16_t source_rx_burst(struct replay *r, uint16_t port,
+                                       uint16_t queue, struct rte_mbuf **bufs,
+                                       uint16_t n) {
+  if (r != NULL) return replay_rx_burst(r, bufs, n);
+  return rte_eth_rx_burst(port, queue, bufs, n);
+}
+
+#endif /* PCAP_REPLAY_H */
@@ -0,0 +1,33 @@
+/*
+ * pcapng block definitions shared by the capture writer (capture.h) and the
+ * replay reader (pcap_replay.h). Blocks are in host byte order.
+ */
+#ifndef PCAPNG_H
+#define PCAPNG_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <rte_common.h>
+
+#define PCAPNG_SHB 0x0A0D0D0A /* Section Header Block */
+#define PCAPNG_IDB 0x00000001 /* Interface Description Block */
+#define PCAPNG_SPB 0x00000003 /* Simple Packet Block */
+#define PCAPNG_EPB 0x00000006 /* Enhanced Packet Block */
+#define PCAPNG_CB 0x40000BAD  /* custom block, readers skip it */
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+
+#define PCAPNG_CB_MIN 16
+#define PCAPNG_SPB_MIN 16 /* block header and trailer, original length */
+#define PCAPNG_EPB_MIN 32 /* the same plus interface, timestamp, lengths */
+#define PCAPNG_EPB_LEN(caplen) (PCAPNG_EPB_MIN + RTE_ALIGN_CEIL((caplen), 4))
+
+static inline uint32_t pcapng_get32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline void pcapng_put32(uint8_t *p, uint32_t v) { memcpy(p, &v, 4); }
+
+#endif /* PCAPNG_H */
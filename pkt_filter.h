@@ -0,0 +1,134 @@
+/*
+ * rx burst filter on rte_bpf, run before packets are copied or enqueued.
+ *
+ * A filter is either a tcpdump expression, compiled by libpcap to classic
+ * BPF and converted with rte_bpf_convert(), or an eBPF object built with
+ * "clang -O2 -target bpf -c", given as FILE.o[:SECTION] (section .text by
+ * default). Programs get the mbuf as their argument and a non-zero return
+ * keeps the packet. The JIT is used when the architecture has one, the
+ * interpreter otherwise. Expressions need DPDK 22.11 built with libpcap.
+ */
+#ifndef PKT_FILTER_H
+#define PKT_FILTER_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_bpf.h>
+#include <rte_common.h>
+#include <rte_config.h>
+#include <rte_errno.h>
+#include <rte_malloc.h>
+#include <rte_mbuf.h>
+#include <rte_version.h>
+
+#if defined(RTE_HAS_LIBPCAP) && RTE_VERSION >= RTE_VERSION_NUM(22, 11, 0, 0)
+#define FILTER_HAVE_EXPR 1
+#include <pcap/pcap.h>
+#endif
+
+#define FILTER_ELF_SECTION ".text"
+
+struct pkt_filter {
+  struct rte_bpf *bpf;
+  struct rte_bpf_jit jit; /* func is NULL without a JIT */
+};
+
+static inline struct rte_bpf *filter_load_elf(const char *spec) {
+  const struct rte_bpf_prm prm = {
+      .prog_arg =
+          {
+              .type = RTE_BPF_ARG_PTR_MBUF,
+              .size = sizeof(struct rte_mbuf),
+              .buf_size = RTE_MBUF_DEFAULT_DATAROOM,
+          },
+  };
+  char path[PATH_MAX];
+  const char *section = FILTER_ELF_SECTION;
+  const char *colon = strrchr(spec, ':');
+
+  snprintf(path, sizeof(path), "%s", spec);
+  if (colon != NULL) {
+    path[RTE_MIN((size_t)(colon - spec), sizeof(path) - 1)] = '\0';
+    section = colon + 1;
+  }
+  return rte_bpf_elf_load(&prm, path, section);
+}
+
+static inline struct rte_bpf *filter_load_expr(const char *expr) {
+#ifdef FILTER_HAVE_EXPR
+  struct bpf_program fcode;
+  struct rte_bpf *bpf = NULL;
+  pcap_t *pcap = pcap_open_dead(DLT_EN10MB, UINT16_MAX);
+
+  if (pcap == NULL) return NULL;
+  if (pcap_compile(pcap, &fcode, expr, 1, PCAP_NETMASK_UNKNOWN) != 0) {
+    printf("Filter %s: %s\n", expr, pcap_geterr(pcap));
+  } else {
+    struct rte_bpf_prm *prm = rte_bpf_convert(&fcode);
+    if (prm != NULL) {
+      bpf = rte_bpf_load(prm);
+      rte_free(prm);
+    }
+    pcap_freecode(&fcode);
+  }
+  pcap_close(pcap);
+  return bpf;
+#else
+  printf("Filter expressions need DPDK 22.11 with libpcap, "
+         "give a compiled FILE.o instead of %s\n", expr);
+  return NULL;
+#endif
+}
+
+/* spec is an expression, or FILE.o[:SECTION] */
+static inline struct pkt_filter *pkt_filter_create(const char *spec) {
+  struct pkt_filter *f = calloc(1, sizeof(*f));
+  const char *colon = strrchr(spec, ':');
+  const size_t len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+
+  if (f == NULL) return NULL;
+  if (len > 2 && strncmp(spec + len - 2, ".o", 2) == 0)
+    f->bpf = filter_load_elf(spec);
+  else
+    f->bpf = filter_load_expr(spec);
+  if (f->bpf == NULL) {
+    printf("Cannot load filter %s: %s\n", spec, rte_strerror(rte_errno));
+    free(f);
+    return NULL;
+  }
+  if (rte_bpf_get_jit(f->bpf, &f->jit) != 0) f->jit.func = NULL;
+  return f;
+}
+
+/*
+ * Runs the filter over a burst and frees the rejected mbufs in one bulk put.
+ * Kept packets are compacted to the front of bufs in order, their count is
+ * returned.
+ */
+static inline uint16_t pkt_filter_burst(const struct pkt_filter *f,
+                                        struct rte_mbuf **bufs, uint16_t n) {
+  uint64_t rc[n];
+  struct rte_mbuf *drop[n];
+  uint16_t nb_keep = 0, nb_drop = 0;
+
+  if (f->jit.func != NULL) {
+    for (uint16_t i = 0; i < n; i++) rc[i] = f->jit.func(bufs[i]);
+  } else {
+    rte_bpf_exec_burst(f->bpf, (void **)bufs, rc, n);
+  }
+
+  for (uint16_t i = 0; i < n; i++) {
+    if (rc[i] != 0)
+      bufs[nb_keep++] = bufs[i];
+    else
+      drop[nb_drop++] = bufs[i];
+  }
+  if (nb_drop > 0) rte_pktmbuf_free_bulk(drop, nb_drop);
+  return nb_keep;
+}
+
+#endif /* PKT_FILTER_H */
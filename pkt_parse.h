@@ -0,0 +1,318 @@
+/*
+ * Burst header parser used by packet_copy and rss_scaling.
+ *
+ * pkt_parse_mbufs() parses a whole rx burst into a struct parse_burst, one
+ * array per field: L3/L4 offsets, the 5-tuple and PARSE_F_* flags, so later
+ * stages loop over compact arrays instead of re-reading headers. Ports that
+ * report packet types get their protocols from mbuf->packet_type; for the
+ * others ethertypes and IP protocols of the burst are compared in SIMD lanes.
+ * Packet data is prefetched for the whole burst before any header is read.
+ */
+#ifndef PKT_PARSE_H
+#define PKT_PARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <rte_byteorder.h>
+#include <rte_common.h>
+#include <rte_ethdev.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_mbuf.h>
+#include <rte_mbuf_ptype.h>
+#include <rte_prefetch.h>
+#include <rte_tcp.h>
+#include <rte_vect.h>
+
+#ifndef PARSE_BURST_MAX
+#define PARSE_BURST_MAX 256 /**< Largest burst parsed at once, multiple of 16 */
+#endif
+
+#define PARSE_F_VLAN 0x01 /* one or two VLAN tags skipped */
+#define PARSE_F_IPV4 0x02
+#define PARSE_F_IPV6 0x04
+#define PARSE_F_TCP 0x08
+#define PARSE_F_UDP 0x10
+#define PARSE_F_FRAG 0x20 /* IP fragment, ports are not filled in */
+#define PARSE_F_BAD 0x40  /* truncated, or an IPv4 header failing RFC 1812 */
+
+/* One parsed burst, index i describes the i-th packet handed in */
+struct parse_burst {
+  uint16_t n;
+  uint8_t flags[PARSE_BURST_MAX];
+  uint8_t proto[PARSE_BURST_MAX];        /* IPPROTO_*, 0 when not IP */
+  uint16_t ether_type[PARSE_BURST_MAX];  /* network order, after VLAN tags */
+  uint16_t l3_off[PARSE_BURST_MAX];
+  uint16_t l4_off[PARSE_BURST_MAX];
+  uint16_t len[PARSE_BURST_MAX];
+  uint16_t src_port[PARSE_BURST_MAX];    /* network order */
+  uint16_t dst_port[PARSE_BURST_MAX];
+  uint8_t tcp_flags[PARSE_BURST_MAX];    /* RTE_TCP_*_FLAG, 0 unless TCP */
+  /* Addresses are only set for IP packets without PARSE_F_BAD, IPv4 uses
+     the first 4 bytes */
+  uint8_t src_addr[PARSE_BURST_MAX][16];
+  uint8_t dst_addr[PARSE_BURST_MAX][16];
+  uint32_t ptype[PARSE_BURST_MAX];
+  const uint8_t *data[PARSE_BURST_MAX];
+} __rte_cache_aligned;
+
+static inline int is_valid_ipv4_pkt(struct rte_ipv4_hdr *pkt, uint32_t link_len)
+{
+    /* From http://www.rfc-editor.org/rfc/rfc1812.txt section 5.2.2 */
+    /*
+     *      * 1. The packet length reported by the Link Layer must be large
+     *           * enough to hold the minimum length legal IP datagram (20 bytes).
+     *                */
+    if (link_len < sizeof(struct rte_ipv4_hdr))
+        return -1;
+    /* 2. The IP checksum must be correct. */
+    /* this is checked in H/W */
+    /*
+     *      * 3. The IP version number must be 4. If the version number is not 4
+     *           * then the packet may be another version of IP, such as IPng or
+     *                * ST-II.
+     *                     */
+    if (((pkt->version_ihl) >> 4) != 4)
+        return -3;
+    /*
+     *      * 4. The IP header length field must be large enough to hold the
+     *           * minimum length legal IP datagram (20 bytes = 5 words).
+     *                */
+    if ((pkt->version_ihl & 0xf) < 5)
+        return -4;
+    /*
+     *      * 5. The IP total length field must be large enough to hold the IP
+     *           * datagram header, whose length is specified in the IP header length
+     *                * field.
+     *                     */
+    if (rte_cpu_to_be_16(pkt->total_length) < sizeof(struct rte_ipv4_hdr))
+        return -5;
+    return 0;
+}
+
+/*
+ * Whether the port's PMD fills in the L2, L3 and L4 packet types the parser
+ * relies on; ports without them are classified in software.
+ */
+static inline int pkt_parse_port_ptypes(uint16_t port) {
+  const uint32_t mask = RTE_PTYPE_L2_MASK | RTE_PTYPE_L3_MASK | RTE_PTYPE_L4_MASK;
+  uint32_t ptypes[64];
+  int have = 0;
+  int n = rte_eth_dev_get_supported_ptypes(port, mask, ptypes, RTE_DIM(ptypes));
+  for (int i = 0; i < RTE_MIN(n, (int)RTE_DIM(ptypes)); i++) {
+    if (RTE_ETH_IS_IPV4_HDR(ptypes[i])) have |= 1;
+    if (RTE_ETH_IS_IPV6_HDR(ptypes[i])) have |= 2;
+    if ((ptypes[i] & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_TCP) have |= 4;
+    if ((ptypes[i] & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_UDP) have |= 8;
+  }
+  return have == 0xf;
+}
+
+/* flags[i] |= flag where v[i] == k, for n a multiple of 16 */
+static inline void parse_match_u16(const uint16_t *v, uint16_t n, uint16_t k,
+                                   uint8_t *flags, uint8_t flag) {
+  uint16_t i = 0;
+#if defined(__AVX2__)
+  const __m256i key = _mm256_set1_epi16(k);
+  const __m128i bit = _mm_set1_epi8(flag);
+  for (; i < n; i += 16) {
+    __m256i eq = _mm256_cmpeq_epi16(
+        _mm256_loadu_si256((const __m256i *)(v + i)), key);
+    __m128i m = _mm_packs_epi16(_mm256_castsi256_si128(eq),
+                                _mm256_extracti128_si256(eq, 1));
+    __m128i f = _mm_loadu_si128((const __m128i *)(flags + i));
+    _mm_storeu_si128((__m128i *)(flags + i),
+                     _mm_or_si128(f, _mm_and_si128(m, bit)));
+  }
+#elif defined(__SSE4_2__)
+  const __m128i key = _mm_set1_epi16(k);
+  const __m128i bit = _mm_set1_epi8(flag);
+  for (; i < n; i += 8) {
+    __m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(v + i)), key);
+    __m128i m = _mm_packs_epi16(eq, _mm_setzero_si128());
+    __m128i f = _mm_loadl_epi64((const __m128i *)(flags + i));
+    _mm_storel_epi64((__m128i *)(flags + i),
+                     _mm_or_si128(f, _mm_and_si128(m, bit)));
+  }
+#endif
+  for (; i < n; i++) flags[i] |= v[i] == k ? flag : 0;
+}
+
+/* flags[i] |= flag where v[i] == k, for n a multiple of 16 */
+static inline void parse_match_u8(const uint8_t *v, uint16_t n, uint8_t k,
+                                  uint8_t *flags, uint8_t flag) {
+  uint16_t i = 0;
+#if defined(__SSE4_2__)
+  const __m128i key = _mm_set1_epi8(k);
+  const __m128i bit = _mm_set1_epi8(flag);
+  for (; i < n; i += 16) {
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(v + i)), key);
+    __m128i f = _mm_loadu_si128((const __m128i *)(flags + i));
+    _mm_storeu_si128((__m128i *)(flags + i),
+                     _mm_or_si128(f, _mm_and_si128(eq, bit)));
+  }
+#endif
+  for (; i < n; i++) flags[i] |= v[i] == k ? flag : 0;
+}
+
+/* PARSE_F_* and the L3 offset straight from the PMD packet type */
+static inline uint8_t parse_ptype_flags(uint32_t ptype, uint16_t *l3_off) {
+  uint8_t f = 0;
+  switch (ptype & RTE_PTYPE_L2_MASK) {
+    case RTE_PTYPE_L2_ETHER_QINQ:
+      *l3_off = RTE_ETHER_HDR_LEN + 2 * sizeof(struct rte_vlan_hdr);
+      f |= PARSE_F_VLAN;
+      break;
+    case RTE_PTYPE_L2_ETHER_VLAN:
+      *l3_off = RTE_ETHER_HDR_LEN + sizeof(struct rte_vlan_hdr);
+      f |= PARSE_F_VLAN;
+      break;
+    default:
+      *l3_off = RTE_ETHER_HDR_LEN;
+  }
+  if (RTE_ETH_IS_IPV4_HDR(ptype))
+    f |= PARSE_F_IPV4;
+  else if (RTE_ETH_IS_IPV6_HDR(ptype))
+    f |= PARSE_F_IPV6;
+  switch (ptype & RTE_PTYPE_L4_MASK) {
+    case RTE_PTYPE_L4_TCP: f |= PARSE_F_TCP; break;
+    case RTE_PTYPE_L4_UDP: f |= PARSE_F_UDP; break;
+    case RTE_PTYPE_L4_FRAG: f |= PARSE_F_FRAG; break;
+  }
+  return f;
+}
+
+/* Ethertype past up to two VLAN tags, software path */
+static inline void parse_l2(struct parse_burst *pb, uint16_t i) {
+  const uint8_t *d = pb->data[i];
+  uint16_t off = RTE_ETHER_HDR_LEN, et = 0;
+  uint8_t f = 0;
+
+  if (unlikely(pb->len[i] < RTE_ETHER_HDR_LEN)) {
+    f = PARSE_F_BAD;
+  } else {
+    memcpy(&et, d + off - 2, sizeof(et));
+    for (int tags = 0; tags < 2; tags++) {
+      if (likely(et != RTE_BE16(RTE_ETHER_TYPE_VLAN) &&
+                 et != RTE_BE16(RTE_ETHER_TYPE_QINQ)))
+        break;
+      if (unlikely(pb->len[i] < off + sizeof(struct rte_vlan_hdr))) {
+        f = PARSE_F_BAD;
+        et = 0;
+        break;
+      }
+      memcpy(&et, d + off + 2, sizeof(et));
+      off += sizeof(struct rte_vlan_hdr);
+      f |= PARSE_F_VLAN;
+    }
+  }
+  pb->ether_type[i] = et;
+  pb->l3_off[i] = off;
+  pb->flags[i] = f;
+}
+
+/* Addresses, protocol and L4 offset of an IPv4 or IPv6 packet */
+static inline void parse_l3(struct parse_burst *pb, uint16_t i) {
+  const uint8_t *d = pb->data[i];
+  const uint16_t off = pb->l3_off[i];
+  uint8_t f = pb->flags[i];
+
+  pb->proto[i] = 0;
+  pb->l4_off[i] = off;
+  if (f & PARSE_F_IPV4) {
+    struct rte_ipv4_hdr *ip = (struct rte_ipv4_hdr *)(uintptr_t)(d + off);
+    if (unlikely(pb->len[i] < off + sizeof(*ip) ||
+                 is_valid_ipv4_pkt(ip, pb->len[i] - off) < 0)) {
+      pb->flags[i] = f | PARSE_F_BAD;
+      return;
+    }
+    pb->proto[i] = ip->next_proto_id;
+    pb->l4_off[i] = off + (ip->version_ihl & RTE_IPV4_HDR_IHL_MASK) *
+                              RTE_IPV4_IHL_MULTIPLIER;
+    memset(pb->src_addr[i], 0, 16);
+    memset(pb->dst_addr[i], 0, 16);
+    memcpy(pb->src_addr[i], &ip->src_addr, 4);
+    memcpy(pb->dst_addr[i], &ip->dst_addr, 4);
+    if (ip->fragment_offset &
+        RTE_BE16(RTE_IPV4_HDR_OFFSET_MASK | RTE_IPV4_HDR_MF_FLAG))
+      f |= PARSE_F_FRAG;
+  } else if (f & PARSE_F_IPV6) {
+    const struct rte_ipv6_hdr *ip6 = (const struct rte_ipv6_hdr *)(d + off);
+    if (unlikely(pb->len[i] < off + sizeof(*ip6))) {
+      pb->flags[i] = f | PARSE_F_BAD;
+      return;
+    }
+    // Extension headers are not walked, their proto matches neither TCP nor UDP
+    pb->proto[i] = ip6->proto;
+    pb->l4_off[i] = off + sizeof(*ip6);
+    memcpy(pb->src_addr[i], ip6->src_addr, 16);
+    memcpy(pb->dst_addr[i], ip6->dst_addr, 16);
+    if (ip6->proto == IPPROTO_FRAGMENT) f |= PARSE_F_FRAG;
+  }
+  pb->flags[i] = f;
+}
+
+/* Parse pb->data/len/ptype[0, n), hw_ptype when ptype[] came from the PMD */
+static inline void pkt_parse_run(struct parse_burst *pb, uint16_t n,
+                                 int hw_ptype) {
+  const uint16_t nv = RTE_ALIGN_CEIL(n, 16);
+  uint16_t i;
+
+  pb->n = n;
+  if (hw_ptype) {
+    for (i = 0; i < n; i++) {
+      pb->flags[i] = parse_ptype_flags(pb->ptype[i], &pb->l3_off[i]);
+      if (unlikely(pb->len[i] < pb->l3_off[i])) pb->flags[i] |= PARSE_F_BAD;
+    }
+    for (i = 0; i < n; i++) parse_l3(pb, i);
+  } else {
+    for (i = 0; i < n; i++) parse_l2(pb, i);
+    for (i = n; i < nv; i++) {
+      pb->ether_type[i] = 0;
+      pb->flags[i] = 0;
+    }
+    parse_match_u16(pb->ether_type, nv, RTE_BE16(RTE_ETHER_TYPE_IPV4),
+                    pb->flags, PARSE_F_IPV4);
+    parse_match_u16(pb->ether_type, nv, RTE_BE16(RTE_ETHER_TYPE_IPV6),
+                    pb->flags, PARSE_F_IPV6);
+    for (i = 0; i < n; i++) parse_l3(pb, i);
+    for (i = n; i < nv; i++) pb->proto[i] = 0;
+    parse_match_u8(pb->proto, nv, IPPROTO_TCP, pb->flags, PARSE_F_TCP);
+    parse_match_u8(pb->proto, nv, IPPROTO_UDP, pb->flags, PARSE_F_UDP);
+  }
+
+  // TCP and UDP both start with the two ports
+  for (i = 0; i < n; i++) {
+    const uint8_t f = pb->flags[i];
+    pb->src_port[i] = 0;
+    pb->dst_port[i] = 0;
+    pb->tcp_flags[i] = 0;
+    if ((f & (PARSE_F_TCP | PARSE_F_UDP)) && !(f & (PARSE_F_FRAG | PARSE_F_BAD)) &&
+        likely(pb->len[i] >= pb->l4_off[i] + 4)) {
+      memcpy(&pb->src_port[i], pb->data[i] + pb->l4_off[i], 2);
+      memcpy(&pb->dst_port[i], pb->data[i] + pb->l4_off[i] + 2, 2);
+      if ((f & PARSE_F_TCP) &&
+          pb->len[i] >= pb->l4_off[i] + sizeof(struct rte_tcp_hdr))
+        pb->tcp_flags[i] =
+            pb->data[i][pb->l4_off[i] + offsetof(struct rte_tcp_hdr, tcp_flags)];
+    }
+  }
+}
+
+/* Parse the first segment of n <= PARSE_BURST_MAX mbufs */
+static inline void pkt_parse_mbufs(struct parse_burst *pb,
+                                   struct rte_mbuf **bufs, uint16_t n,
+                                   int hw_ptype) {
+  for (uint16_t i = 0; i < n; i++) {
+    pb->data[i] = rte_pktmbuf_mtod(bufs[i], const uint8_t *);
+    rte_prefetch0(pb->data[i]);
+    pb->len[i] = rte_pktmbuf_data_len(bufs[i]);
+    pb->ptype[i] = bufs[i]->packet_type;
+  }
+  pkt_parse_run(pb, n, hw_ptype);
+}
+
+#endif /* PKT_PARSE_H */
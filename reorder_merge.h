@@ -0,0 +1,167 @@
+/*
+ * Merge stage restoring rx order after parallel workers, on rte_reorder.
+ *
+ * Every rx lcore numbers the mbufs it hands off (merge_stamp()), in one
+ * sequence of its own, and marks them with its source index. Workers give
+ * finished mbufs to the merge ring instead of freeing them, and
+ * merge_poll() puts each into the reorder buffer of its source and drains
+ * what is in sequence. A source is one rx queue, so its order is the
+ * arrival order of the queue, and with RSS keeping a flow on one queue the
+ * order of every flow.
+ *
+ * A reorder buffer holds a window of sequence numbers. Packets older than
+ * the window are late, they are passed on as they come; ones too far ahead
+ * for it push the window forward, skipping missing sequence numbers, and
+ * are dropped when it cannot move. Rx lcores only advance their sequence
+ * by what was enqueued, so drops before the workers leave no gaps.
+ *
+ * At the end of a run the merge lcore polls until the ring is empty and
+ * nothing more drains; merge_free() counts what is left behind a gap as
+ * drops.
+ */
+#ifndef REORDER_MERGE_H
+#define REORDER_MERGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_errno.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_mbuf_dyn.h>
+#include <rte_reorder.h>
+#include <rte_ring.h>
+
+#include "stats.h"
+
+#define MERGE_MAX_SRC 64
+#define MERGE_WINDOW_MAX (1u << 20) /**< Largest reorder window per source */
+
+/* Merge lcore counters, one writer */
+struct merge_stats {
+  uint64_t ordered; /* drained in sequence */
+  uint64_t late;    /* behind the window, passed on out of order */
+  uint64_t drops;   /* too far ahead for the window, or no merge ring room */
+};
+
+struct merge {
+  struct rte_ring *ring; /* workers to the merge lcore */
+  struct rte_reorder_buffer *buf[MERGE_MAX_SRC];
+  unsigned nb_src;
+  uint64_t held; /* mbufs in the reorder buffers, merge lcore only */
+};
+
+static int merge_src_dynfield = -1;
+static const struct rte_mbuf_dynfield merge_src_dynfield_desc = {
+    .name = "reorder_merge_src",
+    .size = sizeof(uint16_t),
+    .align = __alignof__(uint16_t),
+};
+
+static inline uint16_t *merge_src(struct rte_mbuf *m) {
+  return RTE_MBUF_DYNFIELD(m, merge_src_dynfield, uint16_t *);
+}
+
+/*
+ * nb_src reorder buffers of window sequence numbers (a power of two) and a
+ * merge ring able to hold ring_size mbufs, so workers never find it full.
+ */
+static inline struct merge *merge_create(unsigned nb_src, unsigned window,
+                                         unsigned ring_size, int socket) {
+  struct merge *m = calloc(1, sizeof(*m));
+  char name[RTE_RING_NAMESIZE];
+
+  if (m == NULL || nb_src > MERGE_MAX_SRC) goto fail;
+  merge_src_dynfield = rte_mbuf_dynfield_register(&merge_src_dynfield_desc);
+  if (merge_src_dynfield < 0) goto fail;
+  m->ring = rte_ring_create("MERGE_RING", rte_align32pow2(ring_size + 1),
+                            socket, RING_F_SC_DEQ);
+  if (m->ring == NULL) goto fail;
+  for (m->nb_src = 0; m->nb_src < nb_src; m->nb_src++) {
+    snprintf(name, sizeof(name), "REORDER_%u", m->nb_src);
+    m->buf[m->nb_src] =
+        rte_reorder_create(name, socket, rte_align32pow2(window));
+    if (m->buf[m->nb_src] == NULL) goto fail;
+  }
+  return m;
+
+fail:
+  printf("Cannot create the reorder merge stage: %s\n",
+         rte_strerror(rte_errno));
+  return NULL;
+}
+
+/* Numbers a burst from source src, seq is the source's next number */
+static inline void merge_stamp(struct rte_mbuf **bufs, uint16_t n,
+                               uint16_t src, uint32_t seq) {
+  for (uint16_t i = 0; i < n; i++) {
+    *rte_reorder_seqn(bufs[i]) = seq + i;
+    *merge_src(bufs[i]) = src;
+  }
+}
+
+/* Worker side, the mbufs belong to the merge stage afterwards */
+static inline void merge_put(struct merge *m, struct rte_mbuf **bufs,
+                             unsigned n, struct merge_stats *st) {
+  const unsigned nb = rte_ring_mp_enqueue_burst(m->ring, (void **)bufs, n, NULL);
+  if (unlikely(nb < n)) {
+    stats_add(&st->drops, n - nb);
+    rte_pktmbuf_free_bulk(&bufs[nb], n - nb);
+  }
+}
+
+/*
+ * Takes what the workers finished and returns up to n mbufs in out: late
+ * ones first, then every source's in-sequence packets.
+ */
+static inline unsigned merge_poll(struct merge *m, struct rte_mbuf **out,
+                                  unsigned n, struct merge_stats *st) {
+  struct rte_mbuf *in[n];
+  unsigned nb_out = 0, late = 0, drops = 0;
+
+  const unsigned nb = rte_ring_sc_dequeue_burst(m->ring, (void **)in, n, NULL);
+  for (unsigned i = 0; i < nb; i++) {
+    const uint16_t src = *merge_src(in[i]);
+    if (rte_reorder_insert(m->buf[src], in[i]) == 0) continue;
+    if (rte_errno == ERANGE) {
+      out[nb_out++] = in[i];
+      late++;
+    } else {
+      rte_pktmbuf_free(in[i]);
+      drops++;
+    }
+  }
+  if (late) stats_add(&st->late, late);
+  if (drops) stats_add(&st->drops, drops);
+
+  const unsigned first = nb_out;
+  for (unsigned s = 0; s < m->nb_src && nb_out < n; s++)
+    nb_out += rte_reorder_drain(m->buf[s], &out[nb_out], n - nb_out);
+  if (nb_out > first) stats_add(&st->ordered, nb_out - first);
+  m->held += nb - late - drops - (nb_out - first);
+  return nb_out;
+}
+
+/*
+ * Frees the buffers with the mbufs still waiting in them, counted as drops.
+ * Only the merge lcore may call it, after the workers stopped.
+ */
+static inline void merge_free(struct merge *m, struct merge_stats *st) {
+  struct rte_mbuf *bufs[64];
+  uint64_t drops = m->held;
+  unsigned nb;
+  while ((nb = rte_ring_sc_dequeue_burst(m->ring, (void **)bufs, RTE_DIM(bufs),
+                                         NULL)) > 0) {
+    rte_pktmbuf_free_bulk(bufs, nb);
+    drops += nb;
+  }
+  if (drops) stats_add(&st->drops, drops);
+  for (unsigned s = 0; s < m->nb_src; s++) rte_reorder_free(m->buf[s]);
+  rte_ring_free(m->ring);
+  free(m);
+}
+
+#endif /* REORDER_MERGE_H */
@@ -1,47 +1,210 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <rte_cycles.h>
 #include <rte_eal.h>
+#include <rte_errno.h>
 #include <rte_ethdev.h>
+#include <rte_ip.h>
 #include <rte_lcore.h>
 #include <rte_malloc.h>
 #include <rte_mbuf.h>
+#include <rte_mempool.h>
 #include <rte_ring.h>
+#include <rte_telemetry.h>
+#include <rte_thash.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "flow_table.h"
+#include "idle.h"
+#include "lcore_plan.h"
+#include "mem_budget.h"
+#include "overload.h"
+#include "pkt_parse.h"
+#include "stats.h"
+
+/* Defaults of the run time options, see usage() */
 #define RX_RING_SIZE 2048
-#define RX_QUEUES 3
+#define RX_QUEUES 0 /**< Rx queues per port, 0 uses every worker lcore the device allows */
 #define TX_RING_SIZE 4096
-#define MBUFS 8191
 #define MBUF_CACHE 256
-#define MBUFSZ (2048 + sizeof(struct rte_mbuf) + RTE_PKTMBUF_HEADROOM)
-#define LCORE_QUEUESZ 4194304
+#ifndef BURST_SIZE
 #define BURST_SIZE 32
+#endif
+#define BURST_MAX PARSE_BURST_MAX /**< Largest --burst, sizes the burst arrays */
 
-#define RING_SIZE 1048576
 #define MEMPOOL_CACHE_SIZE 256
-#define MAX_PKT_BURST 32
-#define RTE_TEST_RX_DESC_DEFAULT 4096  /**< Configurable number of RX ring descriptors */
-#define RTE_TEST_TX_DESC_DEFAULT 16384 /**< Configurable number of TX ring descriptors */
-
-#define NB_MBUF RTE_MAX(                    \
-        (nb_ports * nb_rx_queue * nb_rxd +      \
-         nb_ports * nb_lcores * MAX_PKT_BURST + \
-         nb_ports * n_tx_queue * nb_txd +       \
-         nb_lcores * MEMPOOL_CACHE_SIZE),       \
-         (unsigned)8192)
+#define RSS_KEY_MAX 52        /**< Largest Toeplitz key we program */
+#define RSS_KEY_DEFAULT_LEN 40
+#define SOFT_RETA_SIZE 512    /**< Software redirection table, power of 2 */
+#define RSS_WEIGHT_MAX 1024   /**< Largest -w weight */
+#define RING_LATENCY_US 1000  /**< Queue lcore stall a soft_ring absorbs, -W */
+#define RING_PPS 14880000     /**< Expected packets per second per port, -P */
+#define NB_MBUF_MIN 8192
+#define FLOW_EXPORT_RING_SIZE 65536 /**< Expired flow records waiting for export */
+#define FLOW_RECORDS (2 * FLOW_EXPORT_RING_SIZE - 1)
+#define FLOW_EXPORT_BURST 64
+#define FLOW_EXPORT_SLEEP_US 1000   /**< Export thread naps when the ring is empty */
+#define IDLE_SLEEP_US 1000          /**< Idle period before lcores sleep, -I */
+#define FLOWS_MIN 1024              /**< Smallest --flows */
+#define FLOWS_MAX (1u << 26)        /**< Largest --flows */
 
 static uint8_t nb_ports;
-static volatile unsigned long packets_rx;
-static volatile unsigned long packets_processed;
-static uint64_t timer_period = 3;
-static uint64_t timer_cycles;
+static uint64_t timer_period = 3; /* --stats, seconds, 0 prints none */
+static uint16_t burst_size = BURST_SIZE;
+static uint16_t rx_ring_size = RX_RING_SIZE; /* rx descriptors per queue */
+static unsigned mbuf_cache = MBUF_CACHE;
+static uint16_t rx_queues = RX_QUEUES;
+static unsigned soft_ring_fixed; /* --ring-size, 0 sizes from -P and -W */
+static unsigned flow_table_size = FLOW_TABLE_SIZE; /* --flows per worker */
 static volatile char is_stop = 0;
-unsigned int free_space = LCORE_QUEUESZ;
-unsigned int free_space2 = LCORE_QUEUESZ;
-struct rte_ring *queue;
-struct rte_ring *packet_ring;
+static uint64_t start_tsc; /* set when the lcores are launched */
+static unsigned mem_budget_mb; /* -M, 0 is the free memory */
+static uint64_t ring_pps = RING_PPS;
+static unsigned ring_latency_us = RING_LATENCY_US;
+static struct mem_budget mem;
+static struct overload overload; /* -b, full soft_rings */
+static uint64_t idle_sleep_us = IDLE_SLEEP_US; /* 0 polls all the time */
+
+/* The one (port, queue) an lcore polls, built once at startup */
+struct lcore_queue {
+  uint16_t port;
+  uint16_t queue;
+  uint8_t enabled;
+};
+static struct lcore_queue lcore_queue_conf[RTE_MAX_LCORE];
+static uint16_t nb_rx_queues;
+static struct lcore_plan plan;
+
+/*
+ * Counters written only by the owning lcore, summed by print_stats().
+ * enqueued and ring_drops count the software RSS hand-off.
+ */
+struct lcore_stats {
+  uint64_t rx;
+  uint64_t enqueued;
+  uint64_t ring_drops;
+  uint64_t processed;
+  uint64_t bytes;
+  uint64_t non_ip;    /* parsed as neither IPv4 nor IPv6 */
+  uint64_t malformed; /* PARSE_F_BAD */
+  uint64_t flows;     /* in this lcore's flow table */
+  uint64_t flow_adds;
+  uint64_t flow_full; /* packets of new flows with the table full */
+  uint64_t flow_expired;
+  uint64_t expire_capped; /* polls whose expiry work hit FLOW_EXPIRE_BUDGET */
+  uint64_t expire_lag;    /* wheel ticks left behind by the last capped poll */
+  uint64_t export_drops;
+  uint64_t alloc_fails;
+  struct overload_stats overload; /* ring_drops is their drops summed */
+  struct idle_stats idle;
+} __rte_cache_aligned;
+static struct lcore_stats lcore_stats[RTE_MAX_LCORE];
+
+static struct lcore_stats stats_last; /* print_stats() rates are deltas */
+
+#define LCORE_STAT(member) STATS_FIELD(struct lcore_stats, member)
+#define LCORE_STAT_AS(name, member) \
+  STATS_FIELD_AS(name, struct lcore_stats, member)
+
+/* Summed by stats_sum(), also the keys of /rss_scaling/stats */
+static const struct stats_field stats_fields[] = {
+    LCORE_STAT(rx),
+    LCORE_STAT(enqueued),
+    LCORE_STAT(ring_drops),
+    LCORE_STAT(processed),
+    LCORE_STAT(bytes),
+    LCORE_STAT(alloc_fails),
+    LCORE_STAT(non_ip),
+    LCORE_STAT(malformed),
+    LCORE_STAT(flows),
+    LCORE_STAT(flow_adds),
+    LCORE_STAT(flow_full),
+    LCORE_STAT(flow_expired),
+    LCORE_STAT(export_drops),
+    LCORE_STAT(expire_capped),
+    STATS_FIELD_MAX("expire_lag", struct lcore_stats, expire_lag),
+    LCORE_STAT_AS("tail_drops", overload.tail_drops),
+    LCORE_STAT_AS("class_drops", overload.class_drops),
+    LCORE_STAT_AS("rx_pauses", overload.pauses),
+    LCORE_STAT_AS("rx_pause_cycles", overload.pause_cycles),
+    LCORE_STAT_AS("busy_cycles", idle.busy_cycles),
+    LCORE_STAT_AS("idle_cycles", idle.idle_cycles),
+    LCORE_STAT_AS("idle_pause_waits", idle.waits[IDLE_PAUSE]),
+    LCORE_STAT_AS("idle_monitor_waits", idle.waits[IDLE_MONITOR]),
+    LCORE_STAT_AS("idle_sleep_waits", idle.waits[IDLE_SLEEP]),
+};
+
+/* Count the non-IP and malformed packets of a parsed burst */
+static inline void stats_parsed(struct lcore_stats *stats,
+                                const struct parse_burst *pb) {
+  uint64_t non_ip = 0, bad = 0;
+  for (uint16_t i = 0; i < pb->n; i++) {
+    non_ip += !(pb->flags[i] & (PARSE_F_IPV4 | PARSE_F_IPV6 | PARSE_F_BAD));
+    bad += !!(pb->flags[i] & PARSE_F_BAD);
+  }
+  if (non_ip) stats_add(&stats->non_ip, non_ip);
+  if (bad) stats_add(&stats->malformed, bad);
+}
+
+static void stats_sum(struct lcore_stats *sum) {
+  stats_sum_lcores(sum, lcore_stats, sizeof(*sum), stats_fields,
+                   RTE_DIM(stats_fields));
+}
+
+/* Hash fields selectable with -H */
+static const struct {
+  const char *name;
+  uint64_t rss_hf;
+} rss_hf_names[] = {
+    {"ip", ETH_RSS_IP},     {"udp", ETH_RSS_UDP},       {"tcp", ETH_RSS_TCP},
+    {"sctp", ETH_RSS_SCTP}, {"tunnel", ETH_RSS_TUNNEL},
+};
+static uint64_t rss_hf = ETH_RSS_IP | ETH_RSS_UDP | ETH_RSS_TCP;
+static int rss_symmetric;
+static uint16_t rss_weights[RTE_MAX_QUEUES_PER_PORT];
+static unsigned nb_rss_weights;
+
+/* Default Toeplitz key, the one most PMDs ship with */
+static const uint8_t rss_key_default[RSS_KEY_DEFAULT_LEN] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67,
+    0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb,
+    0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30,
+    0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/*
+ * Per-port RSS state. Ports whose PMD cannot hash the requested fields
+ * get a single hardware queue; the lcore polling it computes the same
+ * Toeplitz hash with rte_softrss and hands packets to the other queue
+ * lcores through soft_rings.
+ */
+static uint8_t rss_key[RTE_MAX_ETHPORTS][RSS_KEY_MAX] __rte_aligned(4);
+static uint8_t rss_key_be[RTE_MAX_ETHPORTS][RSS_KEY_MAX] __rte_aligned(4);
+static uint8_t soft_rss[RTE_MAX_ETHPORTS];
+static uint16_t soft_reta[SOFT_RETA_SIZE];
+static struct rte_ring *soft_rings[RTE_MAX_ETHPORTS][RTE_MAX_QUEUES_PER_PORT];
+static unsigned soft_ring_size; /* a queue's share of -P for -W */
+
+/* Ports whose PMD fills in mbuf->packet_type for pkt_parse_mbufs() */
+static uint8_t port_ptype[RTE_MAX_ETHPORTS];
+
+/* One flow table per worker lcore, on the lcore's socket */
+static struct flow_table *flow_tables[RTE_MAX_LCORE];
+
+/* Expired flows, drained by flow_export_thread() into the -e file; without -e
+ * there is no ring and the workers only drop expired flows */
+static struct rte_ring *flow_export_ring;
+static struct rte_mempool *flow_record_pool;
+static FILE *flow_export_file;
+static int export_done; /* no more records, set by main() */
+static uint64_t flows_exported;
 
 static const struct rte_eth_conf port_conf_default = {
     .rxmode =
@@ -52,21 +215,126 @@ static const struct rte_eth_conf port_conf_default = {
 	.rx_adv_conf = {
 		.rss_conf = {
 			.rss_key = NULL,
-			.rss_hf = ETH_RSS_TCP,
+			.rss_hf = ETH_RSS_IP | ETH_RSS_UDP | ETH_RSS_TCP,
 		},
 	},
 };
 
-struct packet {
-  int size;
-  u_char *data;
-};
+/* Queue for redirection table entry i, interleaved by the -w weights */
+static uint16_t reta_queue(unsigned i) {
+  unsigned total = 0, q;
+  for (q = 0; q < nb_rx_queues; q++)
+    total += q < nb_rss_weights ? rss_weights[q] : 1;
+  unsigned pos = i % total;
+  for (q = 0; q < nb_rx_queues; q++) {
+    unsigned w = q < nb_rss_weights ? rss_weights[q] : 1;
+    if (pos < w) break;
+    pos -= w;
+  }
+  return q;
+}
+
+static int reta_program(uint16_t port, uint16_t reta_size) {
+  struct rte_eth_rss_reta_entry64
+      reta_conf[ETH_RSS_RETA_SIZE_512 / RTE_RETA_GROUP_SIZE];
+
+  if (reta_size == 0 || reta_size > ETH_RSS_RETA_SIZE_512) return -ENOTSUP;
+  memset(reta_conf, 0, sizeof(reta_conf));
+  for (unsigned i = 0; i < reta_size; i++) {
+    unsigned idx = i / RTE_RETA_GROUP_SIZE;
+    unsigned shift = i % RTE_RETA_GROUP_SIZE;
+    reta_conf[idx].mask |= 1ULL << shift;
+    reta_conf[idx].reta[shift] = reta_queue(i);
+  }
+  return rte_eth_dev_rss_reta_update(port, reta_conf, reta_size);
+}
+
+/* Fill the port's key, 0x6d5a repeated makes Toeplitz symmetric */
+static void rss_key_init(uint16_t port, uint8_t key_len) {
+  for (unsigned i = 0; i < key_len; i++) {
+    if (rss_symmetric)
+      rss_key[port][i] = i % 2 ? 0x5a : 0x6d;
+    else
+      rss_key[port][i] = rss_key_default[i % RSS_KEY_DEFAULT_LEN];
+  }
+  rte_convert_rss_key((const uint32_t *)rss_key[port],
+                      (uint32_t *)rss_key_be[port], key_len);
+}
+
+/* Software Toeplitz hash over the same outer fields the NIC would use, inner
+ * headers of tunnels are not parsed */
+static uint32_t soft_rss_hash(struct rte_mbuf *m, uint16_t port) {
+  struct rte_ether_hdr *eth = rte_pktmbuf_mtod(m, struct rte_ether_hdr *);
+  const uint32_t data_len = rte_pktmbuf_data_len(m);
+  union rte_thash_tuple tuple;
+  uint16_t ether_type;
+  uint32_t off = sizeof(*eth), len, l4_off;
+  const uint16_t *l4;
+  uint8_t proto;
+
+  // Runt and truncated frames hash to 0 rather than from stale bytes
+  if (data_len < off) return 0;
+  ether_type = eth->ether_type;
+  if (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)) {
+    struct rte_vlan_hdr *vh = (struct rte_vlan_hdr *)(eth + 1);
+    if (data_len < off + sizeof(*vh)) return 0;
+    ether_type = vh->eth_proto;
+    off += sizeof(*vh);
+  }
+
+  if (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
+    struct rte_ipv4_hdr *ip =
+        rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr *, off);
+    if (data_len < off + sizeof(*ip)) return 0;
+    tuple.v4.src_addr = rte_be_to_cpu_32(ip->src_addr);
+    tuple.v4.dst_addr = rte_be_to_cpu_32(ip->dst_addr);
+    len = RTE_THASH_V4_L3_LEN;
+    proto = ip->next_proto_id;
+    l4_off = off + (ip->version_ihl & RTE_IPV4_HDR_IHL_MASK) *
+                       RTE_IPV4_IHL_MULTIPLIER;
+    if (ip->fragment_offset & rte_cpu_to_be_16(RTE_IPV4_HDR_MF_FLAG |
+                                               RTE_IPV4_HDR_OFFSET_MASK))
+      proto = 0;
+  } else if (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6)) {
+    struct rte_ipv6_hdr *ip6 =
+        rte_pktmbuf_mtod_offset(m, struct rte_ipv6_hdr *, off);
+    if (data_len < off + sizeof(*ip6)) return 0;
+    rte_thash_load_v6_addrs(ip6, &tuple);
+    len = RTE_THASH_V6_L3_LEN;
+    proto = ip6->proto;
+    l4_off = off + sizeof(*ip6);
+  } else {
+    return 0;
+  }
+
+  // An IHL past the frame or a cut L4 header leaves the L3 hash
+  if (data_len < l4_off + 2 * sizeof(*l4)) proto = 0;
+  if ((proto == IPPROTO_TCP && (rss_hf & ETH_RSS_TCP)) ||
+      (proto == IPPROTO_UDP && (rss_hf & ETH_RSS_UDP)) ||
+      (proto == IPPROTO_SCTP && (rss_hf & ETH_RSS_SCTP))) {
+    l4 = rte_pktmbuf_mtod_offset(m, const uint16_t *, l4_off);
+    // sport/dport sit at the same offsets in the v4 and v6 tuples' tails
+    if (len == RTE_THASH_V4_L3_LEN) {
+      tuple.v4.sport = rte_be_to_cpu_16(l4[0]);
+      tuple.v4.dport = rte_be_to_cpu_16(l4[1]);
+      len = RTE_THASH_V4_L4_LEN;
+    } else {
+      tuple.v6.sport = rte_be_to_cpu_16(l4[0]);
+      tuple.v6.dport = rte_be_to_cpu_16(l4[1]);
+      len = RTE_THASH_V6_L4_LEN;
+    }
+  } else if (!(rss_hf & ETH_RSS_IP)) {
+    return 0;
+  }
+
+  return rte_softrss_be((uint32_t *)&tuple, len, rss_key_be[port]);
+}
 
 int port_init(uint16_t port, struct rte_mempool *membuf_pool) {
   struct rte_eth_conf port_conf = port_conf_default;
-  const uint16_t rx_rings = RX_QUEUES;
+  uint16_t rx_rings = nb_rx_queues;
   const uint16_t tx_rings = 0;
-  uint16_t nb_rxd = RX_RING_SIZE;
+  uint16_t nb_rxd = rx_ring_size;
   uint16_t nb_txd = TX_RING_SIZE;
   int ret;
 
@@ -89,22 +357,61 @@ int port_init(uint16_t port, struct rte_mempool *membuf_pool) {
 
 //   printf("Dev adjust rx-tx success [%u]\n", port);
 
-  port_conf.rx_adv_conf.rss_conf.rss_hf &=
-	  dev_info.flow_type_rss_offloads;
-  if (port_conf.rx_adv_conf.rss_conf.rss_hf !=
-		  port_conf.rx_adv_conf.rss_conf.rss_hf)
+  port_conf.rx_adv_conf.rss_conf.rss_hf =
+	  rss_hf & dev_info.flow_type_rss_offloads;
+  if (port_conf.rx_adv_conf.rss_conf.rss_hf != rss_hf)
   {
 	  printf("Port %u modified RSS hash function based on hardware support,"
 			  "requested:%#" PRIx64 " configured:%#" PRIx64 "\n",
-			  port,
-			  port_conf.rx_adv_conf.rss_conf.rss_hf,
+			  port, rss_hf,
 			  port_conf.rx_adv_conf.rss_conf.rss_hf);
   }
 
+  uint8_t key_len = dev_info.hash_key_size ? dev_info.hash_key_size
+                                           : RSS_KEY_DEFAULT_LEN;
+  if (key_len <= RSS_KEY_MAX) {
+    rss_key_init(port, key_len);
+    port_conf.rx_adv_conf.rss_conf.rss_key = rss_key[port];
+    port_conf.rx_adv_conf.rss_conf.rss_key_len = key_len;
+  } else {
+    printf("Port %u key size %u not supported, keeping the PMD key\n", port,
+           key_len);
+    rss_key_init(port, RSS_KEY_DEFAULT_LEN);
+  }
+
+  soft_rss[port] = rx_rings > 1 &&
+                   (port_conf.rx_adv_conf.rss_conf.rss_hf == 0 ||
+                    dev_info.max_rx_queues < rx_rings);
+  if (soft_rss[port]) {
+    // soft_rss_hash() stops at the outer headers
+    if (rss_hf & ETH_RSS_TUNNEL) {
+      printf("Port %u needs software RSS, which cannot hash tunnel fields\n",
+             port);
+      return -1;
+    }
+    printf("Port %u falls back to software RSS over %u queues\n", port,
+           rx_rings);
+    rx_rings = 1;
+    port_conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+    port_conf.rx_adv_conf.rss_conf.rss_hf = 0;
+  }
+
+  // Rx interrupts let idle queue lcores sleep in epoll, ports without them
+  // get timed sleeps
+  port_conf.intr_conf.rxq = idle_sleep_us > 0;
   ret = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
+  if (ret != 0 && port_conf.intr_conf.rxq) {
+    printf("Port %u has no rx interrupts\n", port);
+    port_conf.intr_conf.rxq = 0;
+    ret = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
+  }
   if (ret != 0) return ret;
 //   printf("rte_eth_dev_configure success [%u]\n", port);
 
+  // Per-queue counters in rte_eth_stats, PMDs without the mapping ignore it
+  for (uint16_t q = 0; q < RTE_MIN(rx_rings, RTE_ETHDEV_QUEUE_STAT_CNTRS); q++)
+    rte_eth_dev_set_rx_queue_stats_mapping(port, q, q);
+
   uint16_t q;
   for (q = 0; q < rx_rings; q++) {
 //   printf("Going to initialize queue %u of port %u\n", port, port);
@@ -126,6 +433,19 @@ int port_init(uint16_t port, struct rte_mempool *membuf_pool) {
 
   printf("Port Configured and started [%u]\n", port);
 
+  port_ptype[port] = pkt_parse_port_ptypes(port);
+  printf("Port %u packet types from %s\n", port,
+         port_ptype[port] ? "the PMD" : "software parsing");
+
+  xstats_select(port);
+
+  if (!soft_rss[port] && rx_rings > 1) {
+    ret = reta_program(port, dev_info.reta_size);
+    if (ret != 0)
+      printf("Port %u RETA update failed (%s), keeping the default table\n",
+             port, strerror(-ret));
+  }
+
   struct rte_ether_addr addr;
   ret = rte_eth_macaddr_get(port, &addr);
   if (ret != 0) {
@@ -142,94 +462,199 @@ int port_init(uint16_t port, struct rte_mempool *membuf_pool) {
 }
 
 void print_stats(void) {
-  struct rte_eth_stats st;
+  struct lcore_stats sum;
+  const double dt = stats_interval();
   printf("--------------------------------------------------------------\n");
 
-  for (int p = 0; p < nb_ports; ++p) {
-    rte_eth_stats_get(p, &st);
-    printf("Port #%u: %lu received / %lu errors / %lu missed\n", p, st.ipackets,
-           st.ierrors, st.imissed);
-  }
+  print_ports(nb_ports, dt);
 
-  printf(
-      "Rx packets: %lu \t Ring space: %u \t Packet ring: %u \t Packets "
-      "processed %lu\n",
-      packets_rx, free_space, free_space2, packets_processed);
+  stats_sum(&sum);
+  printf("Rx packets: %" PRIu64 " (%" PRIu64 " bytes) \t Packets processed %"
+         PRIu64 "\n",
+         sum.rx, sum.bytes, sum.processed);
+
+  if (dt > 0)
+    printf("Rates: rx %.3f Mpps \t enqueued %.3f Mpps \t processed %.3f Mpps"
+           " \t ring drops %.0f/s \t alloc fails %.0f/s\n",
+           (sum.rx - stats_last.rx) / dt / 1e6,
+           (sum.enqueued - stats_last.enqueued) / dt / 1e6,
+           (sum.processed - stats_last.processed) / dt / 1e6,
+           (sum.ring_drops - stats_last.ring_drops) / dt,
+           (sum.alloc_fails - stats_last.alloc_fails) / dt);
+  if (sum.enqueued > 0)
+    printf("Overload %s: tail drops %" PRIu64 " \t class drops %" PRIu64
+           " \t rx pauses %" PRIu64 " (%.1f ms)\n",
+           overload_names[overload.policy], sum.overload.tail_drops,
+           sum.overload.class_drops, sum.overload.pauses,
+           sum.overload.pause_cycles * 1e3 / rte_get_tsc_hz());
+  printf("Parsed: non-IP %" PRIu64 " \t malformed %" PRIu64 "\n",
+         sum.non_ip, sum.malformed);
+  printf("Flows: active %" PRIu64 " \t added %" PRIu64 " \t table full %"
+         PRIu64 "\n", sum.flows, sum.flow_adds, sum.flow_full);
+  printf("Flow aging: expired %" PRIu64 " \t exported %" PRIu64
+         " \t export drops %" PRIu64 " \t capped polls %" PRIu64
+         " \t max lag %" PRIu64 " ticks\n",
+         sum.flow_expired, __atomic_load_n(&flows_exported, __ATOMIC_RELAXED),
+         sum.export_drops, sum.expire_capped, sum.expire_lag);
+  if (dt > 0)
+    printf("Flow rates: new %.0f/s \t expired %.0f/s \t table full %.0f/s\n",
+           (sum.flow_adds - stats_last.flow_adds) / dt,
+           (sum.flow_expired - stats_last.flow_expired) / dt,
+           (sum.flow_full - stats_last.flow_full) / dt);
+  stats_last = sum;
+  idle_print(lcore_stats, sizeof(struct lcore_stats),
+             offsetof(struct lcore_stats, idle), &sum.idle);
+
+  // Per-queue share shows RSS skew
+  unsigned lcore;
+  RTE_LCORE_FOREACH_WORKER(lcore) {
+    const struct lcore_queue *conf = &lcore_queue_conf[lcore];
+    if (!conf->enabled) continue;
+    uint64_t processed =
+        __atomic_load_n(&lcore_stats[lcore].processed, __ATOMIC_RELAXED);
+    uint64_t drops =
+        __atomic_load_n(&lcore_stats[lcore].ring_drops, __ATOMIC_RELAXED);
+    printf("  Port %u queue %u%s: %" PRIu64 " (%.1f%%)", conf->port,
+           conf->queue, soft_rss[conf->port] ? " (soft)" : "", processed,
+           sum.processed ? 100.0 * processed / sum.processed : 0.0);
+    if (drops) printf(" \t soft ring drops %" PRIu64, drops);
+    printf("\n");
+  }
   printf("--------------------------------------------------------------\n\n");
 }
 
-static inline int is_valid_ipv4_pkt(struct rte_ipv4_hdr *pkt, uint32_t link_len)
-{
-    /* From http://www.rfc-editor.org/rfc/rfc1812.txt section 5.2.2 */
-    /*
-     *      * 1. The packet length reported by the Link Layer must be large
-     *           * enough to hold the minimum length legal IP datagram (20 bytes).
-     *                */
-    if (link_len < sizeof(struct rte_ipv4_hdr))
-        return -1;
-    /* 2. The IP checksum must be correct. */
-    /* this is checked in H/W */
-    /*
-     *      * 3. The IP version number must be 4. If the version number is not 4
-     *           * then the packet may be another version of IP, such as IPng or
-     *                * ST-II.
-     *                     */
-    if (((pkt->version_ihl) >> 4) != 4)
-        return -3;
-    /*
-     *      * 4. The IP header length field must be large enough to hold the
-     *           * minimum length legal IP datagram (20 bytes = 5 words).
-     *                */
-    if ((pkt->version_ihl & 0xf) < 5)
-        return -4;
-    /*
-     *      * 5. The IP total length field must be large enough to hold the IP
-     *           * datagram header, whose length is specified in the IP header length
-     *                * field.
-     *                     */
-    if (rte_cpu_to_be_16(pkt->total_length) < sizeof(struct rte_ipv4_hdr))
-        return -5;
-    return 0;
+/*
+ * Software RSS: hash the burst from the port's single hardware queue,
+ * keep this lcore's share and pass the rest to the other queue lcores.
+ */
+static uint16_t soft_rss_spread(const struct lcore_queue *conf,
+                                struct lcore_stats *stats,
+                                struct rte_mbuf **bufs, uint16_t nb_rx) {
+  struct rte_mbuf *rest[BURST_MAX], *out[BURST_MAX];
+  uint16_t qid[BURST_MAX];
+  uint8_t ctl[BURST_MAX], rest_ctl[BURST_MAX], out_ctl[BURST_MAX];
+  uint16_t nb_keep = 0, nb_rest = 0, nb_out, i;
+  unsigned nb_old;
+  // ctl is only filled in, and read, by -b class
+  const int use_ctl = overload.policy == OVERLOAD_CLASS;
+
+  if (use_ctl) {
+    struct parse_burst pb;
+    pkt_parse_mbufs(&pb, bufs, nb_rx, port_ptype[conf->port]);
+    overload_classify(&pb, ctl);
+  }
+  for (i = 0; i < nb_rx; i++) {
+    struct rte_mbuf *m = bufs[i];
+    m->hash.rss = soft_rss_hash(m, conf->port);
+    m->ol_flags |= PKT_RX_RSS_HASH;
+    uint16_t q = soft_reta[m->hash.rss & (SOFT_RETA_SIZE - 1)];
+    if (q == conf->queue) {
+      bufs[nb_keep++] = m;
+    } else {
+      qid[nb_rest] = q;
+      if (use_ctl) rest_ctl[nb_rest] = ctl[i];
+      rest[nb_rest++] = m;
+    }
+  }
+
+  // One enqueue per destination queue present in the burst
+  while (nb_rest > 0) {
+    uint16_t q = qid[0], nb_left = 0;
+    nb_out = 0;
+    for (i = 0; i < nb_rest; i++) {
+      if (qid[i] == q) {
+        if (use_ctl) out_ctl[nb_out] = rest_ctl[i];
+        out[nb_out++] = rest[i];
+      } else {
+        qid[nb_left] = qid[i];
+        if (use_ctl) rest_ctl[nb_left] = rest_ctl[i];
+        rest[nb_left++] = rest[i];
+      }
+    }
+    nb_rest = nb_left;
+
+    // Pausing here leaves the hardware queue unpolled, the NIC drops
+    unsigned nb_enq =
+        overload_enqueue(&overload, soft_rings[conf->port][q], (void **)out,
+                         use_ctl ? out_ctl : NULL, nb_out, NULL, &nb_old,
+                         &stats->overload);
+    stats_add(&stats->enqueued, nb_enq);
+    if (unlikely(nb_enq < nb_out)) {
+      stats_add(&stats->ring_drops, nb_out - nb_enq);
+      rte_pktmbuf_free_bulk(&out[nb_enq], nb_out - nb_enq);
+    }
+  }
+  return nb_keep;
 }
 
+/* Run to completion on the lcore's own (port, queue), no shared ring */
 static int rx_packets(void *args) {
-  uint16_t port = *(uint16_t *)args;
-  // unsigned lcoreid = *(unsigned *)args;
-  printf("Core %u processing rx packets on port %d \n", rte_lcore_id(), port);
+  const struct lcore_queue *conf = args;
+  struct lcore_stats *stats = &lcore_stats[rte_lcore_id()];
+  const uint16_t port = conf->port;
+  const uint16_t queue = conf->queue;
+  const int soft = soft_rss[port];
+  const int hw_ptype = port_ptype[port];
+  struct flow_table *ft = flow_tables[rte_lcore_id()];
+  struct parse_burst pb;
+  struct flow_update upd;
+  struct flow_expire ex;
+  struct idle idle;
+  printf("Core %u processing rx packets on port %u queue %u\n",
+         rte_lcore_id(), port, queue);
+
+  // Software RSS queues wait on their ring, the others on the rx interrupt
+  idle_init(&idle, &stats->idle, idle_sleep_us);
+  if (soft && queue > 0)
+    idle_monitor_ring(&idle, soft_rings[port][queue]);
+  else if (idle_sleep_us > 0 && idle_rx_intr(&idle, port, queue) != 0)
+    printf("Core %u sleeps on a timer when port %u is idle\n", rte_lcore_id(),
+           port);
 
   while (!is_stop) {
-    struct rte_mbuf *bufs[BURST_SIZE];
-    const uint16_t nb_rx = rte_eth_rx_burst(port, 0, bufs, BURST_SIZE);
-    if (unlikely(nb_rx == 0)) continue;
-    packets_rx += nb_rx;
-    for (int i = 0; i < nb_rx; i++) {
-      // Enqueue into rte_ring
-      // rte_ring_enqueue_bulk(queue, (void **)&bufs[i], 1, &free_space);
-     if(rte_pktmbuf_data_len(bufs[i]) > 0){
-         struct packet *p = NULL;
-         p = rte_malloc("packet_malloc", sizeof(struct packet), 0);
-         p->size = rte_pktmbuf_data_len(bufs[i]);
-         p->data = NULL;
-         p->data = rte_malloc("packet_data", p->size, 0);
-         rte_memcpy(p->data, rte_pktmbuf_mtod(bufs[i], unsigned char *), p->size);
-         rte_ring_mp_enqueue_bulk(packet_ring, (void **)&p, 1, &free_space2);
-
-         // printf("Packet of original: %d  copied with length %d\n",
-         //      rte_pktmbuf_data_len(bufs[i]), p->size);
-
-
-     }
-     else{
-     //printf("Error packet \n");
-     }
-
-     rte_pktmbuf_free(bufs[i]);
-
-     // printf("Packet freed\n");
-      // rte_free(p->data);
-      // rte_free(p);a
+    struct rte_mbuf *bufs[BURST_MAX];
+    uint16_t nb_rx;
+    const uint64_t now = rte_rdtsc();
 
+    // Bounded aging work every poll, idle or not
+    flow_table_expire(ft, now, FLOW_EXPIRE_BUDGET, &ex);
+    if (unlikely(ex.work)) {
+      if (ex.expired) {
+        stats_add(&stats->flow_expired, ex.expired);
+        __atomic_store_n(&stats->flows, ft->nb_flows, __ATOMIC_RELAXED);
+      }
+      if (ex.export_drops) stats_add(&stats->export_drops, ex.export_drops);
+      if (ex.capped) stats_add(&stats->expire_capped, 1);
+      __atomic_store_n(&stats->expire_lag, ex.lag, __ATOMIC_RELAXED);
     }
+
+    if (soft && queue > 0) {
+      nb_rx = rte_ring_sc_dequeue_burst(soft_rings[port][queue],
+                                        (void **)bufs, burst_size, NULL);
+      idle_poll(&idle, nb_rx);
+      if (unlikely(nb_rx == 0)) continue;
+    } else {
+      nb_rx = rte_eth_rx_burst(port, queue, bufs, burst_size);
+      idle_poll(&idle, nb_rx);
+      if (unlikely(nb_rx == 0)) continue;
+      stats_add(&stats->rx, nb_rx);
+      if (soft) nb_rx = soft_rss_spread(conf, stats, bufs, nb_rx);
+    }
+
+    // Process inline
+    pkt_parse_mbufs(&pb, bufs, nb_rx, hw_ptype);
+    stats_parsed(stats, &pb);
+    flow_table_update(ft, &pb, bufs, now, &upd);
+    if (upd.added) {
+      stats_add(&stats->flow_adds, upd.added);
+      __atomic_store_n(&stats->flows, ft->nb_flows, __ATOMIC_RELAXED);
+    }
+    if (unlikely(upd.full)) stats_add(&stats->flow_full, upd.full);
+    uint64_t bytes = 0;
+    for (int i = 0; i < nb_rx; i++) bytes += rte_pktmbuf_pkt_len(bufs[i]);
+    stats_add(&stats->processed, nb_rx);
+    stats_add(&stats->bytes, bytes);
+    rte_pktmbuf_free_bulk(bufs, nb_rx);
   }
 
   printf("Stopping rx Reader\n");
@@ -238,81 +663,295 @@ static int rx_packets(void *args) {
   return 0;
 }
 
-static int set_timer() {
-  uint64_t diff_tsc, cur_tsc, prev_tsc, timer_tsc;
+/*
+ * Control thread draining expired flow records, so the workers never wait on
+ * export. Records are written as CSV to the -e file. It returns once main()
+ * sets export_done after the workers stopped and the ring is empty.
+ */
+static void *flow_export_thread(void *arg) {
+  struct flow_record *recs[FLOW_EXPORT_BURST];
+  const double tsc_us = rte_get_tsc_hz() / 1e6;
+  RTE_SET_USED(arg);
 
-  prev_tsc = 0, timer_tsc = 0;
-  while (!is_stop) {
-    cur_tsc = rte_rdtsc();
-    diff_tsc = cur_tsc - prev_tsc;
-    if (timer_cycles > 0) { /* timer enabled */
-      timer_tsc += diff_tsc;
-      if (unlikely(timer_tsc >= timer_cycles)) { /* timeout */
-        print_stats();
-        timer_tsc = 0;
-      }
+  for (;;) {
+    unsigned n = rte_ring_sc_dequeue_burst(flow_export_ring, (void **)recs,
+                                           FLOW_EXPORT_BURST, NULL);
+    if (n == 0) {
+      if (__atomic_load_n(&export_done, __ATOMIC_ACQUIRE)) break;
+      fflush(flow_export_file);
+      rte_delay_us_sleep(FLOW_EXPORT_SLEEP_US);
+      continue;
+    }
+    for (unsigned i = 0; i < n; i++) {
+      const struct flow_record *r = recs[i];
+      const int af = r->key.ip_version == 6 ? AF_INET6 : AF_INET;
+      char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+      inet_ntop(af, r->key.src_addr, src, sizeof(src));
+      inet_ntop(af, r->key.dst_addr, dst, sizeof(dst));
+      fprintf(flow_export_file,
+              "%s,%s,%u,%u,%u,%" PRIu64 ",%" PRIu64 ",%.0f,0x%02x,%s\n", src,
+              dst, rte_be_to_cpu_16(r->key.src_port),
+              rte_be_to_cpu_16(r->key.dst_port), r->key.proto, r->packets,
+              r->bytes, (r->last_tsc - r->first_tsc) / tsc_us, r->tcp_flags,
+              r->reason == FLOW_EXPIRE_FIN ? "fin" : "idle");
     }
-    prev_tsc = cur_tsc;
+    rte_mempool_put_bulk(flow_record_pool, (void **)recs, n);
+    __atomic_store_n(&flows_exported, flows_exported + n, __ATOMIC_RELAXED);
   }
+  return NULL;
 }
 
-//
-//static int process_packets(void *args) {
-//  unsigned lcoreid = *(unsigned *)args;
-//  printf("Starting process on lcore %u\n", lcoreid);
-//  struct rte_mbuf *mbuf[BURST_SIZE];
-//  int nb, q;
-//  packets_processed = 0;
-//  // process packets
-//  while (!is_stop) {
-//    // Dequeue from rte_ring
-//    nb = rte_ring_mc_dequeue_burst(queue, (void **)&mbuf, BURST_SIZE, NULL);
-//    if (unlikely(nb == 0)) continue;
-//
-//    packets_processed += nb;
-//    // Read packets from mbuf
-//    for (q = 0; q < nb; q++) {
-//      rte_pktmbuf_free(mbuf[q]);
-//    }
-//  }
-//}
-
-static int open_packets(void *args) {
-  unsigned lcoreid = *(unsigned *)args;
-  printf("Starting process on lcore %u\n", lcoreid);
-  struct rte_mbuf *mbuf[BURST_SIZE];
-  struct packet *arr_packets[BURST_SIZE];
-  int nb, q;
-  packets_processed = 0;
-  // process packets
-  while (!is_stop) {
-     // printf("Checking burst\n");
-    // Dequeue from rte_ring
-    nb = rte_ring_mc_dequeue_burst(packet_ring, (void **)&arr_packets,
-                                   BURST_SIZE, NULL);
-    if (unlikely(nb == 0)) continue;
-   // printf("packets dequeued\n");
-    packets_processed += nb;
-    // Read packets from mbuf
-    for (q = 0; q < nb; q++) {
-        // printf("packe dequeue size: %d with data: %.*s\n",
-        // arr_packets[q]->size,
-        //     10, arr_packets[q]->data);
-
-        if(arr_packets[q]->data)
-            rte_free(arr_packets[q]->data);
-        if(arr_packets[q])
-            rte_free(arr_packets[q]);
+/* /rss_scaling/stats: the summed lcore counters as JSON, e.g. via dpdk-telemetry.py */
+static int telemetry_stats(const char *cmd __rte_unused,
+                           const char *params __rte_unused,
+                           struct rte_tel_data *d) {
+  struct lcore_stats sum;
+  stats_sum(&sum);
+  stats_telemetry(d, &sum, stats_fields, RTE_DIM(stats_fields));
+  rte_tel_data_add_dict_u64(d, "flows_exported",
+                            __atomic_load_n(&flows_exported, __ATOMIC_RELAXED));
+  return 0;
+}
+
+static void usage(const char *prgname) {
+  printf(
+      "%s [EAL options] -- [-H FIELDS] [-s] [-w W0,W1,...] [-e FILE]\n"
+      "    [-I US] [-M MB] [-P PPS] [-W US] [-b tail|pause|class] [--burst N]\n"
+      "    [--rx-desc N] [--ring-size N] [--mbuf-cache N] [--rx-queues N]\n"
+      "    [--flows N] [--stats S]\n"
+      "  -H FIELDS: comma separated RSS hash fields out of "
+      "ip,udp,tcp,sctp,tunnel (default ip,udp,tcp)\n"
+      "  -s: symmetric Toeplitz key, both directions of a flow share a "
+      "queue\n"
+      "  -w WEIGHTS: relative share of the redirection table per queue, 0 to\n"
+      "              %u, queues without one weigh 1\n"
+      "  -e FILE: append expired flows to FILE as CSV\n"
+      "  -I US: idle lcores back off to pause and monitor, and sleep after US\n"
+      "         (default %u, 0 keeps polling)\n"
+      "  -M MB: hugepage memory pools and rings may take per NUMA node\n"
+      "         (default what the node has free)\n"
+      "  -P PPS: packets per second a port is expected to take (default %u)\n"
+      "  -W US: queue lcore stall a software RSS ring absorbs at that rate\n"
+      "         (default %u)\n"
+      "  -b POLICY: full software RSS rings drop what does not fit (tail,\n"
+      "             default), stop rx until there is room (pause), or keep\n"
+      "             their last free slots for control packets (class)\n"
+      "  --burst N: packets per rx burst, 1 to %u (default %u)\n"
+      "  --rx-desc N: rx descriptors per queue (default %u)\n"
+      "  --ring-size N: software RSS ring slots, 0 sizes them from -P and -W\n"
+      "               (default 0)\n"
+      "  --mbuf-cache N: per-lcore cache of the mbuf pool (default %u)\n"
+      "  --rx-queues N: rx queues per port at most, 0 one per worker lcore\n"
+      "               (default %u)\n"
+      "  --flows N: flow table entries per worker lcore, %u to %u\n"
+      "           (default %u)\n"
+      "  --stats S: seconds between stats, 0 prints none (default 3)\n",
+      prgname, RSS_WEIGHT_MAX, IDLE_SLEEP_US, RING_PPS, RING_LATENCY_US,
+      BURST_MAX, BURST_SIZE, RX_RING_SIZE, MBUF_CACHE, RX_QUEUES, FLOWS_MIN,
+      FLOWS_MAX, FLOW_TABLE_SIZE);
+}
+
+static int parse_rss_hf(char *arg) {
+  char *save = NULL, *tok;
+  rss_hf = 0;
+  for (tok = strtok_r(arg, ",", &save); tok != NULL;
+       tok = strtok_r(NULL, ",", &save)) {
+    unsigned i;
+    for (i = 0; i < RTE_DIM(rss_hf_names); i++)
+      if (strcmp(tok, rss_hf_names[i].name) == 0) break;
+    if (i == RTE_DIM(rss_hf_names)) {
+      printf("Unknown RSS hash field %s\n", tok);
+      return -1;
+    }
+    rss_hf |= rss_hf_names[i].rss_hf;
+  }
+  return rss_hf ? 0 : -1;
+}
+
+/* A whole decimal number in [min, max], -1 otherwise */
+static long parse_num(const char *arg, unsigned long min, unsigned long max) {
+  char *end;
+  errno = 0;
+  const unsigned long n = strtoul(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || n < min || n > max)
+    return -1;
+  return (long)n;
+}
+
+/* -w, checked against the queues by weights_check() once they are known */
+static int parse_weights(char *arg) {
+  char *save = NULL, *tok;
+  long w;
+  nb_rss_weights = 0;
+  for (tok = strtok_r(arg, ",", &save); tok != NULL;
+       tok = strtok_r(NULL, ",", &save)) {
+    if (nb_rss_weights == RTE_MAX_QUEUES_PER_PORT ||
+        (w = parse_num(tok, 0, RSS_WEIGHT_MAX)) < 0)
+      return -1;
+    rss_weights[nb_rss_weights++] = w;
+  }
+  return nb_rss_weights > 0 ? 0 : -1;
+}
+
+/* The -w weights of the queues that exist must not all be 0 */
+static int weights_check(void) {
+  unsigned total = 0;
+  if (nb_rss_weights > nb_rx_queues)
+    printf("WARNING: %u queue weights given, ignoring the %u past the %u rx "
+           "queues\n",
+           nb_rss_weights, nb_rss_weights - nb_rx_queues, nb_rx_queues);
+  for (unsigned q = 0; q < nb_rx_queues; q++)
+    total += q < nb_rss_weights ? rss_weights[q] : 1;
+  return total > 0 ? 0 : -1;
+}
+
+/* Long options for the sizes bench.sh sweeps, values past the short ones */
+enum {
+  OPT_BURST = 256,
+  OPT_RX_DESC,
+  OPT_RING_SIZE,
+  OPT_MBUF_CACHE,
+  OPT_RX_QUEUES,
+  OPT_FLOWS,
+  OPT_STATS,
+};
+
+static const struct option long_options[] = {
+    {"burst", required_argument, NULL, OPT_BURST},
+    {"rx-desc", required_argument, NULL, OPT_RX_DESC},
+    {"ring-size", required_argument, NULL, OPT_RING_SIZE},
+    {"mbuf-cache", required_argument, NULL, OPT_MBUF_CACHE},
+    {"rx-queues", required_argument, NULL, OPT_RX_QUEUES},
+    {"flows", required_argument, NULL, OPT_FLOWS},
+    {"stats", required_argument, NULL, OPT_STATS},
+    {NULL, 0, NULL, 0},
+};
+
+/* The values every run time size was given, to rerun a configuration */
+static void print_config(void) {
+  printf("Config: --burst %u --rx-desc %u --ring-size %u --mbuf-cache %u"
+         " --rx-queues %u --flows %u --stats %" PRIu64 "\n",
+         burst_size, rx_ring_size, soft_ring_fixed, mbuf_cache, rx_queues,
+         flow_table_size, timer_period);
+}
+
+static int parse_args(int argc, char **argv) {
+  const char *prgname = argv[0];
+  int opt;
+  long n;
+
+  while ((opt = getopt_long(argc, argv, "H:sw:e:I:M:P:W:b:", long_options,
+                            NULL)) != EOF) {
+    switch (opt) {
+      case OPT_BURST:
+      case OPT_RX_DESC:
+      case OPT_RING_SIZE:
+      case OPT_MBUF_CACHE:
+      case OPT_RX_QUEUES:
+      case OPT_FLOWS:
+      case OPT_STATS: {
+        // Ranges in the order of long_options
+        static const unsigned long max[] = {
+            BURST_MAX, UINT16_MAX, MEM_RING_MAX, RTE_MEMPOOL_CACHE_MAX_SIZE,
+            RTE_MAX_QUEUES_PER_PORT, FLOWS_MAX, 3600};
+        static const unsigned long min[] = {1, 1, 0, 0, 0, FLOWS_MIN, 0};
+        if ((n = parse_num(optarg, min[opt - OPT_BURST],
+                           max[opt - OPT_BURST])) < 0) {
+          printf("Invalid --%s %s, %lu to %lu\n",
+                 long_options[opt - OPT_BURST].name, optarg,
+                 min[opt - OPT_BURST], max[opt - OPT_BURST]);
+          usage(prgname);
+          return -1;
+        }
+        switch (opt) {
+          case OPT_BURST: burst_size = n; break;
+          case OPT_RX_DESC: rx_ring_size = n; break;
+          case OPT_RING_SIZE: soft_ring_fixed = n; break;
+          case OPT_MBUF_CACHE: mbuf_cache = n; break;
+          case OPT_RX_QUEUES: rx_queues = n; break;
+          case OPT_FLOWS: flow_table_size = n; break;
+          default: timer_period = n;
+        }
+        break;
+      }
+      case 'H':
+        if (parse_rss_hf(optarg) < 0) {
+          usage(prgname);
+          return -1;
+        }
+        break;
+      case 's':
+        rss_symmetric = 1;
+        break;
+      case 'w':
+        if (parse_weights(optarg) < 0) {
+          printf("Invalid queue weights\n");
+          usage(prgname);
+          return -1;
+        }
+        break;
+      case 'e':
+        flow_export_file = fopen(optarg, "a");
+        if (flow_export_file == NULL) {
+          printf("Cannot open %s: %s\n", optarg, strerror(errno));
+          return -1;
+        }
+        fprintf(flow_export_file,
+                "src,dst,src_port,dst_port,proto,packets,bytes,duration_us,"
+                "tcp_flags,reason\n");
+        break;
+      case 'I':
+      case 'M':
+      case 'P':
+      case 'W': {
+        const unsigned long max = opt == 'I'   ? IDLE_SLEEP_MAX_US
+                                  : opt == 'M' ? MEM_BUDGET_MAX_MB
+                                  : opt == 'P' ? MEM_PPS_MAX
+                                               : MEM_LATENCY_MAX_US;
+        if ((n = parse_num(optarg, 0, max)) < 0) {
+          printf("Invalid -%c %s, 0 to %lu\n", opt, optarg, max);
+          usage(prgname);
+          return -1;
+        }
+        if (opt == 'I')
+          idle_sleep_us = n;
+        else if (opt == 'M')
+          mem_budget_mb = n;
+        else if (opt == 'P')
+          ring_pps = n;
+        else
+          ring_latency_us = n;
+        break;
+      }
+      case 'b': {
+        // Head drop would dequeue from a single consumer ring
+        const int policy = overload_parse(optarg);
+        if (policy < 0 || policy == OVERLOAD_HEAD) {
+          printf("Invalid overload policy %s\n", optarg);
+          usage(prgname);
+          return -1;
+        }
+        overload.policy = policy;
+        break;
+      }
+      default:
+        usage(prgname);
+        return -1;
     }
-    //rte_free(arr_packets);
   }
+
+  optind = 1; /* reset getopt lib */
+  return 0;
 }
 
+/*
+ * The lcores leave their loops and main() prints the totals once the flow
+ * export has drained. A second signal exits without waiting.
+ */
 void exit_stats(int sig) {
+  if (is_stop) exit(0);
   is_stop = 1;
   printf("Caught signal %d\n", sig);
-  printf("Total received packets: %lu\n", packets_processed);
-  exit(0);
 }
 
 int main(int argc, char *argv[]) {
@@ -326,44 +965,107 @@ int main(int argc, char *argv[]) {
   argv += ret;
   printf("EAL configs set \n");
 
-  timer_cycles = timer_period * rte_get_timer_hz();
+  if (parse_args(argc, argv) < 0)
+    rte_exit(EXIT_FAILURE, "Invalid application arguments\n");
+  print_config();
+
   uint32_t nb_lcores = rte_lcore_count();
   nb_ports = rte_eth_dev_count_avail();
-  uint16_t n_tx_queue = 0;
-  uint16_t nb_rx_queue = 1;
-
-  static uint16_t nb_rxd = RTE_TEST_RX_DESC_DEFAULT;
-  static uint16_t nb_txd = RTE_TEST_TX_DESC_DEFAULT;
 
-  printf("Number of ports available %d\n", nb_ports);
-
-  unsigned nb_mbuf = NB_MBUF;
-  // pktmbuf_pool_create
-  membuf_pool =
-      rte_pktmbuf_pool_create("MBUF_POOL", nb_mbuf, MBUF_CACHE, 0,
-                              RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-    printf("pktmbuf pool done!\n");
+  // One worker lcore per (port, queue), stats run on a control thread
+  unsigned nb_workers = rte_lcore_count() - 1;
+  if (nb_ports == 0 || nb_workers < nb_ports)
+    rte_exit(EXIT_FAILURE, "Need at least one worker lcore per port\n");
+  nb_rx_queues = nb_workers / nb_ports;
+  if (rx_queues > 0) nb_rx_queues = RTE_MIN(nb_rx_queues, rx_queues);
+  unsigned nb_soft_ports = 0;
+  RTE_ETH_FOREACH_DEV(portid) {
+    struct rte_eth_dev_info dev_info;
+    if (rte_eth_dev_info_get(portid, &dev_info) != 0)
+      rte_exit(EXIT_FAILURE, "Cannot get info of port %u\n", portid);
+    // Ports without RSS for these fields are spread in software instead
+    if (rss_hf & dev_info.flow_type_rss_offloads)
+      nb_rx_queues = RTE_MIN(nb_rx_queues, dev_info.max_rx_queues);
+    else
+      nb_soft_ports++;
+  }
 
-  // mempool_create same as probe
- // unsigned hwsize = MBUFS * nb_ports;
- // unsigned swsize = LCORE_QUEUESZ;
+  printf("Number of ports available %d, rx queues per port %u\n", nb_ports,
+         nb_rx_queues);
+  if (weights_check() != 0)
+    rte_exit(EXIT_FAILURE, "The -w weights of the %u rx queues are all 0\n",
+             nb_rx_queues);
 
- // struct rte_mempool *mempool2;
- // mempool2 = rte_mempool_create("mbuf_pool", hwsize + swsize, MBUFSZ, 32,
- //                               sizeof(struct rte_pktmbuf_pool_private),
- //                               rte_pktmbuf_pool_init, NULL, rte_pktmbuf_init,
- //                               NULL, rte_socket_id(), 0);
+  // Queue lcores by topology: port's node, no two on one physical core
+  uint16_t plan_ports[RTE_MAX_ETHPORTS], plan_rx[RTE_MAX_ETHPORTS];
+  unsigned plan_sockets[RTE_MAX_ETHPORTS], nb_plan = 0;
+  RTE_ETH_FOREACH_DEV(portid) {
+    plan_ports[nb_plan] = portid;
+    plan_rx[nb_plan] = nb_rx_queues;
+    plan_sockets[nb_plan++] = plan_port_socket(portid);
+  }
+  if (lcore_plan_build(&plan, plan_ports, plan_sockets, plan_rx, nb_plan, 0) !=
+      0)
+    rte_exit(EXIT_FAILURE, "Cannot place %u rx lcores\n",
+             nb_plan * nb_rx_queues);
+  lcore_plan_print(&plan);
+  if (plan.nb_remote > 0 || plan.nb_shared > 0)
+    printf("WARNING: %u rx lcores remote to their port, %u share a core\n",
+           plan.nb_remote, plan.nb_shared);
 
-  // mempool2 = rte_mempool_create("MBUF_POOL2",
-  //                               swsize, sizeof(struct
-  //                               rte_pktmbuf_pool_private), MBUF_CACHE,
-  //                               RTE_MBUF_DEFAULT_BUF_SIZE,
-  //                               NULL, NULL, NULL, NULL,
-  //                               rte_socket_id(), 0);
+  // Every queue lcore's flow table on its node comes first, its size is
+  // fixed by --flows
+  mem_budget_init(&mem, mem_budget_mb);
+  unsigned lcoreid;
+  RTE_LCORE_FOREACH_WORKER(lcoreid) {
+    if (plan.lcore[lcoreid].role != ROLE_RX) continue;
+    const int socket = rte_lcore_to_socket_id(lcoreid);
+    if (mem_reserve(&mem, socket, flow_table_bytes(flow_table_size)) != 0)
+      rte_exit(EXIT_FAILURE,
+               "Flow tables of %u flows (%.1f MB each) do not fit the budget "
+               "of socket %d, lower --flows\n",
+               flow_table_size, flow_table_bytes(flow_table_size) / 1048576.0,
+               socket);
+  }
 
-  //if (mempool2 == NULL) rte_exit(EXIT_FAILURE, "Error in creating membuf pool");
+  // Mbufs out at once: every rx descriptor, an lcore cache and burst per
+  // lcore, and full soft_rings on ports spread in software. The soft_rings
+  // hold a queue's share of -P for -W, halved until the pool fits -M.
+  const int pool_socket = rte_socket_id();
+  const size_t mbuf_elt = mem_pktmbuf_elt(RTE_MBUF_DEFAULT_BUF_SIZE);
+  soft_ring_size =
+      soft_ring_fixed > 0
+          ? rte_align32pow2(soft_ring_fixed)
+          : mem_ring_entries(ring_pps / nb_rx_queues, ring_latency_us,
+                             MEM_RING_MIN, MEM_RING_MAX);
+  unsigned nb_mbuf;
+  for (;;) {
+    const unsigned nb_soft_rings = nb_soft_ports * (nb_rx_queues - 1);
+    nb_mbuf = RTE_MAX(nb_ports * nb_rx_queues * rx_ring_size +
+                          nb_lcores * (mbuf_cache + burst_size) +
+                          nb_soft_rings * soft_ring_size,
+                      (unsigned)NB_MBUF_MIN);
+    mem_unplan(&mem, pool_socket);
+    if (mem_plan(&mem, pool_socket,
+                 mem_pool_bytes(nb_mbuf, mbuf_elt) +
+                     nb_soft_rings * mem_ring_bytes(soft_ring_size)) == 0)
+      break;
+    if (nb_soft_rings == 0 || soft_ring_fixed > 0 ||
+        soft_ring_size <= MEM_RING_MIN)
+      rte_exit(EXIT_FAILURE, "%u mbufs (%.1f MB) do not fit the budget\n",
+               nb_mbuf, mem_pool_bytes(nb_mbuf, mbuf_elt) / 1048576.0);
+    soft_ring_size /= 2;
+  }
+  overload_init(&overload, overload.policy, soft_ring_size - 1, &is_stop);
 
-  //printf("Mempool created successfully\n");
+  membuf_pool =
+      rte_pktmbuf_pool_create("MBUF_POOL", nb_mbuf, mbuf_cache, 0,
+                              RTE_MBUF_DEFAULT_BUF_SIZE, pool_socket);
+  if (membuf_pool == NULL)
+    rte_exit(EXIT_FAILURE, "Cannot create mbuf pool: %s\n",
+             rte_strerror(rte_errno));
+  mem_add_pool(&mem, membuf_pool);
+  printf("pktmbuf pool done!\n");
 
   RTE_ETH_FOREACH_DEV(portid) {
     if (port_init(portid, membuf_pool) != 0)
@@ -372,34 +1074,82 @@ int main(int argc, char *argv[]) {
 
   signal(SIGINT, exit_stats);
 
-  //queue = rte_ring_create("RING 1", swsize, SOCKET_ID_ANY,
-  //                       RING_F_SP_ENQ | RING_F_MC_RTS_DEQ);
+  for (unsigned i = 0; i < SOFT_RETA_SIZE; i++) soft_reta[i] = reta_queue(i);
+  RTE_ETH_FOREACH_DEV(portid) {
+    if (!soft_rss[portid]) continue;
+    for (uint16_t q = 1; q < nb_rx_queues; q++) {
+      char name[RTE_RING_NAMESIZE];
+      snprintf(name, sizeof(name), "SOFT_RSS_%u_%u", portid, q);
+      soft_rings[portid][q] =
+          rte_ring_create(name, soft_ring_size, rte_eth_dev_socket_id(portid),
+                          RING_F_SP_ENQ | RING_F_SC_DEQ);
+      if (soft_rings[portid][q] == NULL)
+        rte_exit(EXIT_FAILURE, "Error in creating ring %s\n", name);
+      mem_add_ring(&mem, soft_rings[portid][q]);
+    }
+  }
 
-  packet_ring = rte_ring_create("RING_PACKETS", RING_SIZE, SOCKET_ID_ANY,
-                                RING_F_MP_RTS_ENQ | RING_F_MC_RTS_DEQ);
+  if (flow_export_file != NULL) {
+    flow_export_ring = rte_ring_create("FLOW_EXPORT", FLOW_EXPORT_RING_SIZE,
+                                       SOCKET_ID_ANY, RING_F_SC_DEQ);
+    flow_record_pool = rte_mempool_create(
+        "FLOW_RECORDS", FLOW_RECORDS, sizeof(struct flow_record),
+        MEMPOOL_CACHE_SIZE, 0, NULL, NULL, NULL, NULL, SOCKET_ID_ANY, 0);
+    if (flow_export_ring == NULL || flow_record_pool == NULL)
+      rte_exit(EXIT_FAILURE, "Cannot create flow export ring: %s\n",
+               rte_strerror(rte_errno));
+    mem_add_ring(&mem, flow_export_ring);
+    mem_add_pool(&mem, flow_record_pool);
+  }
+  RTE_LCORE_FOREACH_WORKER(lcoreid) {
+    if (plan.lcore[lcoreid].role != ROLE_RX) continue;
+    const int socket = rte_lcore_to_socket_id(lcoreid);
+    char name[RTE_HASH_NAMESIZE];
+    snprintf(name, sizeof(name), "flows_%u", lcoreid);
+    flow_tables[lcoreid] =
+        flow_table_create(name, flow_table_size, socket, flow_export_ring,
+                          flow_record_pool);
+    if (flow_tables[lcoreid] == NULL)
+      rte_exit(EXIT_FAILURE, "Cannot create flow table %s\n", name);
+    mem_add_bytes(&mem, name, socket, flow_table_size,
+                  sizeof(struct flow_entry), flow_table_bytes(flow_table_size));
+  }
+  mem_report(&mem);
 
-  unsigned lcoreid = 3;
-  // RTE_LCORE_FOREACH_WORKER(lcoreid)
-  for(int i=0;i<10 ;i++)
-  {
-    printf("Lcore starting remote process function\n");
-    // rte_eal_remote_launch(process_packets, (void *)&lcoreid, lcoreid);
-    lcoreid++;
-    rte_eal_remote_launch(open_packets, (void *)&lcoreid,lcoreid);
-  }
-  // set_timer();
-  portid = 0;
-  uint32_t rxQueues = RX_QUEUES;
-  RTE_ETH_FOREACH_DEV(portid) {
-    printf("Starting rx on port %d\n", portid);
-    for(int i=0;i< rxQueues;i++)
-        rte_eal_remote_launch(rx_packets, (void *)&portid, ++lcoreid);
-    // rte_eal_remote_launch(rx_packets, (void *)&portid, ++lcoreid);
+  start_tsc = rte_rdtsc();
+  RTE_LCORE_FOREACH_WORKER(lcoreid) {
+    const struct lcore_assign *a = &plan.lcore[lcoreid];
+    if (a->role != ROLE_RX) continue;
+    lcore_queue_conf[lcoreid].port = a->port;
+    lcore_queue_conf[lcoreid].queue = a->queue;
+    lcore_queue_conf[lcoreid].enabled = 1;
+    printf("Lcore %u -> port %u queue %u\n", lcoreid, a->port, a->queue);
+    rte_eal_remote_launch(rx_packets, &lcore_queue_conf[lcoreid], lcoreid);
   }
 
-  rte_eal_remote_launch(set_timer, NULL, ++lcoreid);
+  rte_telemetry_register_cmd("/rss_scaling/stats", telemetry_stats,
+                             "Returns packet counters summed over lcores");
+  if (stats_thread_start(timer_period, print_stats, &is_stop) != 0)
+    rte_exit(EXIT_FAILURE, "Cannot start stats thread\n");
+  pthread_t export_tid;
+  if (flow_export_ring != NULL &&
+      rte_ctrl_thread_create(&export_tid, "flow_export", NULL,
+                             flow_export_thread, NULL) != 0)
+    rte_exit(EXIT_FAILURE, "Cannot start flow export thread\n");
   rte_eal_mp_wait_lcore();
 
+  // The workers are done, what is on the export ring is all there is
+  if (flow_export_ring != NULL) {
+    __atomic_store_n(&export_done, 1, __ATOMIC_RELEASE);
+    pthread_join(export_tid, NULL);
+    fclose(flow_export_file);
+  }
+  struct lcore_stats sum;
+  stats_sum(&sum);
+  printf("Total received packets: %" PRIu64 "\n", sum.processed);
+  print_summary(start_tsc, sum.rx, sum.processed, sum.ring_drops,
+                sum.alloc_fails);
+
   return 0;
 }
 
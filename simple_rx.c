@@ -1,31 +1,122 @@
+#include <errno.h>
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
+#include <string.h>
 
 #include <rte_eal.h>
 #include <rte_ethdev.h>
 #include <rte_cycles.h>
 #include <rte_lcore.h>
 #include <rte_mbuf.h>
+#include <rte_mbuf_dyn.h>
 #include <rte_ring.h>
+#include <rte_telemetry.h>
 
+#include "idle.h"
+#include "mem_budget.h"
+#include "stats.h"
+
+/* Defaults of the run time options, see usage() */
 #define RX_RING_SIZE 1024
 #define TX_RING_SIZE 0
-#define MBUFS 8191
 #define MBUF_CACHE 250
 #define MBUFSZ (2048 + sizeof(struct rte_mbuf) + RTE_PKTMBUF_HEADROOM)
-#define LCORE_QUEUESZ 1024 * 32
+#ifndef LCORE_QUEUESZ
+#define LCORE_QUEUESZ 0 /**< Ring slots, 0 sizes it from the two below */
+#endif
+#ifndef RING_LATENCY_US
+#define RING_LATENCY_US 1000 /**< Worker stall the ring absorbs */
+#endif
+#ifndef RING_PPS
+#define RING_PPS 14880000 /**< Expected packets per second */
+#endif
+#ifndef MEM_BUDGET_MB
+#define MEM_BUDGET_MB 0 /**< Hugepage memory per node, 0 is what is free */
+#endif
+#ifndef BURST_SIZE
 #define BURST_SIZE 32
+#endif
+#define BURST_MAX 256 /**< Largest --burst, sizes the burst arrays */
+#ifndef IDLE_SLEEP_US
+#define IDLE_SLEEP_US 1000 /**< Idle period before lcores sleep, 0 polls */
+#endif
 
 static uint8_t nb_ports;
-static unsigned long packets_rx;
-static unsigned long packets_processed;
-static uint64_t timer_period = 2;
-static uint64_t timer_cycles;
+static uint64_t timer_period = 2; /* --stats, seconds, 0 prints none */
+static uint16_t burst_size = BURST_SIZE;
+static uint16_t rx_ring_size = RX_RING_SIZE; /* rx descriptors per queue */
+static unsigned ring_size_fixed = LCORE_QUEUESZ;
+static unsigned mbuf_cache = MBUF_CACHE;
 static volatile char is_stop = 0;
-unsigned int free_space = LCORE_QUEUESZ;
+static uint64_t start_tsc; /* set when the lcores are launched */
+unsigned int free_space;
 struct rte_ring *queue;
+static struct rte_mempool *rx_pools[RTE_MAX_NUMA_NODES]; /* per port node */
+static int port_remote[RTE_MAX_ETHPORTS]; /* port on another node than rx */
+static int worker_remote;
+
+/* TSC of the rte_eth_rx_burst() that returned the mbuf */
+static int rx_tsc_dynfield = -1;
+static const struct rte_mbuf_dynfield rx_tsc_dynfield_desc = {
+    .name = "simple_rx_dynfield_rx_tsc",
+    .size = sizeof(uint64_t),
+    .align = __alignof__(uint64_t),
+};
+
+static inline uint64_t *rx_tsc(struct rte_mbuf *m)
+{
+  return RTE_MBUF_DYNFIELD(m, rx_tsc_dynfield, uint64_t *);
+}
+
+/* Counters written only by the owning lcore, summed by print_stats() */
+struct lcore_stats
+{
+  uint64_t rx;
+  uint64_t enqueued;
+  uint64_t ring_drops;
+  uint64_t processed;
+  uint64_t bytes;
+  uint64_t alloc_fails;
+  uint64_t numa_remote; /* handled across NUMA nodes */
+  struct idle_stats idle;
+} __rte_cache_aligned;
+static struct lcore_stats lcore_stats[RTE_MAX_LCORE];
+
+static struct lcore_stats stats_last; /* print_stats() rates are deltas */
+
+#define LCORE_STAT(member) STATS_FIELD(struct lcore_stats, member)
+#define LCORE_STAT_AS(name, member) \
+  STATS_FIELD_AS(name, struct lcore_stats, member)
+
+/* Summed by stats_sum(), also the keys of /simple_rx/stats */
+static const struct stats_field stats_fields[] = {
+    LCORE_STAT(rx),
+    LCORE_STAT(enqueued),
+    LCORE_STAT(ring_drops),
+    LCORE_STAT(processed),
+    LCORE_STAT(bytes),
+    LCORE_STAT(alloc_fails),
+    LCORE_STAT(numa_remote),
+    LCORE_STAT_AS("busy_cycles", idle.busy_cycles),
+    LCORE_STAT_AS("idle_cycles", idle.idle_cycles),
+    LCORE_STAT_AS("idle_pause_waits", idle.waits[IDLE_PAUSE]),
+    LCORE_STAT_AS("idle_monitor_waits", idle.waits[IDLE_MONITOR]),
+    LCORE_STAT_AS("idle_sleep_waits", idle.waits[IDLE_SLEEP]),
+    LCORE_STAT_AS("idle_wakes", idle.wakes),
+    LCORE_STAT_AS("idle_wake_cycles", idle.wake_cycles),
+    STATS_FIELD_MAX("idle_wake_max", struct lcore_stats, idle.wake_max),
+};
+
+static void stats_sum(struct lcore_stats *sum)
+{
+  stats_sum_lcores(sum, lcore_stats, sizeof(*sum), stats_fields,
+                   RTE_DIM(stats_fields));
+}
 
 static const struct rte_eth_conf port_conf_default = {
     .rxmode = {
@@ -33,12 +124,28 @@ static const struct rte_eth_conf port_conf_default = {
     },
 };
 
+struct lcore_latency
+{
+  struct latency_hist dwell; /* rx burst to ring dequeue */
+  struct latency_hist total; /* rx burst to processing done */
+} __rte_cache_aligned;
+static struct lcore_latency lcore_latency[RTE_MAX_LCORE];
+
+static void print_latency(void)
+{
+  const size_t size = sizeof(struct lcore_latency);
+  hist_print_lcores("Ring dwell", lcore_latency, size,
+                    offsetof(struct lcore_latency, dwell));
+  hist_print_lcores("Rx to done", lcore_latency, size,
+                    offsetof(struct lcore_latency, total));
+}
+
 int port_init(uint16_t port, struct rte_mempool *membuf_pool)
 {
   struct rte_eth_conf port_conf = port_conf_default;
   const uint16_t rx_rings = 1;
   const uint16_t tx_rings = 0;
-  uint16_t nb_rxd = RX_RING_SIZE;
+  uint16_t nb_rxd = rx_ring_size;
   uint16_t nb_txd = TX_RING_SIZE;
   int ret;
 
@@ -63,7 +170,16 @@ int port_init(uint16_t port, struct rte_mempool *membuf_pool)
 
   printf("Dev adjust rx-tx success [%u]\n", port);
 
+  // One rx interrupt can wake the rx lcore only when it polls one port,
+  // otherwise and without interrupts it sleeps on a timer
+  port_conf.intr_conf.rxq = IDLE_SLEEP_US > 0 && nb_ports == 1;
   ret = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
+  if (ret != 0 && port_conf.intr_conf.rxq)
+  {
+    printf("Port %u has no rx interrupts\n", port);
+    port_conf.intr_conf.rxq = 0;
+    ret = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
+  }
   if (ret != 0)
     return ret;
   printf("rte_eth_dev_configure success [%u]\n", port);
@@ -91,6 +207,8 @@ int port_init(uint16_t port, struct rte_mempool *membuf_pool)
 
   printf("Port started [%u]\n", port);
 
+  xstats_select(port);
+
   struct rte_ether_addr addr;
   ret = rte_eth_macaddr_get(port, &addr);
   if (ret != 0)
@@ -110,60 +228,93 @@ int port_init(uint16_t port, struct rte_mempool *membuf_pool)
 
 void print_stats(void)
 {
-  struct rte_eth_stats st;
+  struct lcore_stats sum;
+  const double dt = stats_interval();
   printf("--------------------------------------------------------------\n");
 
-  for (int p = 0; p < nb_ports; ++p)
-  {
-    rte_eth_stats_get(p, &st);
-    printf("Port #%u: %lu received / %lu errors / %lu missed\n", p, st.ipackets, st.ierrors, st.imissed);
-  }
-
-  printf("Rx packets: %lu \t Ring space: %u \t Packets processed %lu\n", packets_rx, free_space, packets_processed);
+  print_ports(nb_ports, dt);
+
+  stats_sum(&sum);
+  printf("Rx packets: %" PRIu64 " (%" PRIu64 " bytes) \t Enqueued %" PRIu64 " \t Ring space: %u \t Packets processed %" PRIu64 " \t Ring full drops %" PRIu64 "\n",
+         sum.rx, sum.bytes, sum.enqueued, free_space, sum.processed, sum.ring_drops);
+
+  if (dt > 0)
+    printf("Rates: rx %.3f Mpps \t enqueued %.3f Mpps \t processed %.3f Mpps"
+           " \t ring drops %.0f/s \t alloc fails %.0f/s\n",
+           (sum.rx - stats_last.rx) / dt / 1e6,
+           (sum.enqueued - stats_last.enqueued) / dt / 1e6,
+           (sum.processed - stats_last.processed) / dt / 1e6,
+           (sum.ring_drops - stats_last.ring_drops) / dt,
+           (sum.alloc_fails - stats_last.alloc_fails) / dt);
+  if (sum.numa_remote > 0)
+    printf("NUMA: %" PRIu64 " packets handled across nodes\n",
+           sum.numa_remote);
+  stats_last = sum;
+  idle_print(lcore_stats, sizeof(struct lcore_stats),
+             offsetof(struct lcore_stats, idle), &sum.idle);
+  print_latency();
   printf("--------------------------------------------------------------\n\n");
 }
 
+/* /simple_rx/stats: the summed lcore counters as JSON, e.g. via dpdk-telemetry.py */
+static int telemetry_stats(const char *cmd __rte_unused,
+                           const char *params __rte_unused,
+                           struct rte_tel_data *d)
+{
+  struct lcore_stats sum;
+  stats_sum(&sum);
+  stats_telemetry(d, &sum, stats_fields, RTE_DIM(stats_fields));
+  return 0;
+}
+
 static int rx_packets(void)
 {
+  struct lcore_stats *stats = &lcore_stats[rte_lcore_id()];
+  struct idle idle;
   uint16_t port;
-  uint64_t diff_tsc, cur_tsc, prev_tsc, timer_tsc;
 
-  prev_tsc = 0, timer_tsc = 0;
   printf("Core %u processing rx packets\n", rte_lcore_id());
+  idle_init(&idle, &stats->idle, IDLE_SLEEP_US);
+  if (IDLE_SLEEP_US > 0 && (nb_ports != 1 ||
+                            idle_rx_intr(&idle, rte_eth_find_next(0), 0) != 0))
+    printf("Core %u sleeps on a timer when the ports are idle\n",
+           rte_lcore_id());
 
   while (!is_stop)
   {
+    unsigned nb_round = 0;
     RTE_ETH_FOREACH_DEV(port)
     {
-      struct rte_mbuf *bufs[BURST_SIZE];
-      const uint16_t nb_rx = rte_eth_rx_burst(port, 0, bufs, BURST_SIZE);
-      cur_tsc = rte_rdtsc();
-      diff_tsc = cur_tsc - prev_tsc;
-
-      if (timer_cycles > 0)
-      { /* timer enabled */
-        timer_tsc += diff_tsc;
-        if (unlikely(timer_tsc >= timer_cycles))
-        { /* timeout */
-          print_stats();
-          timer_tsc = 0;
-        }
-      }
-      prev_tsc = cur_tsc;
+      struct rte_mbuf *bufs[BURST_MAX];
+      const uint16_t nb_rx = rte_eth_rx_burst(port, 0, bufs, burst_size);
 
       if (unlikely(nb_rx == 0))
         continue;
+      nb_round += nb_rx;
 
+      const uint64_t now = rte_rdtsc();
+      uint64_t bytes = 0;
       for (int i = 0; i < nb_rx; i++)
       {
-        packets_rx++;
-
-        // Enqueue into rte_ring
-        rte_ring_enqueue_bulk(queue, (void **)bufs, 1, &free_space);
-
-        rte_pktmbuf_free(bufs[i]);
+        bytes += rte_pktmbuf_pkt_len(bufs[i]);
+        *rx_tsc(bufs[i]) = now;
+      }
+      stats_add(&stats->rx, nb_rx);
+      stats_add(&stats->bytes, bytes);
+      if (port_remote[port])
+        stats_add(&stats->numa_remote, nb_rx);
+
+      // Enqueue the whole burst, process_packets() owns what makes it in
+      const unsigned nb_enq = rte_ring_sp_enqueue_burst(queue, (void **)bufs, nb_rx, &free_space);
+      stats_add(&stats->enqueued, nb_enq);
+      if (unlikely(nb_enq < nb_rx))
+      {
+        stats_add(&stats->ring_drops, nb_rx - nb_enq);
+        rte_pktmbuf_free_bulk(&bufs[nb_enq], nb_rx - nb_enq);
       }
     }
+    // A round over every port is one poll
+    idle_poll(&idle, nb_round);
   }
 
   printf("Stopping rx Reader\n");
@@ -176,36 +327,152 @@ static int process_packets(void *args)
 {
   unsigned lcoreid = *(unsigned *)args;
   printf("Starting process on lcore %u\n", lcoreid);
-  struct rte_mbuf *mbuf[BURST_SIZE];
+  struct lcore_stats *stats = &lcore_stats[rte_lcore_id()];
+  struct lcore_latency *lat = &lcore_latency[rte_lcore_id()];
+  struct rte_mbuf *mbuf[BURST_MAX];
+  uint64_t stamp[BURST_MAX];
+  struct idle idle;
   int nb, q;
+  idle_init(&idle, &stats->idle, IDLE_SLEEP_US);
+  idle_monitor_ring(&idle, queue);
   // process packets
   while (!is_stop)
   {
     // Dequeue from rte_ring
-    nb = rte_ring_dequeue_burst(queue, (void **)mbuf, BURST_SIZE, NULL);
+    nb = rte_ring_sc_dequeue_burst(queue, (void **)mbuf, burst_size, NULL);
+    const enum idle_level woke = idle_poll(&idle, nb);
     if (unlikely(nb == 0))
       continue;
 
+    const uint64_t deq_tsc = rte_rdtsc();
+    for (q = 0; q < nb; q++)
+    {
+      stamp[q] = *rx_tsc(mbuf[q]);
+      hist_add(&lat->dwell, deq_tsc - stamp[q]);
+    }
+    if (woke >= IDLE_MONITOR)
+      idle_woken(&idle, deq_tsc - stamp[0]);
+
     // Read packets from mbuf
+    stats_add(&stats->processed, nb);
+    if (worker_remote)
+      stats_add(&stats->numa_remote, nb);
+    rte_pktmbuf_free_bulk(mbuf, nb);
+
+    const uint64_t done_tsc = rte_rdtsc();
     for (q = 0; q < nb; q++)
+      hist_add(&lat->total, done_tsc - stamp[q]);
+  }
+
+  return 0;
+}
+
+static void usage(const char *prgname)
+{
+  printf("%s [EAL options] -- [--burst N] [--rx-desc N] [--ring-size N]\n"
+         "    [--mbuf-cache N] [--stats S]\n"
+         "  --burst N: packets per rx burst and ring dequeue, 1 to %u "
+         "(default %u)\n"
+         "  --rx-desc N: rx descriptors per port (default %u)\n"
+         "  --ring-size N: ring slots, 0 sizes it from RING_PPS and "
+         "RING_LATENCY_US (default %u)\n"
+         "  --mbuf-cache N: per-lcore cache of the mbuf pools (default %u)\n"
+         "  --stats S: seconds between stats, 0 prints none (default 2)\n",
+         prgname, BURST_MAX, BURST_SIZE, RX_RING_SIZE, LCORE_QUEUESZ,
+         MBUF_CACHE);
+}
+
+/* Long options for the sizes bench.sh sweeps */
+enum
+{
+  OPT_BURST = 256,
+  OPT_RX_DESC,
+  OPT_RING_SIZE,
+  OPT_MBUF_CACHE,
+  OPT_STATS,
+};
+
+static const struct option long_options[] = {
+    {"burst", required_argument, NULL, OPT_BURST},
+    {"rx-desc", required_argument, NULL, OPT_RX_DESC},
+    {"ring-size", required_argument, NULL, OPT_RING_SIZE},
+    {"mbuf-cache", required_argument, NULL, OPT_MBUF_CACHE},
+    {"stats", required_argument, NULL, OPT_STATS},
+    {NULL, 0, NULL, 0},
+};
+
+/* A whole decimal number in [min, max], -1 otherwise */
+static long parse_num(const char *arg, unsigned long min, unsigned long max)
+{
+  char *end;
+  errno = 0;
+  const unsigned long n = strtoul(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || n < min || n > max)
+    return -1;
+  return (long)n;
+}
+
+/* The values every run time size was given, to rerun a configuration */
+static void print_config(void)
+{
+  printf("Config: --burst %u --rx-desc %u --ring-size %u --mbuf-cache %u"
+         " --stats %" PRIu64 "\n",
+         burst_size, rx_ring_size, ring_size_fixed, mbuf_cache, timer_period);
+}
+
+static int parse_args(int argc, char **argv)
+{
+  // Ranges in the order of long_options
+  static const unsigned long max[] = {BURST_MAX, UINT16_MAX, MEM_RING_MAX,
+                                      RTE_MEMPOOL_CACHE_MAX_SIZE, 3600};
+  static const unsigned long min[] = {1, 1, 0, 0, 0};
+  const char *prgname = argv[0];
+  int opt;
+  long n;
+
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != EOF)
+  {
+    if (opt < OPT_BURST || opt > OPT_STATS)
+    {
+      usage(prgname);
+      return -1;
+    }
+    if ((n = parse_num(optarg, min[opt - OPT_BURST],
+                       max[opt - OPT_BURST])) < 0)
+    {
+      printf("Invalid --%s %s, %lu to %lu\n",
+             long_options[opt - OPT_BURST].name, optarg,
+             min[opt - OPT_BURST], max[opt - OPT_BURST]);
+      usage(prgname);
+      return -1;
+    }
+    switch (opt)
     {
-      packets_processed++;
-      rte_pktmbuf_free(mbuf[q]);
+    case OPT_BURST: burst_size = n; break;
+    case OPT_RX_DESC: rx_ring_size = n; break;
+    case OPT_RING_SIZE: ring_size_fixed = n; break;
+    case OPT_MBUF_CACHE: mbuf_cache = n; break;
+    default: timer_period = n;
     }
   }
+  optind = 1; /* reset getopt lib */
+  return 0;
 }
 
 void exit_stats(int sig)
 {
   is_stop = 1;
   printf("Caught signal %d\n", sig);
-  printf("Total received packets: %lu\n", packets_processed);
+  struct lcore_stats sum;
+  stats_sum(&sum);
+  printf("Total received packets: %" PRIu64 "\n", sum.processed);
+  print_summary(start_tsc, sum.rx, sum.processed, sum.ring_drops,
+                sum.alloc_fails);
   exit(0);
 }
 
 int main(int argc, char *argv[])
 {
-  struct rte_mempool *membuf_pool;
   uint16_t portid;
 
   int ret = rte_eal_init(argc, argv);
@@ -216,24 +483,64 @@ int main(int argc, char *argv[])
   argv += ret;
   printf("EAL configs set \n");
 
-  timer_cycles = timer_period * rte_get_timer_hz();
+  if (parse_args(argc, argv) < 0)
+    rte_exit(EXIT_FAILURE, "Invalid application arguments\n");
+  print_config();
+
+  rx_tsc_dynfield = rte_mbuf_dynfield_register(&rx_tsc_dynfield_desc);
+  if (rx_tsc_dynfield < 0)
+    rte_exit(EXIT_FAILURE, "Cannot register rx timestamp mbuf field\n");
 
   nb_ports = rte_eth_dev_count_avail();
   printf("Number of ports available %d\n", nb_ports);
 
-  // pktmbuf_pool_create
-  membuf_pool = rte_pktmbuf_pool_create("MBUF_POOL", MBUFS * nb_ports, MBUF_CACHE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+  // The ring holds RING_LATENCY_US of RING_PPS unless --ring-size gives
+  // its size, every mbuf in it can come
+  // from any pool. A pool also fills its ports' descriptors and the caches
+  // of the rx and worker lcores.
+  struct mem_budget mem;
+  mem_budget_init(&mem, MEM_BUDGET_MB);
+  const unsigned swsize = ring_size_fixed > 0
+                              ? rte_align32pow2(ring_size_fixed)
+                              : mem_ring_entries(RING_PPS, RING_LATENCY_US,
+                                                 MEM_RING_MIN, MEM_RING_MAX);
+  unsigned node_ports[RTE_MAX_NUMA_NODES] = {0};
+  RTE_ETH_FOREACH_DEV(portid)
+  {
+    const int socket = rte_eth_dev_socket_id(portid);
+    node_ports[socket < 0 ? (int)rte_socket_id() : socket]++;
+  }
 
-  // mempool_create same as probe
-  unsigned hwsize = MBUFS * nb_ports;
-  unsigned swsize = LCORE_QUEUESZ;
-  
-  struct rte_mempool *mempool2;
-  mempool2 = rte_mempool_create("mbuf_pool",
-                                    hwsize + swsize , MBUFSZ, 32,
-                                    sizeof(struct rte_pktmbuf_pool_private),
-                                    rte_pktmbuf_pool_init, NULL,
-                                    rte_pktmbuf_init, NULL, rte_socket_id(), 0);
+  // One pool per node with ports, next to the NIC that fills it. The main
+  // lcore does rx, so ports on other nodes are polled across the link.
+  const unsigned rx_socket = rte_socket_id();
+  RTE_ETH_FOREACH_DEV(portid)
+  {
+    int socket = rte_eth_dev_socket_id(portid);
+    if (socket < 0)
+      socket = rx_socket;
+    port_remote[portid] = (unsigned)socket != rx_socket;
+    if (port_remote[portid])
+      printf("WARNING: port %u is on socket %d, rx runs on socket %u\n",
+             portid, socket, rx_socket);
+    if (rx_pools[socket] != NULL)
+      continue;
+    const unsigned nb_mbuf = node_ports[socket] * rx_ring_size + swsize +
+                             2 * (mbuf_cache + burst_size);
+    if (mem_plan(&mem, socket, mem_pool_bytes(nb_mbuf, MBUFSZ)) != 0)
+      rte_exit(EXIT_FAILURE, "%u mbufs do not fit the budget of socket %d\n",
+               nb_mbuf, socket);
+    char name[RTE_MEMPOOL_NAMESIZE];
+    snprintf(name, sizeof(name), "mbuf_pool_%d", socket);
+    rx_pools[socket] = rte_mempool_create(name,
+                                          nb_mbuf, MBUFSZ, mbuf_cache,
+                                          sizeof(struct rte_pktmbuf_pool_private),
+                                          rte_pktmbuf_pool_init, NULL,
+                                          rte_pktmbuf_init, NULL, socket, 0);
+    if (rx_pools[socket] == NULL)
+      rte_exit(EXIT_FAILURE, "Error in creating membuf pool on socket %d", socket);
+    mem_add_pool(&mem, rx_pools[socket]);
+  }
 
   // mempool2 = rte_mempool_create("MBUF_POOL2",
   //                               swsize, sizeof(struct rte_pktmbuf_pool_private), MBUF_CACHE, 
@@ -241,27 +548,50 @@ int main(int argc, char *argv[])
   //                               NULL, NULL, NULL, NULL,
   //                               rte_socket_id(), 0);
 
-  if (mempool2 == NULL)
-    rte_exit(EXIT_FAILURE, "Error in creating membuf pool");
-
   printf("Mempool created successfully\n");
 
   RTE_ETH_FOREACH_DEV(portid)
   {
-    if (port_init(portid, mempool2) != 0)
+    const int socket = rte_eth_dev_socket_id(portid);
+    if (port_init(portid, rx_pools[socket < 0 ? (int)rx_socket : socket]) != 0)
       rte_exit(EXIT_FAILURE, "Cannot init port %" PRIu16 " \n", portid);
   }
 
   signal(SIGINT, exit_stats);
 
-  queue = rte_ring_create("RING 1", swsize, SOCKET_ID_ANY, RING_F_SP_ENQ | RING_F_SC_DEQ);
-
-  unsigned lcoreid = 0;
-  RTE_LCORE_FOREACH_WORKER(lcoreid)
+  queue = rte_ring_create("RING 1", swsize, rx_socket, RING_F_SP_ENQ | RING_F_SC_DEQ);
+  if (queue == NULL)
+    rte_exit(EXIT_FAILURE, "Error in creating ring");
+  mem_add_ring(&mem, queue);
+  mem_report(&mem);
+
+  // The ring is single consumer, so one worker dequeues from it, the first
+  // one on the rx node if there is one there
+  static unsigned lcoreid;
+  lcoreid = rte_get_next_lcore(-1, 1, 0);
+  if (lcoreid >= RTE_MAX_LCORE)
+    rte_exit(EXIT_FAILURE, "Need at least one worker lcore\n");
+  unsigned lcore;
+  RTE_LCORE_FOREACH_WORKER(lcore)
   {
-    printf("Lcore starting remote process function\n");
-    rte_eal_remote_launch(process_packets, (void *)&lcoreid, lcoreid);
+    if (rte_lcore_to_socket_id(lcore) == rx_socket)
+    {
+      lcoreid = lcore;
+      break;
+    }
   }
+  worker_remote = rte_lcore_to_socket_id(lcoreid) != rx_socket;
+  if (worker_remote)
+    printf("WARNING: no worker lcore on socket %u, lcore %u is on socket %u\n",
+           rx_socket, lcoreid, rte_lcore_to_socket_id(lcoreid));
+  printf("Lcore starting remote process function\n");
+  start_tsc = rte_rdtsc();
+  rte_eal_remote_launch(process_packets, (void *)&lcoreid, lcoreid);
+
+  rte_telemetry_register_cmd("/simple_rx/stats", telemetry_stats,
+                             "Returns packet counters summed over lcores");
+  if (stats_thread_start(timer_period, print_stats, &is_stop) != 0)
+    rte_exit(EXIT_FAILURE, "Cannot start stats thread\n");
 
   rx_packets();
 
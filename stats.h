@@ -0,0 +1,308 @@
+/*
+ * Per-lcore counters and the reporting simple_rx, packet_copy and
+ * rss_scaling share.
+ *
+ * Every lcore owns a cache aligned block of uint64_t counters and is its
+ * only writer: stats_add() publishes with a relaxed store and the reporting
+ * threads read with relaxed loads, so no counter line is shared between
+ * packet lcores. A program lists its counters in a table of stats_field,
+ * from which stats_sum_lcores() adds up the blocks and stats_telemetry()
+ * fills a telemetry dict.
+ *
+ * The rest is the reporting around them: log-linear latency histograms,
+ * per-port and per-queue rates with the drop related xstats, the control
+ * thread printing every period and the SUMMARY line bench.sh reads.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_telemetry.h>
+
+#define XSTATS_MAX 16  /**< Drop related xstats tracked per port */
+#define L1_OVERHEAD 24 /**< Preamble, SFD, IFG and the CRC left out of ibytes */
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/* Single writer, so a relaxed store is enough for readers to see whole values */
+static inline void stats_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stats_read(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* A counter of a per-lcore block: summed over lcores, or their maximum */
+struct stats_field {
+  const char *name; /* telemetry key */
+  size_t off;
+  int max;
+};
+
+#define STATS_FIELD(type, member) {#member, offsetof(type, member), 0}
+#define STATS_FIELD_AS(name, type, member) {name, offsetof(type, member), 0}
+#define STATS_FIELD_MAX(name, type, member) {name, offsetof(type, member), 1}
+
+static inline uint64_t *stats_field_ptr(void *block,
+                                        const struct stats_field *f) {
+  return (uint64_t *)((char *)block + f->off);
+}
+
+/* Adds up the size byte blocks of every lcore into sum */
+static inline void stats_sum_lcores(void *sum, const void *blocks, size_t size,
+                                    const struct stats_field *fields,
+                                    unsigned nb_fields) {
+  unsigned lcore;
+  memset(sum, 0, size);
+  RTE_LCORE_FOREACH(lcore) {
+    void *st = (char *)(uintptr_t)blocks + (size_t)lcore * size;
+    for (unsigned i = 0; i < nb_fields; i++) {
+      uint64_t *s = stats_field_ptr(sum, &fields[i]);
+      const uint64_t v = stats_read(stats_field_ptr(st, &fields[i]));
+      *s = fields[i].max ? RTE_MAX(*s, v) : *s + v;
+    }
+  }
+}
+
+/* A summed block as a telemetry dict, one key per field */
+static inline void stats_telemetry(struct rte_tel_data *d, const void *sum,
+                                   const struct stats_field *fields,
+                                   unsigned nb_fields) {
+  rte_tel_data_start_dict(d);
+  for (unsigned i = 0; i < nb_fields; i++)
+    rte_tel_data_add_dict_u64(
+        d, fields[i].name,
+        *stats_field_ptr((void *)(uintptr_t)sum, &fields[i]));
+}
+
+/* Seconds since the previous call, 0 on the first */
+static inline double stats_interval(void) {
+  static uint64_t last_tsc;
+  const uint64_t now = rte_get_timer_cycles();
+  const double dt =
+      last_tsc ? (double)(now - last_tsc) / rte_get_timer_hz() : 0;
+  last_tsc = now;
+  return dt;
+}
+
+/*
+ * Log-linear latency histogram in TSC cycles: exact below
+ * 2^HIST_SUB_BITS, then 2^HIST_SUB_BITS buckets per power of two.
+ */
+struct latency_hist {
+  uint64_t count[HIST_BUCKETS];
+  uint64_t max;
+};
+
+static inline unsigned hist_bucket(uint64_t v) {
+  if (v < (1u << HIST_SUB_BITS)) return v;
+  unsigned e = 63 - __builtin_clzll(v);
+  return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+         ((v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+/* Largest value that falls into bucket b */
+static inline uint64_t hist_bucket_max(unsigned b) {
+  if (b < (1u << HIST_SUB_BITS)) return b;
+  unsigned e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  uint64_t width = 1ULL << (e - HIST_SUB_BITS);
+  return (1ULL << e) + (b & ((1u << HIST_SUB_BITS) - 1)) * width + width - 1;
+}
+
+/* Owning lcore only */
+static inline void hist_add(struct latency_hist *h, uint64_t v) {
+  stats_add(&h->count[hist_bucket(v)], 1);
+  if (unlikely(v > h->max)) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+static inline void hist_merge(struct latency_hist *sum,
+                              const struct latency_hist *h) {
+  for (unsigned b = 0; b < HIST_BUCKETS; b++)
+    sum->count[b] += stats_read(&h->count[b]);
+  sum->max = RTE_MAX(sum->max, stats_read(&h->max));
+}
+
+static inline void hist_print(const char *name, const struct latency_hist *h) {
+  static const double pct[] = {0.5, 0.99, 0.999};
+  double us[RTE_DIM(pct)] = {0};
+  double cycles_per_us = rte_get_tsc_hz() / 1e6;
+  uint64_t n = 0, seen = 0;
+  unsigned b, i = 0;
+
+  for (b = 0; b < HIST_BUCKETS; b++) n += h->count[b];
+  if (n == 0) return;
+  for (b = 0; b < HIST_BUCKETS && i < RTE_DIM(pct); b++) {
+    seen += h->count[b];
+    while (i < RTE_DIM(pct) && seen >= pct[i] * n)
+      us[i++] = hist_bucket_max(b) / cycles_per_us;
+  }
+  printf("%s latency (us): p50 %.1f \t p99 %.1f \t p99.9 %.1f \t max %.1f\n",
+         name, us[0], us[1], us[2], h->max / cycles_per_us);
+}
+
+/* Merges the histogram at off of every lcore's size byte block and prints it */
+static inline void hist_print_lcores(const char *name, const void *blocks,
+                                     size_t size, size_t off) {
+  static struct latency_hist sum;
+  unsigned lcore;
+
+  memset(&sum, 0, sizeof(sum));
+  RTE_LCORE_FOREACH(lcore)
+    hist_merge(&sum, (const struct latency_hist *)((const char *)blocks +
+                                                    (size_t)lcore * size + off));
+  hist_print(name, &sum);
+}
+
+/* Last print_port_rates() snapshot, rates are deltas over the interval */
+struct port_rates {
+  struct rte_eth_stats last;
+  unsigned nb_xstats;
+  uint64_t xstats_ids[XSTATS_MAX];
+  uint64_t xstats_last[XSTATS_MAX];
+  char xstats_names[XSTATS_MAX][RTE_ETH_XSTATS_NAME_SIZE];
+};
+static struct port_rates port_rates[RTE_MAX_ETHPORTS];
+
+/* xstats whose names contain one of these are reported as rates */
+static const char *const xstats_watch[] = {"nombuf", "no_buf", "missed",
+                                           "drop", "discard", "no_dma"};
+
+/* Remember the ids of the drop related xstats the PMD exposes */
+static inline void xstats_select(uint16_t port) {
+  struct port_rates *r = &port_rates[port];
+  int n = rte_eth_xstats_get_names(port, NULL, 0);
+  if (n <= 0) return;
+
+  struct rte_eth_xstat_name *names = malloc(sizeof(*names) * n);
+  if (names == NULL || rte_eth_xstats_get_names(port, names, n) != n) {
+    free(names);
+    return;
+  }
+  for (int i = 0; i < n && r->nb_xstats < XSTATS_MAX; i++) {
+    for (unsigned w = 0; w < RTE_DIM(xstats_watch); w++) {
+      if (strstr(names[i].name, xstats_watch[w]) == NULL) continue;
+      r->xstats_ids[r->nb_xstats] = i;
+      snprintf(r->xstats_names[r->nb_xstats], RTE_ETH_XSTATS_NAME_SIZE, "%s",
+               names[i].name);
+      r->nb_xstats++;
+      break;
+    }
+  }
+  free(names);
+}
+
+/* Port and per-queue rates since the last call, dt in seconds */
+static inline void print_port_rates(uint16_t port,
+                                    const struct rte_eth_stats *st, double dt) {
+  struct port_rates *r = &port_rates[port];
+  const struct rte_eth_stats *l = &r->last;
+  uint64_t xstats[XSTATS_MAX];
+
+  if (dt > 0) {
+    uint64_t pkts = st->ipackets - l->ipackets;
+    uint64_t missed = st->imissed - l->imissed;
+    printf("  %.3f Mpps \t %.3f Gbps (L1) \t missed %.0f/s \t errors %.0f/s"
+           " \t nombuf %.0f/s \t loss %.2f%%\n",
+           pkts / dt / 1e6,
+           (st->ibytes - l->ibytes + pkts * L1_OVERHEAD) * 8 / dt / 1e9,
+           missed / dt, (st->ierrors - l->ierrors) / dt,
+           (st->rx_nombuf - l->rx_nombuf) / dt,
+           pkts + missed ? 100.0 * missed / (pkts + missed) : 0.0);
+
+    struct rte_eth_dev_info dev_info;
+    uint16_t nb_q = 0;
+    if (rte_eth_dev_info_get(port, &dev_info) == 0)
+      nb_q = RTE_MIN(dev_info.nb_rx_queues, RTE_ETHDEV_QUEUE_STAT_CNTRS);
+    for (uint16_t q = 0; nb_q > 1 && q < nb_q; q++)
+      printf("    queue %u: %.3f Mpps \t errors %.0f/s\n", q,
+             (st->q_ipackets[q] - l->q_ipackets[q]) / dt / 1e6,
+             (st->q_errors[q] - l->q_errors[q]) / dt);
+  }
+
+  if (r->nb_xstats > 0 &&
+      rte_eth_xstats_get_by_id(port, r->xstats_ids, xstats, r->nb_xstats) ==
+          (int)r->nb_xstats) {
+    for (unsigned i = 0; i < r->nb_xstats; i++) {
+      if (dt > 0 && xstats[i] != r->xstats_last[i])
+        printf("    %s: %" PRIu64 " (%.0f/s)\n", r->xstats_names[i],
+               xstats[i], (xstats[i] - r->xstats_last[i]) / dt);
+      r->xstats_last[i] = xstats[i];
+    }
+  }
+  r->last = *st;
+}
+
+/* The "Port #" lines of ports 0..nb_ports-1, with their rates over dt seconds */
+static inline void print_ports(uint16_t nb_ports, double dt) {
+  struct rte_eth_stats st;
+
+  for (uint16_t p = 0; p < nb_ports; p++) {
+    rte_eth_stats_get(p, &st);
+    printf("Port #%u: %" PRIu64 " received / %" PRIu64 " errors / %" PRIu64
+           " missed\n",
+           p, st.ipackets, st.ierrors, st.imissed);
+    print_port_rates(p, &st, dt);
+  }
+}
+
+struct stats_thread {
+  uint64_t period; /* seconds */
+  void (*print)(void);
+  const volatile char *stop;
+  pthread_t tid;
+};
+static struct stats_thread stats_ctl;
+
+/* Control thread printing stats every period seconds, off the packet lcores */
+static void *stats_thread(void *arg) {
+  RTE_SET_USED(arg);
+  while (!*stats_ctl.stop) {
+    rte_delay_us_sleep(stats_ctl.period * US_PER_S);
+    stats_ctl.print();
+  }
+  return NULL;
+}
+
+/* A period of 0 starts nothing */
+static inline int stats_thread_start(uint64_t period, void (*print)(void),
+                                     const volatile char *stop) {
+  if (period == 0) return 0;
+  stats_ctl.period = period;
+  stats_ctl.print = print;
+  stats_ctl.stop = stop;
+  return rte_ctrl_thread_create(&stats_ctl.tid, "stats", NULL, stats_thread,
+                                NULL);
+}
+
+/* Final totals on one line for bench.sh, key=value pairs */
+static inline void print_summary(uint64_t start_tsc, uint64_t rx,
+                                 uint64_t processed, uint64_t ring_drops,
+                                 uint64_t alloc_fails) {
+  struct rte_eth_stats st;
+  uint64_t nic_drops = 0;
+  uint16_t portid;
+
+  RTE_ETH_FOREACH_DEV(portid) {
+    if (rte_eth_stats_get(portid, &st) == 0)
+      nic_drops += st.imissed + st.rx_nombuf;
+  }
+  printf("SUMMARY seconds=%.3f tsc_hz=%" PRIu64 " rx=%" PRIu64
+         " processed=%" PRIu64 " ring_drops=%" PRIu64 " alloc_fails=%" PRIu64
+         " nic_drops=%" PRIu64 "\n",
+         start_tsc ? (double)(rte_rdtsc() - start_tsc) / rte_get_tsc_hz() : 0.0,
+         rte_get_tsc_hz(), rx, processed, ring_drops, alloc_fails, nic_drops);
+}
+
+#endif /* STATS_H */